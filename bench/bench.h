@@ -0,0 +1,200 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+//
+// What every benchmark shares. An op is run three ways:
+//
+// - with the allocation counters on, for allocations and bytes per op
+// - timed one by one, for the p50 and p99 latency. The clock's own cost is
+//   measured once and taken off every sample, what remains of it is noise
+//   on ops that take less than ~50 ns.
+// - in a tight loop for BENCH_TARGET_NS, for ns/op
+//
+// Every result is one JSON object per line on stdout, so runs of two
+// commits can be diffed or compared with `bench/compare.sh`:
+//
+//   make -s bench > before.jsonl
+//   git checkout ... && make -s bench > after.jsonl
+//   ./bench/compare.sh before.jsonl after.jsonl
+//
+// Allocations are counted by replacing glibc's `malloc`, `calloc` and
+// `realloc`, and lua states created with `bench_lua_state` allocate through
+// them. Elsewhere they aren't counted and are reported as null.
+//
+#define BENCH_TARGET_NS 200000000ull
+#define BENCH_WARMUP_NS 20000000ull
+#define BENCH_ALLOC_OPS 1000
+#define BENCH_SAMPLES 20000
+
+static uint64_t g_bench_allocs = 0;
+static uint64_t g_bench_bytes = 0;
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#define BENCH_COUNTS_ALLOCS 1
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size) {
+  g_bench_allocs++;
+  g_bench_bytes += size;
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+  g_bench_allocs++;
+  g_bench_bytes += count * size;
+  return __libc_calloc(count, size);
+}
+
+// Only a realloc that needs more than the block holds counts, shrinking
+// and growing into slack is free
+void* realloc(void* ptr, size_t size) {
+  if (!ptr || malloc_usable_size(ptr) < size) {
+    g_bench_allocs++;
+    g_bench_bytes += size;
+  }
+  return __libc_realloc(ptr, size);
+}
+#else
+#define BENCH_COUNTS_ALLOCS 0
+#endif
+
+struct bench_result {
+  const char* bench;
+  const char* name;
+  const char* fixture;
+  uint64_t ops;
+  double ns_op;
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+  double allocs_op;
+  double bytes_op;
+};
+
+typedef void (bench_op)(void* context);
+
+static inline uint64_t bench_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void* bench_lua_alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+  if (nsize == 0) {
+    free(ptr);
+    return NULL;
+  }
+  return realloc(ptr, nsize);
+}
+
+// LuaJIT builds without GC64 only run on their own allocator, their lua
+// allocations go uncounted
+static inline lua_State* bench_lua_state() {
+  lua_State* L = lua_newstate(bench_lua_alloc, NULL);
+  if (L) return L;
+  return luaL_newstate();
+}
+
+static inline char* bench_read_file(const char* path, uint32_t* length) {
+  FILE* file = fopen(path, "rb");
+  if (!file) return NULL;
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char* contents = malloc(size + 1);
+  if (fread(contents, 1, size, file) != (size_t)size) {
+    free(contents);
+    fclose(file);
+    return NULL;
+  }
+  contents[size] = '\0';
+  *length = size;
+  fclose(file);
+  return contents;
+}
+
+static inline const char* bench_basename(const char* path) {
+  const char* slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+static int bench_compare_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Fixture names come from file names and literals, nothing needs escaping
+static inline void bench_report(struct bench_result* result) {
+  printf("{\"bench\":\"%s\",\"case\":\"%s\",\"fixture\":\"%s\",\"ops\":%llu,"
+         "\"ns_op\":%.1f,\"p50_ns\":%llu,\"p99_ns\":%llu,",
+         result->bench, result->name, result->fixture ? result->fixture : "",
+         (unsigned long long)result->ops, result->ns_op,
+         (unsigned long long)result->p50_ns, (unsigned long long)result->p99_ns);
+
+  if (BENCH_COUNTS_ALLOCS) {
+    printf("\"allocs_op\":%.2f,\"bytes_op\":%.1f}\n", result->allocs_op, result->bytes_op);
+  } else {
+    printf("\"allocs_op\":null,\"bytes_op\":null}\n");
+  }
+  fflush(stdout);
+}
+
+// The cheapest back to back reading of the clock
+static inline uint64_t bench_clock_cost() {
+  uint64_t cost = UINT64_MAX;
+  for (int i = 0; i < 1000; i++) {
+    uint64_t start = bench_now_ns();
+    uint64_t elapsed = bench_now_ns() - start;
+    if (elapsed < cost) cost = elapsed;
+  }
+  return cost;
+}
+
+static inline void bench_run(const char* bench, const char* name, const char* fixture, bench_op* op, void* context) {
+  static uint64_t samples[BENCH_SAMPLES];
+  struct bench_result result = { bench, name, fixture };
+
+  // interned strings, table slots and traces are in place afterwards
+  uint64_t warm = bench_now_ns() + BENCH_WARMUP_NS;
+  while (bench_now_ns() < warm) op(context);
+
+  uint64_t allocs = g_bench_allocs, bytes = g_bench_bytes;
+  for (int i = 0; i < BENCH_ALLOC_OPS; i++) op(context);
+  result.allocs_op = (double)(g_bench_allocs - allocs) / BENCH_ALLOC_OPS;
+  result.bytes_op = (double)(g_bench_bytes - bytes) / BENCH_ALLOC_OPS;
+
+  uint64_t clock_cost = bench_clock_cost();
+  uint32_t count = 0;
+  uint64_t end = bench_now_ns() + BENCH_TARGET_NS / 2;
+  while (count < BENCH_SAMPLES && bench_now_ns() < end) {
+    uint64_t start = bench_now_ns();
+    op(context);
+    uint64_t elapsed = bench_now_ns() - start;
+    samples[count++] = elapsed > clock_cost ? elapsed - clock_cost : 0;
+  }
+  qsort(samples, count, sizeof(uint64_t), bench_compare_u64);
+  result.p50_ns = samples[count / 2];
+  result.p99_ns = samples[count * 99 / 100];
+
+  uint64_t start = bench_now_ns(), elapsed = 0;
+  while (elapsed < BENCH_TARGET_NS) {
+    for (int i = 0; i < 16; i++) op(context);
+    result.ops += 16;
+    elapsed = bench_now_ns() - start;
+  }
+  result.ns_op = (double)elapsed / result.ops;
+
+  bench_report(&result);
+}
@@ -0,0 +1,223 @@
+//
+// Measures everything a command goes through on its way out: yabai's
+// `generate_message`, the `sketchybar()` formatter with and without the
+// shadow model, and the lua side from `sb.setv`, `sb.set` and `sb.item`
+// with config tables down to the stand-in transport. `sb.query` is answered
+// with a recorded item query and decoded.
+//
+//   make bench
+//   ./bench/command_bench bench/fixtures/bar_config.lua bench/fixtures/sketchybar_item.json
+//
+#define main sb_helper_main
+#include "../helper.c"
+#undef main
+#include "bench.h"
+#include "transport_bench.h"
+
+struct command_case {
+  const char* message;
+  const char* alternate;
+  uint32_t length;
+  bool flip;
+};
+
+// One op applies every item of the fixture in a single batch
+static const char* g_config_calls =
+  "local sb = sketchybar\n"
+  "local items = dofile(...)\n"
+  "function apply_items()\n"
+  "  sb.batch(function()\n"
+  "    for i = 1, #items do sb.item(items[i].name, items[i].config) end\n"
+  "  end)\n"
+  "end\n"
+  "function apply_sets()\n"
+  "  sb.batch(function()\n"
+  "    for i = 1, #items do sb.set(items[i].name, items[i].config) end\n"
+  "  end)\n"
+  "end\n"
+  "function apply_setv()\n"
+  "  sb.setv('clock', 'label', 'Fri 17 Oct 12:34', 'icon.color', 0xffcad3f5)\n"
+  "end\n"
+  "function query_item()\n"
+  "  local item = sb.query('front_app')\n"
+  "  return item.geometry.background.color\n"
+  "end\n";
+
+static void yabai_message(void* context) {
+  struct command_case* command = context;
+  char* message;
+  generate_message(command->message, &message);
+  free(message);
+}
+
+// Only formatted, the transaction is never committed
+static void format(void* context) {
+  struct command_case* command = context;
+  g_cmd.length = 0;
+  sketchybar((char*)command->message);
+}
+
+// `alternate` makes every other set change the value
+static void format_send(void* context) {
+  struct command_case* command = context;
+  const char* message = command->message;
+  if (command->alternate && (command->flip = !command->flip)) message = command->alternate;
+  sketchybar((char*)message);
+}
+
+static void format_send_argv(void* context) {
+  struct command_case* command = context;
+  sketchybar_argv(command->message, command->length);
+}
+
+static void call(void* context) {
+  lua_getglobal(Lg, (const char*)context);
+  if (lua_pcall(Lg, 0, 0, 0)) {
+    fprintf(stderr, "%s: %s\n", (const char*)context, lua_tostring(Lg, -1));
+    exit(1);
+  }
+}
+
+static void bench_yabai() {
+  struct command_case query = { "query --windows --space 3" };
+  struct command_case focus = { "window --focus east" };
+  bench_run("command", "generate_message", "query --windows --space 3", yabai_message, &query);
+  bench_run("command", "generate_message", "window --focus east", yabai_message, &focus);
+}
+
+static void bench_sketchybar() {
+  static const char clock[] = "--set clock label=\"Fri 17 Oct 12:34\" icon=󰥔 "
+                              "icon.color=0xffcad3f5 label.font=\"SF Pro:Semibold:13.0\"";
+  static const char clock_next[] = "--set clock label=\"Fri 17 Oct 12:35\" icon=󰥔 "
+                                   "icon.color=0xffcad3f5 label.font=\"SF Pro:Semibold:13.0\"";
+  static const char spaces[] = "--set space.1 background.drawing=off --set space.2 "
+                               "background.drawing=off --set space.3 background.drawing=on "
+                               "label.color=0xff24273a --set space.4 background.drawing=off";
+  static const char clock_argv[] = "--set\0clock\0label=Fri 17 Oct 12:34\0icon=󰥔\0"
+                                   "icon.color=0xffcad3f5\0label.font=SF Pro:Semibold:13.0\0";
+
+  struct command_case clock_case = { clock };
+  struct command_case spaces_case = { spaces };
+  struct command_case changing_case = { clock, clock_next };
+  struct command_case argv_case = { clock_argv, NULL, sizeof(clock_argv) - 1 };
+
+  g_command_filter = NULL;
+  transaction_create();
+  bench_run("command", "format", "clock", format, &clock_case);
+  bench_run("command", "format", "spaces", format, &spaces_case);
+  transaction_commit();
+
+  bench_run("command", "sketchybar", "clock", format_send, &clock_case);
+  bench_run("command", "sketchybar_argv", "clock", format_send_argv, &argv_case);
+
+  g_command_filter = &g_shadow;
+  shadow_reset();
+  bench_run("command", "shadow_unchanged", "clock", format_send, &clock_case);
+  bench_run("command", "shadow_changed", "clock", format_send, &changing_case);
+  bench_run("command", "shadow_unchanged", "spaces", format_send, &spaces_case);
+}
+
+// A set only counts once it reached the bar: one that failed goes out
+// again, and so does everything after the connection was lost
+static void check_shadow() {
+  char set[] = "--set check label=a";
+  g_command_filter = &g_shadow;
+  shadow_reset();
+
+  g_bench_down = true;
+  sketchybar(set);
+  g_bench_down = false;
+
+  g_bench_last = NULL;
+  sketchybar(set);
+  bool resent = transport_bench_sent_arg("label=a");
+
+  g_bench_last = NULL;
+  sketchybar(set);
+  bool suppressed = g_bench_last == NULL;
+
+  transport_epoch_advance();
+  sketchybar(set);
+  bool reset = transport_bench_sent_arg("label=a");
+
+  if (!resent || !suppressed || !reset) {
+    fprintf(stderr, "shadow: %s\n", !resent ? "failed set was recorded"
+                                   : !suppressed ? "posted set wasn't recorded"
+                                   : "kept across a new epoch");
+    exit(1);
+  }
+}
+
+// A string config has to reach the bar split into its properties, with
+// quotes around values that have spaces
+static void check_string_config() {
+  if (luaL_dostring(Lg, "sketchybar.item('check', \"label=hi icon='a b' width=12\")") != 0) {
+    fprintf(stderr, "string config: %s\n", lua_tostring(Lg, -1));
+    exit(1);
+  }
+  if (!transport_bench_sent_arg("label=hi")
+      || !transport_bench_sent_arg("icon=a b")
+      || !transport_bench_sent_arg("width=12")) {
+    fprintf(stderr, "string config: not sent as separate properties\n");
+    exit(1);
+  }
+}
+
+static void bench_lua(const char* config, const char* query, const char* reply) {
+  if (luaL_loadstring(Lg, g_config_calls) != 0) {
+    fprintf(stderr, "%s\n", lua_tostring(Lg, -1));
+    exit(1);
+  }
+  lua_pushstring(Lg, config);
+  if (lua_pcall(Lg, 1, 0, 0) != 0) {
+    fprintf(stderr, "%s\n", lua_tostring(Lg, -1));
+    exit(1);
+  }
+
+  // every set has to reach the serializer and the transport, sb.shadow has
+  // its own cases above
+  shadow_set_enabled(false);
+  check_string_config();
+  const char* fixture = bench_basename(config);
+  bench_run("command", "sb.item", fixture, call, "apply_items");
+  bench_run("command", "sb.set", fixture, call, "apply_sets");
+  bench_run("command", "sb.setv", "clock", call, "apply_setv");
+  shadow_set_enabled(true);
+
+  g_bench_reply = (char*)reply;
+  bench_run("command", "sb.query", bench_basename(query), call, "query_item");
+  g_bench_reply = "";
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s bar_config.lua sketchybar_item.json\n", argv[0]);
+    return 1;
+  }
+
+  uint32_t length;
+  char* reply = bench_read_file(argv[2], &length);
+  if (!reply) {
+    fprintf(stderr, "Could not read %s\n", argv[2]);
+    return 1;
+  }
+
+  // no user config, everything sent goes to the stand-in
+  setenv("CONFIG_DIR", "/nonexistent", 1);
+  transport_bench_use();
+  Lg = bench_lua_state();
+  luaL_openlibs(Lg);
+  if (luaL_load_sketchybar(Lg) != 0) {
+    fprintf(stderr, "%s\n", lua_tostring(Lg, -1));
+    return 1;
+  }
+
+  check_shadow();
+  bench_yabai();
+  bench_sketchybar();
+  bench_lua(argv[1], argv[2], reply);
+
+  lua_close(Lg);
+  free(reply);
+  return 0;
+}
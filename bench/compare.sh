@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Lines up two `make -s bench` runs by bench, case and fixture and prints
+# how ns/op, p99 and allocations per op changed.
+#
+#   ./bench/compare.sh before.jsonl after.jsonl
+#
+if [ $# -ne 2 ]; then
+  echo "usage: $0 before.jsonl after.jsonl" >&2
+  exit 1
+fi
+
+awk '
+function field(line, name,    rest) {
+  if (!match(line, "\"" name "\":(\"[^\"]*\"|[^,}]*)")) return ""
+  rest = substr(line, RSTART + length(name) + 3, RLENGTH - length(name) - 3)
+  gsub(/"/, "", rest)
+  return rest
+}
+function change(before, after) {
+  if (before == "" || after == "" || before == "null" || after == "null") return "-"
+  if (before + 0 == 0) return after + 0 == 0 ? "0%" : "new"
+  return sprintf("%+.1f%%", (after - before) * 100 / before)
+}
+/^\{/ {
+  key = field($0, "bench") " " field($0, "case") " " field($0, "fixture")
+  if (FNR == NR) {
+    ns[key] = field($0, "ns_op"); p99[key] = field($0, "p99_ns"); allocs[key] = field($0, "allocs_op")
+    next
+  }
+  if (!(key in ns)) {
+    printf "%-64s %s\n", key, "only in " FILENAME
+    next
+  }
+  printf "%-64s %10s -> %10s ns/op %8s   p99 %8s   allocs %s -> %s\n", key,
+         ns[key], field($0, "ns_op"), change(ns[key], field($0, "ns_op")),
+         change(p99[key], field($0, "p99_ns")), allocs[key], field($0, "allocs_op")
+}
+' "$1" "$2"
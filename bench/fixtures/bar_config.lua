@@ -0,0 +1,38 @@
+--
+-- The item configs of an 80 item bar, the way a larger config sets them up
+--
+local items = {}
+for i = 1, 80 do
+  items[i] = {
+    name = "item." .. i,
+    config = {
+      icon = {
+        string = "󰀵",
+        font = "Hack Nerd Font:Bold:17.0",
+        color = 0xffcad3f5,
+        padding = { left = 8, right = 4 },
+        highlight = { color = 0xffed8796 },
+      },
+      label = {
+        "Item " .. i,
+        font = "SF Pro:Semibold:13.0",
+        color = 0xffcad3f5,
+        padding = { left = 4, right = 8 },
+        drawing = i % 2 == 0,
+      },
+      background = {
+        color = 0xff24273a,
+        corner_radius = 9,
+        height = 26,
+        border_color = 0xff494d64,
+        border_width = 1,
+      },
+      padding = { left = 3, right = 3 },
+      script = "~/.config/sketchybar/plugins/item.sh",
+      updates = "when_shown",
+      update_freq = 30,
+    },
+  }
+end
+
+return items
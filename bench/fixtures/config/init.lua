@@ -0,0 +1,7 @@
+--
+-- A config split into modules the way larger ones are: colors and settings
+-- shared by a bar, defaults and a few groups of items
+--
+require("bar")
+require("default")
+require("items")
@@ -0,0 +1,14 @@
+local sb = require("sketchybar")
+local colors = require("colors")
+
+sb.bar({
+  height = 32,
+  color = colors.bar.bg,
+  border_color = colors.bar.border,
+  shadow = true,
+  sticky = true,
+  padding_right = 10,
+  padding_left = 10,
+  blur_radius = 20,
+  topmost = "window",
+})
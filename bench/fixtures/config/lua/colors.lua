@@ -0,0 +1,24 @@
+local colors = {
+  black = 0xff181926,
+  white = 0xffcad3f5,
+  red = 0xffed8796,
+  green = 0xffa6da95,
+  blue = 0xff8aadf4,
+  yellow = 0xffeed49f,
+  orange = 0xfff5a97f,
+  magenta = 0xffc6a0f6,
+  grey = 0xff939ab7,
+  transparent = 0x00000000,
+}
+
+colors.bar = { bg = 0xf0181926, border = 0xff2c2e34 }
+colors.popup = { bg = 0xc02c2e34, border = 0xff7f8490 }
+colors.bg1 = 0xff363944
+colors.bg2 = 0xff414550
+
+function colors.with_alpha(color, alpha)
+  if alpha > 1.0 or alpha < 0.0 then return color end
+  return color % 0x1000000 + math.floor(alpha * 255.0) * 0x1000000
+end
+
+return colors
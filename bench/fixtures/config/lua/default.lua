@@ -0,0 +1,44 @@
+local sb = require("sketchybar")
+local colors = require("colors")
+local settings = require("settings")
+
+sb.defaults({
+  updates = "when_shown",
+  icon = {
+    font = {
+      family = settings.font.text,
+      style = settings.font.style.bold,
+      size = 14.0,
+    },
+    color = colors.white,
+    padding_left = settings.paddings,
+    padding_right = settings.paddings,
+  },
+  label = {
+    font = {
+      family = settings.font.text,
+      style = settings.font.style.semibold,
+      size = 13.0,
+    },
+    color = colors.white,
+    padding_left = settings.paddings,
+    padding_right = settings.paddings,
+  },
+  background = {
+    height = 28,
+    corner_radius = 9,
+    border_width = 2,
+  },
+  popup = {
+    background = {
+      border_width = 2,
+      corner_radius = 9,
+      border_color = colors.popup.border,
+      color = colors.popup.bg,
+      shadow = { drawing = true },
+    },
+    blur_radius = 20,
+  },
+  padding_left = 5,
+  padding_right = 5,
+})
@@ -0,0 +1,17 @@
+local sb = require("sketchybar")
+local colors = require("colors")
+local settings = require("settings")
+
+sb.item("front_app", {
+  display = "active",
+  icon = { drawing = false },
+  label = {
+    font = {
+      style = settings.font.style.bold,
+      size = 12.0,
+    },
+    color = colors.with_alpha(colors.white, 0.8),
+  },
+  updates = true,
+  events = { "front_app_switched" },
+})
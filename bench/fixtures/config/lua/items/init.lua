@@ -0,0 +1,3 @@
+require("items.spaces")
+require("items.front_app")
+require("items.widgets")
@@ -0,0 +1,42 @@
+local sb = require("sketchybar")
+local colors = require("colors")
+local settings = require("settings")
+
+local icons = { "1", "2", "3", "4", "5", "6", "7", "8", "9", "10" }
+
+for i = 1, #icons do
+  sb.space("space." .. i, {
+    space = i,
+    icon = {
+      string = icons[i],
+      padding_left = 15,
+      padding_right = 8,
+      color = colors.white,
+      highlight_color = colors.red,
+    },
+    label = {
+      padding_right = 20,
+      color = colors.grey,
+      highlight_color = colors.white,
+      font = "sketchybar-app-font:Regular:16.0",
+      y_offset = -1,
+    },
+    padding_right = 1,
+    padding_left = 1,
+    background = {
+      color = colors.bg1,
+      border_width = 1,
+      height = 26,
+      border_color = colors.black,
+    },
+    popup = { background = { border_width = 5, border_color = colors.black } },
+  })
+
+  sb.add_item("space.padding." .. i, "left")
+  sb.set("space.padding." .. i, {
+    script = "",
+    width = settings.group_paddings,
+  })
+end
+
+sb.add_bracket("spaces", "/space\\..*/")
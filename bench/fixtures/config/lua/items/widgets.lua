@@ -0,0 +1,39 @@
+local sb = require("sketchybar")
+local colors = require("colors")
+local settings = require("settings")
+
+local widgets = {
+  { name = "widgets.battery", icon = "􀛨", update_freq = 180 },
+  { name = "widgets.volume", icon = "􀊩", update_freq = 0 },
+  { name = "widgets.wifi", icon = "􀙇", update_freq = 30 },
+  { name = "widgets.cpu", icon = "􀧓", update_freq = 2 },
+  { name = "widgets.calendar", icon = "􀉉", update_freq = 30 },
+}
+
+for i, widget in ipairs(widgets) do
+  sb.item(widget.name, {
+    position = "right",
+    update_freq = widget.update_freq,
+    icon = {
+      string = widget.icon,
+      font = {
+        style = settings.font.style.regular,
+        size = 19.0,
+      },
+      color = i % 2 == 0 and colors.blue or colors.green,
+    },
+    label = { font = { family = settings.font.numbers } },
+    background = {
+      color = colors.bg1,
+      border_color = colors.bg2,
+      border_width = 1,
+    },
+  })
+
+  sb.add_bracket(widget.name .. ".bracket", widget.name)
+  sb.set(widget.name .. ".bracket", {
+    background = { color = colors.bg1, border_color = colors.bg2 },
+  })
+  sb.add_item(widget.name .. ".padding", "right")
+  sb.set(widget.name .. ".padding", { width = settings.group_paddings })
+end
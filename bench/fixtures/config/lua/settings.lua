@@ -0,0 +1,10 @@
+return {
+  font = {
+    text = "SF Pro",
+    numbers = "SF Mono",
+    style = { regular = "Regular", semibold = "Semibold", bold = "Bold" },
+  },
+  paddings = 3,
+  group_paddings = 5,
+  icons = "sf-symbols",
+}
@@ -0,0 +1,227 @@
+//
+// Replays recorded events through `handler()` and the way it used to
+// dispatch them, with callbacks that read a couple of fields like most
+// item callbacks do. `handler_lua` is the current handler with callbacks
+// looked up in lua instead of the helper's index, `handler_set` the
+// current one with callbacks that also set their item's label through
+// `sb.set`, which goes through the shadow model to the stand-in transport.
+// One op is one event.
+//
+//   make bench
+//   ./bench/handler_bench bench/fixtures/events.txt
+//
+// The fixture holds one `KEY=VALUE` per line and `%%` between events.
+//
+#define main sb_helper_main
+#include "../helper.c"
+#undef main
+#include "bench.h"
+#include "transport_bench.h"
+
+#define BENCH_MAX_EVENTS 64
+
+// A callback for every event in the fixture and 100 more items on mouse
+// events, registered with the helper and in a table for the dispatch
+// `core.lua` used to do in lua.
+static const char* g_callbacks =
+  "local function callback(item, event, env)\n"
+  "  local info, sender = env.info, env.sender\n"
+  "  if update then update(item, info) end\n"
+  "end\n"
+  "local callbacks = {{}}\n"
+  "local function register(item, event, fn)\n"
+  "  callbacks[item] = callbacks[item] or {}\n"
+  "  callbacks[item][event] = callbacks[item][event] or {}\n"
+  "  table.insert(callbacks[item][event], fn)\n"
+  "  sketchybar.register_callback(item, event, fn)\n"
+  "end\n"
+  "for _, event in ipairs({ 'front_app_switched', 'space_change', 'volume_change',\n"
+  "                        'mouse.entered', 'mouse.clicked', 'routine',\n"
+  "                        'media_change', 'mouse.scrolled' }) do\n"
+  "  for _, item in ipairs({ 'front_app', 'space.3', 'volume', 'apple.logo',\n"
+  "                         'clock', 'media' }) do\n"
+  "    register(item, event, callback)\n"
+  "  end\n"
+  "end\n"
+  "for i = 1, 100 do\n"
+  "  register('item.' .. i, 'mouse.entered', callback)\n"
+  "  register('item.' .. i, 'mouse.exited', callback)\n"
+  "end\n"
+  "\n"
+  "local function dispatch_calls(fns, ...)\n"
+  "  if fns == nil or #fns == 0 then return end\n"
+  "  for _, fn in ipairs(fns) do fn(...) end\n"
+  "end\n"
+  "local function nested_get(tbl, ...)\n"
+  "  local value = tbl\n"
+  "  for i = 1, select('#', ...) do\n"
+  "    value = value[select(i, ...)]\n"
+  "    if value == nil then return nil end\n"
+  "  end\n"
+  "  return value\n"
+  "end\n"
+  "lua_dispatch = function(item, event, env)\n"
+  "  dispatch_calls(callbacks[1], item, event, env)\n"
+  "  dispatch_calls(nested_get(callbacks, item, 1), item, event, env)\n"
+  "  dispatch_calls(nested_get(callbacks, item, event), item, event, env)\n"
+  "end\n"
+  "native_dispatch = sketchybar.callback\n"
+  "local set = sketchybar.set\n"
+  "function set_label(item, info)\n"
+  "  set(item, { label = { string = info, color = 0xffcad3f5 } })\n"
+  "end\n";
+
+// Makes `handler` dispatch through the lua global `name`
+static void use_dispatch(const char* name) {
+  lua_getglobal(Lg, "sketchybar");
+  lua_getglobal(Lg, name);
+  lua_setfield(Lg, -2, "callback");
+  lua_pop(Lg, 1);
+  handler_cache_callback(Lg);
+}
+
+// `handler()` before the fast path
+static void handler_baseline(env env) {
+  uint32_t caret = 0;
+  char* item = "";
+  char* event = "";
+  lua_newtable(Lg);
+  for(;;) {
+    if (!env[caret]) break;
+    char* key = &env[caret];
+    int key_len = strlen(key);
+    char* value = &env[caret + key_len + 1];
+    int value_len = strlen(value);
+
+    for(int i = 0; i < key_len; i++) { key[i] = tolower(key[i]); }
+
+    lua_pushlstring(Lg, key, strlen(key));
+    lua_pushlstring(Lg, value, strlen(value));
+    lua_settable(Lg, -3);
+
+    if (strcmp(key, "name") == 0) {
+      item = value;
+    } else if (strcmp(key, "sender") == 0) {
+      event = value;
+    }
+    caret += key_len + value_len + 2;
+  }
+
+  query_cache_event(Lg, event);
+
+  lua_getglobal(Lg, "sketchybar");
+  lua_getfield(Lg, -1, "callback");
+  if (lua_isfunction(Lg, -1) == 1) {
+    lua_pushlstring(Lg, item, strlen(item));
+    lua_pushlstring(Lg, event, strlen(event));
+    lua_pushvalue(Lg, -5);
+
+    batch_begin();
+    lua_pcall(Lg, 3, 0, 0);
+    batch_end();
+  }
+  lua_settop(Lg, 0);
+}
+
+// Reads the fixture into env blobs, every blob is `length` bytes long
+static uint32_t load_events(const char* path, char** events, uint32_t* length) {
+  FILE* file = fopen(path, "r");
+  if (!file) return 0;
+
+  uint32_t count = 0;
+  char line[4096];
+  char* blob = malloc(4096);
+  uint32_t blob_length = 0;
+  for (;;) {
+    bool end = !fgets(line, sizeof(line), file);
+    line[strcspn(line, "\n")] = '\0';
+
+    if (end || strcmp(line, "%%") == 0) {
+      blob[blob_length++] = '\0';
+      events[count] = blob;
+      length[count++] = blob_length;
+      if (end || count == BENCH_MAX_EVENTS) break;
+      blob = malloc(4096);
+      blob_length = 0;
+      continue;
+    }
+
+    char* equals = strchr(line, '=');
+    if (!equals || blob_length + strlen(line) + 2 >= 4096) continue;
+    *equals = '\0';
+    blob_length += sprintf(blob + blob_length, "%s", line) + 1;
+    blob_length += sprintf(blob + blob_length, "%s", equals + 1) + 1;
+  }
+
+  fclose(file);
+  return count;
+}
+
+struct handler_case {
+  void (*dispatch)(env);
+  char* events[BENCH_MAX_EVENTS];
+  uint32_t count;
+  uint32_t next;
+};
+
+static void dispatch_next(void* context) {
+  struct handler_case* handler_case = context;
+  handler_case->dispatch(handler_case->events[handler_case->next]);
+  if (++handler_case->next == handler_case->count) handler_case->next = 0;
+}
+
+static void run(const char* name, const char* fixture, void (*dispatch)(env), char** events, uint32_t* length, uint32_t count) {
+  // the baseline lower-cases keys in place, so every case works on its own
+  // copy
+  struct handler_case handler_case = { dispatch, { NULL }, count, 0 };
+  for (uint32_t i = 0; i < count; i++) {
+    handler_case.events[i] = malloc(length[i]);
+    memcpy(handler_case.events[i], events[i], length[i]);
+  }
+
+  bench_run("handler", name, fixture, dispatch_next, &handler_case);
+
+  for (uint32_t i = 0; i < count; i++) free(handler_case.events[i]);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s events.txt\n", argv[0]);
+    return 1;
+  }
+
+  char* events[BENCH_MAX_EVENTS];
+  uint32_t length[BENCH_MAX_EVENTS];
+  uint32_t count = load_events(argv[1], events, length);
+  if (count == 0) {
+    fprintf(stderr, "%s: no events\n", argv[1]);
+    return 1;
+  }
+
+  // no user config, everything sent goes to the stand-in
+  setenv("CONFIG_DIR", "/nonexistent", 1);
+  transport_bench_use();
+  g_command_filter = &g_shadow;
+  Lg = bench_lua_state();
+  luaL_openlibs(Lg);
+  if (luaL_load_sketchybar(Lg) != 0 || luaL_dostring(Lg, g_callbacks)) {
+    fprintf(stderr, "%s\n", lua_tostring(Lg, -1));
+    return 1;
+  }
+
+  const char* fixture = bench_basename(argv[1]);
+  use_dispatch("lua_dispatch");
+  run("baseline", fixture, handler_baseline, events, length, count);
+  run("handler_lua", fixture, handler, events, length, count);
+  use_dispatch("native_dispatch");
+  run("handler", fixture, handler, events, length, count);
+
+  // the same label every time, after the first event only the shadow model
+  // sees it
+  lua_getglobal(Lg, "set_label");
+  lua_setglobal(Lg, "update");
+  run("handler_set", fixture, handler, events, length, count);
+
+  lua_close(Lg);
+  return 0;
+}
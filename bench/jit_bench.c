@@ -0,0 +1,147 @@
+//
+// Runs the lua hot paths with the trace compiler watching: a callback that
+// reads the env and sets its item, `sb.set` and `sb.setv` on their own and
+// a loop setting 16 items in one batch. Everything sent goes to the
+// stand-in transport with the shadow model off.
+//
+// Next to the usual result every case prints the traces it recorded to
+// stderr, how many of them had to be stitched around a C function and how
+// many were aborted, and why, for the whole run and once more for ops
+// after it. With
+// LuaJIT's `jit.*` modules on the package path `-v` hands the trace log to
+// `jit.v` as well.
+//
+//   make bench/jit_bench
+//   ./bench/jit_bench [-v]
+//
+#define main sb_helper_main
+#include "../helper.c"
+#undef main
+#include <luajit.h>
+#include "bench.h"
+#include "transport_bench.h"
+
+#define BENCH_WARM_OPS 10000
+
+static const char* g_workloads =
+  "local sb = sketchybar\n"
+  "local labels = { 'Fri 17 Oct 12:34', 'Fri 17 Oct 12:35' }\n"
+  "local flip = 1\n"
+  "sb.item('clock', { subscribe = { routine = function(item, event, env)\n"
+  "  local info, sender = env.info, env.sender\n"
+  "  sb.set(item, { label = { string = info, color = 0xffcad3f5 }, icon = sender })\n"
+  "end } })\n"
+  "function set_clock()\n"
+  "  flip = 3 - flip\n"
+  "  sb.set('clock', { label = { string = labels[flip], color = 0xffcad3f5 },\n"
+  "                    icon = { drawing = true, padding_left = 4 } })\n"
+  "end\n"
+  "function setv_clock()\n"
+  "  flip = 3 - flip\n"
+  "  sb.setv('clock', 'label', labels[flip], 'icon.color', 0xffcad3f5)\n"
+  "end\n"
+  "local items = {}\n"
+  "for i = 1, 16 do\n"
+  "  items[i] = { name = 'space.' .. i, config = {\n"
+  "    icon = { string = tostring(i), color = 0xff24273a },\n"
+  "    background = { drawing = i % 2 == 0, corner_radius = 6 } } }\n"
+  "end\n"
+  "local function set_items()\n"
+  "  for i = 1, #items do sb.set(items[i].name, items[i].config) end\n"
+  "end\n"
+  "function set_spaces()\n"
+  "  sb.batch(set_items)\n"
+  "end\n"
+  "\n"
+  "local util = require('jit.util')\n"
+  "local ok, vmdef = pcall(require, 'jit.vmdef')\n"
+  "local traces, stitched, aborts, reasons = 0, 0, 0, {}\n"
+  "jit.attach(function(what, tr, func, pc, code, info)\n"
+  "  if what == 'stop' then\n"
+  "    traces = traces + 1\n"
+  "    if util.traceinfo(tr).linktype == 'stitch' then stitched = stitched + 1 end\n"
+  "  elseif what == 'abort' then\n"
+  "    aborts = aborts + 1\n"
+  "    local reason = ok and vmdef.traceerr[code] or ('error ' .. tostring(code))\n"
+  "    if ok and type(info) == 'number' then reason = string.format(reason, info)\n"
+  "    elseif info ~= nil then reason = reason .. ' (' .. tostring(info) .. ')' end\n"
+  "    reason = reason .. ' at ' .. util.funcinfo(func, pc).loc\n"
+  "    reasons[reason] = (reasons[reason] or 0) + 1\n"
+  "  end\n"
+  "end, 'trace')\n"
+  "function trace_stats(name)\n"
+  "  if not name then traces, stitched, aborts, reasons = 0, 0, 0, {} return end\n"
+  "  local out = { string.format('%s: %d traces, %d stitched, %d aborted',\n"
+  "                             name, traces, stitched, aborts) }\n"
+  "  for reason, count in pairs(reasons) do\n"
+  "    table.insert(out, string.format('  %4d x %s', count, reason))\n"
+  "  end\n"
+  "  io.stderr:write(table.concat(out, '\\n'), '\\n')\n"
+  "  traces, stitched, aborts, reasons = 0, 0, 0, {}\n"
+  "end\n";
+
+static void call(void* context) {
+  lua_getglobal(Lg, (const char*)context);
+  if (lua_pcall(Lg, 0, 0, 0)) {
+    fprintf(stderr, "%s: %s\n", (const char*)context, lua_tostring(Lg, -1));
+    exit(1);
+  }
+}
+
+// The handler lower-cases the keys in place, it's the same every time after
+static char g_event[] = "NAME\0clock\0SENDER\0routine\0INFO\0Fri 17 Oct 12:34\0"
+                        "CONFIG_DIR\0/Users/me/.config/sketchybar\0"
+                        "BAR_NAME\0sketchybar\0";
+
+static void dispatch(void* context) {
+  handler(g_event);
+}
+
+// Prints what was counted under `name` and starts over, NULL only starts over
+static void trace_stats(const char* name) {
+  lua_getglobal(Lg, "trace_stats");
+  if (name) lua_pushstring(Lg, name);
+  else lua_pushnil(Lg);
+  lua_pcall(Lg, 1, 0, 0);
+}
+
+// Every case starts without traces, they'd be shared with the one before.
+// Aborts while the trace tree for a case grows are normal, once it's done
+// growing there should be none: another BENCH_WARM_OPS run is counted on
+// its own.
+static void run(const char* name, bench_op* op, void* context) {
+  luaJIT_setmode(Lg, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_FLUSH);
+  trace_stats(NULL);
+  bench_run("jit", name, NULL, op, context);
+  trace_stats(name);
+
+  for (uint32_t i = 0; i < BENCH_WARM_OPS; i++) op(context);
+  char warm[64];
+  snprintf(warm, sizeof(warm), "%s (warm)", name);
+  trace_stats(warm);
+}
+
+int main(int argc, char** argv) {
+  bool verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+
+  // no user config, everything sent goes to the stand-in
+  setenv("CONFIG_DIR", "/nonexistent", 1);
+  transport_bench_use();
+  Lg = bench_lua_state();
+  luaL_openlibs(Lg);
+  if (luaL_load_sketchybar(Lg) != 0
+      || (verbose && luaL_dostring(Lg, "require('jit.v').start()"))
+      || luaL_dostring(Lg, g_workloads)) {
+    fprintf(stderr, "%s\n", lua_tostring(Lg, -1));
+    return 1;
+  }
+  shadow_set_enabled(false);
+
+  run("callback", dispatch, NULL);
+  run("sb.set", call, "set_clock");
+  run("sb.setv", call, "setv_clock");
+  run("sb.set_batch", call, "set_spaces");
+
+  lua_close(Lg);
+  return 0;
+}
@@ -0,0 +1,209 @@
+//
+// Compares the old cJSON tree round trip against `json_decode`, the lazy
+// proxies and `json_to_lua_table` on recorded query payloads.
+//
+//   make bench
+//   ./bench/json_bench bench/fixtures/*.json
+//
+#include <lualib.h>
+#include <cJSON.h>
+#include "../json.h"
+#include "../parsing.h"
+#include "bench.h"
+
+//
+// The decoder parsing.c used before json.c, kept as the baseline
+//
+
+static void cjson_object_to_lua_table(lua_State* state, cJSON* json);
+
+static void cjson_push_item(lua_State* state, cJSON* item);
+
+static void cjson_array_to_lua_table(lua_State* state, cJSON* json) {
+  int i = 1;
+  cJSON* item;
+  lua_newtable(state);
+  cJSON_ArrayForEach(item, json) {
+    cjson_push_item(state, item);
+    lua_rawseti(state, -2, i);
+    i++;
+  }
+}
+
+static void cjson_object_to_lua_table(lua_State* state, cJSON* json) {
+  lua_newtable(state);
+  cJSON* item;
+  cJSON_ArrayForEach(item, json) {
+    lua_pushstring(state, item->string);
+    cjson_push_item(state, item);
+    lua_settable(state, -3);
+  }
+}
+
+static void cjson_push_item(lua_State* state, cJSON* item) {
+  switch (item->type) {
+    case cJSON_Number: lua_pushnumber(state, item->valuedouble); break;
+    case cJSON_String: lua_pushstring(state, item->valuestring); break;
+    case cJSON_Array: cjson_array_to_lua_table(state, item); break;
+    case cJSON_Object: cjson_object_to_lua_table(state, item); break;
+    case cJSON_True: lua_pushboolean(state, true); break;
+    case cJSON_False: lua_pushboolean(state, false); break;
+    default: lua_pushnil(state); break;
+  }
+}
+
+static bool cjson_to_lua_table(lua_State* state, const char* json_str, uint32_t len) {
+  cJSON* json = cJSON_Parse(json_str);
+  if (!json) return false;
+  cjson_push_item(state, json);
+  cJSON_Delete(json);
+  return true;
+}
+
+// A typical callback: parse lazily and read a single field of the first
+// element
+static bool lazy_first_field(lua_State* state, const char* json_str, uint32_t len) {
+  if (!json_decode_lazy(state, json_str, len)) return false;
+  lua_pushinteger(state, 1);
+  lua_gettable(state, -2);
+  if (lua_isuserdata(state, -1)) lua_getfield(state, -1, "id");
+  return true;
+}
+
+// What `sb.json_parse` goes through, the length is measured on every call
+static bool to_lua_table(lua_State* state, const char* json_str, uint32_t len) {
+  return json_to_lua_table(state, json_str);
+}
+
+//
+// harness
+//
+
+typedef bool (decoder)(lua_State* L, const char* json, uint32_t len);
+
+struct json_case {
+  lua_State* L;
+  decoder* decode;
+  const char* json;
+  uint32_t length;
+};
+
+static void decode(void* context) {
+  struct json_case* json = context;
+  json->decode(json->L, json->json, json->length);
+  lua_settop(json->L, 0);
+}
+
+static void run(lua_State* L, const char* name, decoder* decoder, const char* fixture, const char* json, uint32_t len) {
+  if (!decoder(L, json, len)) {
+    fprintf(stderr, "%s %s: decode failed\n", name, fixture);
+    return;
+  }
+  lua_settop(L, 0);
+
+  struct json_case json_case = { L, decoder, json, len };
+  bench_run("json", name, fixture, decode, &json_case);
+}
+
+//
+// checks, run before anything is timed: a decoder that gets these wrong
+// fails the benchmark
+//
+
+struct json_string_check {
+  const char* json;
+  const char* expected;
+  uint32_t length;
+};
+
+// Strings with escapes decode to the bytes they stand for
+static const struct json_string_check g_string_checks[] = {
+  { "\"\\u00e9\\ud83d\\ude00\"", "\xc3\xa9\xf0\x9f\x98\x80", 6 },
+  { "\"\\uD800\\u0041\"", "\xed\xa0\x80" "A", 4 },
+  { "\"a\\n\\\"b\"", "a\n\"b", 4 },
+};
+
+struct json_check {
+  const char* json;
+  bool valid;
+};
+
+// Both decoders take or refuse a document alike, the lazy one before any
+// of it is read
+static const struct json_check g_checks[] = {
+  { "[1,]", false },
+  { "[1,2 3]", false },
+  { "{\"a\" 1}", false },
+  { "{\"a\":1,}", false },
+  { "[tru]", false },
+  { "{\"a\":nul}", false },
+  { "[1 2]", false },
+  { "{\"a\":1 \"b\":2}", false },
+  { "[\"\\u12\"]", false },
+  { "[-]", false },
+  { "{1:2}", false },
+  { "[]", true },
+  { "{}", true },
+  { "[1, 2.5e3, -0.5, true, false, null]", true },
+  { "{\"a\": {\"b\": [1, {\"c\": \"\\u00e9\"}]}, \"d\": []}", true },
+};
+
+static bool check_decoders(lua_State* L) {
+  bool passed = true;
+  for (uint32_t i = 0; i < sizeof(g_checks) / sizeof(*g_checks); i++) {
+    const struct json_check* check = &g_checks[i];
+    uint32_t length = strlen(check->json);
+    bool eager = json_decode(L, check->json, length);
+    lua_settop(L, 0);
+    bool lazy = json_decode_lazy(L, check->json, length);
+    lua_settop(L, 0);
+    if (eager != check->valid || lazy != check->valid) {
+      fprintf(stderr, "%s: json_decode %s, json_decode_lazy %s\n", check->json,
+              eager ? "took it" : "refused it", lazy ? "took it" : "refused it");
+      passed = false;
+    }
+  }
+
+  for (uint32_t i = 0; i < sizeof(g_string_checks) / sizeof(*g_string_checks); i++) {
+    const struct json_string_check* check = &g_string_checks[i];
+    size_t length = 0;
+    const char* decoded = NULL;
+    if (json_decode(L, check->json, strlen(check->json)))
+      decoded = lua_tolstring(L, -1, &length);
+    if (!decoded || length != check->length
+        || memcmp(decoded, check->expected, length) != 0) {
+      fprintf(stderr, "json_decode %s: wrong string\n", check->json);
+      passed = false;
+    }
+    lua_settop(L, 0);
+  }
+  return passed;
+}
+
+int main(int argc, char** argv) {
+  lua_State* L = bench_lua_state();
+  luaL_openlibs(L);
+  lua_newtable(L);
+  json_proxy_register(L);
+  lua_pop(L, 1);
+  if (!check_decoders(L)) return 1;
+
+  for (int i = 1; i < argc; i++) {
+    uint32_t len;
+    char* json = bench_read_file(argv[i], &len);
+    if (!json) {
+      fprintf(stderr, "Could not read %s\n", argv[i]);
+      continue;
+    }
+
+    const char* fixture = bench_basename(argv[i]);
+    run(L, "cjson", cjson_to_lua_table, fixture, json, len);
+    run(L, "json_decode", json_decode, fixture, json, len);
+    run(L, "json_to_lua_table", to_lua_table, fixture, json, len);
+    run(L, "json_lazy", lazy_first_field, fixture, json, len);
+    free(json);
+  }
+
+  lua_close(L);
+  return 0;
+}
@@ -0,0 +1,142 @@
+//
+// Replays a log written with `SKETCHYBAR_CAPTURE` through `handler()`, with
+// the user config loaded the way the helper loads it and everything it
+// sends going to the stand-in transport. Timers, the pacer and child
+// processes run in between events like they do in the helper.
+//
+// Events go out as fast as possible by default, `-p` keeps the recorded
+// pace (gaps longer than a second, between two runs of the helper for
+// one, are cut to a second) and `-n` replays the log several times over.
+// One op is one event, the latency is that of `handler()` alone.
+//
+//   SKETCHYBAR_CAPTURE=/tmp/events.sblog ./sb_helper
+//   make bench/replay_bench
+//   CONFIG_DIR=~/.config/sketchybar ./bench/replay_bench [-p] [-n passes] /tmp/events.sblog
+//
+#define main sb_helper_main
+#include "../helper.c"
+#undef main
+#include "bench.h"
+#include "transport_bench.h"
+
+#define REPLAY_MAX_GAP_NS 1000000000ull
+#define REPLAY_MAX_SAMPLES 1000000
+
+static char* g_replay_env = NULL;
+static uint32_t g_replay_capacity = 0;
+
+// The log is mapped read-only and the handler may write to the env
+static char* replay_copy(struct capture_record* record) {
+  if (record->length > g_replay_capacity) {
+    char* env = realloc(g_replay_env, record->length);
+    if (!env) return NULL;
+    g_replay_env = env;
+    g_replay_capacity = record->length;
+  }
+  memcpy(g_replay_env, record->env, record->length);
+  return g_replay_env;
+}
+
+// What the helper's loop does between events, waiting for up to
+// `wait_ms` on timers and child processes
+static void replay_idle(int32_t wait_ms) {
+  struct pollfd fds[EVENT_SERVER_MAX_FDS];
+  uint64_t until = bench_now_ns() + (uint64_t)wait_ms * 1000000ull;
+  do {
+    uint32_t count = g_event_fds->fds(fds, EVENT_SERVER_MAX_FDS);
+    int64_t left = ((int64_t)until - (int64_t)bench_now_ns()) / 1000000;
+    int32_t timeout = event_server_min_timeout(event_server_timeout(), left > 0 ? left : 0);
+    if (count > 0 || timeout > 0) poll(fds, count, timeout);
+    g_event_fds->ready(fds, count);
+    event_server_tick();
+  } while (bench_now_ns() < until);
+}
+
+int main(int argc, char** argv) {
+  bool paced = false;
+  uint32_t passes = 1;
+  int option;
+  while ((option = getopt(argc, argv, "pn:")) != -1) {
+    if (option == 'p') paced = true;
+    else if (option == 'n') passes = atoi(optarg) > 0 ? atoi(optarg) : 1;
+    else {
+      fprintf(stderr, "usage: %s [-p] [-n passes] log\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-p] [-n passes] log\n", argv[0]);
+    return 1;
+  }
+
+  struct capture_log log;
+  if (!capture_log_map(&log, argv[optind])) {
+    fprintf(stderr, "%s: not a capture log\n", argv[optind]);
+    return 1;
+  }
+
+  transport_bench_use();
+  g_command_filter = &g_shadow;
+  g_command_scheduler = &g_pacer;
+  g_event_timers = &g_timers;
+  g_event_fds = &g_loop_fds;
+
+  Lg = bench_lua_state();
+  luaL_openlibs(Lg);
+  if (luaL_load_sketchybar(Lg) != 0) return 1;
+  replay_idle(0);
+
+  static uint64_t samples[REPLAY_MAX_SAMPLES];
+  uint32_t count = 0;
+  struct bench_result result = { "replay", paced ? "paced" : "fast", bench_basename(argv[optind]) };
+  uint64_t handled_ns = 0;
+  uint64_t allocs = g_bench_allocs, bytes = g_bench_bytes, messages = g_bench_messages;
+  uint64_t start = bench_now_ns();
+
+  for (uint32_t pass = 0; pass < passes; pass++) {
+    capture_log_rewind(&log);
+    uint64_t previous = 0;
+    struct capture_record record;
+    while (capture_log_next(&log, &record)) {
+      if (paced && previous > 0 && record.time_ns > previous) {
+        uint64_t gap = record.time_ns - previous;
+        if (gap > REPLAY_MAX_GAP_NS) gap = REPLAY_MAX_GAP_NS;
+        replay_idle(gap / 1000000);
+      }
+      previous = record.time_ns;
+
+      char* env = replay_copy(&record);
+      if (!env) continue;
+
+      uint64_t before = bench_now_ns();
+      handler(env);
+      uint64_t elapsed = bench_now_ns() - before;
+      handled_ns += elapsed;
+      if (count < REPLAY_MAX_SAMPLES) samples[count++] = elapsed;
+      result.ops++;
+
+      if (!paced) replay_idle(0);
+    }
+  }
+  uint64_t wall_ns = bench_now_ns() - start;
+  if (result.ops == 0) {
+    fprintf(stderr, "%s: no events\n", argv[optind]);
+    return 1;
+  }
+
+  qsort(samples, count, sizeof(uint64_t), bench_compare_u64);
+  result.ns_op = (double)handled_ns / result.ops;
+  result.p50_ns = samples[count / 2];
+  result.p99_ns = samples[count * 99 / 100];
+  result.allocs_op = (double)(g_bench_allocs - allocs) / result.ops;
+  result.bytes_op = (double)(g_bench_bytes - bytes) / result.ops;
+  bench_report(&result);
+
+  fprintf(stderr, "%llu events in %.3f s, %.0f events/s, %llu messages to the bar\n",
+          (unsigned long long)result.ops, wall_ns / 1e9, result.ops * 1e9 / wall_ns,
+          (unsigned long long)(g_bench_messages - messages));
+
+  lua_close(Lg);
+  capture_log_unmap(&log);
+  return 0;
+}
@@ -0,0 +1,70 @@
+//
+// Compares the Lua config serializer against `parse_kv_table` by applying
+// the configs of an 80 item bar (see serialize_bench.lua). One op is the
+// whole bar.
+//
+//   make bench
+//   ./bench/serialize_bench bench/serialize_bench.lua
+//
+#include <lualib.h>
+#include "../parsing.h"
+#include "bench.h"
+
+struct serialize_case {
+  lua_State* L;
+  const char* name;
+};
+
+// the same binding as `sb.serialize` in helper.c
+static int native_serialize(lua_State* L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  const char* extra = luaL_optstring(L, 2, NULL);
+  lua_settop(L, 2);
+  lua_pushnil(L);
+
+  uint32_t length;
+  char* pairs = parse_kv_table(L, 1, 3, extra, &length);
+  lua_pushlstring(L, pairs, length);
+  lua_insert(L, 3);
+  return 2;
+}
+
+static int native_configure(lua_State* L) {
+  parse_kv_configure(L, 1, 2);
+  return 0;
+}
+
+static void call(void* context) {
+  struct serialize_case* serialize = context;
+  lua_getglobal(serialize->L, serialize->name);
+  if (lua_pcall(serialize->L, 0, 0, 0)) {
+    fprintf(stderr, "%s: %s\n", serialize->name, lua_tostring(serialize->L, -1));
+    exit(1);
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s serialize_bench.lua\n", argv[0]);
+    return 1;
+  }
+
+  lua_State* L = bench_lua_state();
+  luaL_openlibs(L);
+  luaL_dostring(L, "package.path = './lua/src/?.lua;' .. package.path");
+  lua_register(L, "native_serialize", native_serialize);
+  lua_register(L, "native_configure", native_configure);
+
+  if (luaL_dofile(L, argv[1])) {
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    return 1;
+  }
+
+  struct serialize_case baseline = { L, "baseline" };
+  struct serialize_case native = { L, "native" };
+  bench_run("serialize", "baseline", "bar_config.lua", call, &baseline);
+  bench_run("serialize", "native", "bar_config.lua", call, &native);
+
+  lua_close(L);
+  return 0;
+}
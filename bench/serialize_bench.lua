@@ -0,0 +1,98 @@
+--
+-- Config serialization for the 80 item bar in fixtures/bar_config.lua, with
+-- the Lua serializer core.lua used before `sb.serialize` as the baseline.
+--
+local inspect = require("inspect")
+
+local __value__ = {}
+local __drop__ = {}
+
+local key_aliases = {
+  ["position"] = __drop__,
+  ["padding.left"] = "padding_left",
+  ["padding.right"] = "padding_right",
+  ["label.padding.left"] = "label.padding_left",
+  ["label.padding.right"] = "label.padding_right",
+  ["label.highlight.color"] = "label.highlight_color",
+  ["icon.padding.left"] = "icon.padding_left",
+  ["icon.padding.right"] = "icon.padding_right",
+  ["icon.highlight.color"] = "icon.highlight_color",
+  ["label.background.padding.left"] = "label.background.padding_left",
+  ["label.background.padding.right"] = "label.background.padding_right",
+  ["label.background.border.color"] = "label.background.border_color",
+  ["label.background.border.width"] = "label.background.border_width",
+  ["icon.background.padding.left"] = "icon.background.padding_left",
+  ["icon.background.padding.right"] = "icon.background.padding_right",
+  ["icon.background.border.color"] = "icon.background.border_color",
+  ["icon.background.border.width"] = "icon.background.border_width"
+}
+local special_keys = {
+  ["position"] = true,
+  ["subscribe"] = true,
+  ["events"] = true,
+  ["members"] = true,
+  ["width"] = true
+}
+
+local function insert_kv(t, k, v)
+  if k == nil then return end
+  local alias = key_aliases[k] or k
+  if alias ~= __drop__ then
+    table.insert(t, alias .. "=" .. inspect(v))
+  end
+end
+
+local function serialize_keys(tbl, acc, s)
+  if type(tbl) ~= "table" then
+    insert_kv(acc, s, tbl)
+  else
+    local prefix = (s ~= nil) and (s .. ".") or ""
+    for k, v in pairs(tbl) do
+      if k == __value__ or k == 1 then
+        insert_kv(acc, s, v)
+      else
+        serialize_keys(v, acc, prefix .. k)
+      end
+    end
+  end
+  return acc
+end
+
+local function preprocess_config(tbl)
+  local specials = {}
+  for k, v in pairs(tbl) do
+    if special_keys[k] then
+      specials[k] = v
+      tbl[k] = nil
+    end
+  end
+  return tbl, specials
+end
+
+local function baseline_serialize(tbl, extra)
+  local config, specials = preprocess_config(tbl)
+  local args = serialize_keys(config, {})
+  return table.concat(args, " ") .. " " .. extra, specials
+end
+
+local items = dofile("bench/fixtures/bar_config.lua")
+
+local extra = 'mach_helper="git.lua.sketchybar"'
+
+function baseline()
+  for i = 1, #items do
+    local item = items[i]
+    local config = baseline_serialize(item.config, extra)
+    local _ = "--set " .. item.name .. " " .. config
+  end
+end
+
+native_configure(key_aliases, special_keys)
+
+function native()
+  for i = 1, #items do
+    local item = items[i]
+    local config = native_serialize(item.config, extra)
+    local _ = "--set " .. item.name .. " " .. config
+  end
+end
@@ -0,0 +1,82 @@
+//
+// Starts the lua side the way the helper does, from a new state to the
+// user config's first flushed command: the embedded core and inspect, then
+// `init.lua` and the modules it requires from the fixture config dir.
+//
+// - core: without a user config
+// - config: every module compiled from source, the cache is off
+// - config_cached: every module loaded from a warm bytecode cache
+//
+// Every op closes its state again, which is part of the time. Everything
+// sent goes to the stand-in transport with the shadow model off.
+//
+//   make bench/startup_bench
+//   ./bench/startup_bench bench/fixtures/config
+//
+#define main sb_helper_main
+#include "../helper.c"
+#undef main
+#include <dirent.h>
+#include "bench.h"
+#include "transport_bench.h"
+
+static void start(void* context) {
+  // the callback ref belonged to the last state
+  g_handler_callback = LUA_NOREF;
+
+  uint64_t messages = g_bench_messages;
+  Lg = bench_lua_state();
+  luaL_openlibs(Lg);
+  if (luaL_load_sketchybar(Lg) != 0) exit(1);
+  if (context && g_bench_messages == messages) {
+    fprintf(stderr, "%s: nothing was flushed\n", (const char*)context);
+    exit(1);
+  }
+  lua_close(Lg);
+  Lg = NULL;
+}
+
+static void remove_dir(const char* path) {
+  DIR* dir = opendir(path);
+  if (!dir) return;
+
+  struct dirent* entry;
+  char file[PATH_MAX];
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] == '.') continue;
+    snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+    unlink(file);
+  }
+  closedir(dir);
+  rmdir(path);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <config dir>\n", argv[0]);
+    return 1;
+  }
+
+  char cache[] = "/tmp/sb_startup_bench.XXXXXX";
+  if (!mkdtemp(cache)) {
+    fprintf(stderr, "Could not create a cache dir\n");
+    return 1;
+  }
+
+  transport_bench_use();
+  shadow_set_enabled(false);
+  const char* fixture = bench_basename(argv[1]);
+
+  setenv("CONFIG_DIR", "/nonexistent", 1);
+  bench_run("startup", "core", NULL, start, NULL);
+
+  setenv("CONFIG_DIR", argv[1], 1);
+  setenv(BYTECODE_CACHE_ENV, "", 1);
+  bench_run("startup", "config", fixture, start, "config");
+
+  setenv(BYTECODE_CACHE_ENV, cache, 1);
+  bench_run("startup", "config_cached", fixture, start, "config_cached");
+
+  remove_dir(cache);
+  return 0;
+}
@@ -0,0 +1,126 @@
+//
+// Measures what adding and cancelling timers costs and how late they fire
+// when a loop waits on the wheel the way the helper's event loop does.
+//
+// For the lateness cases an op is a timer firing, `ns_op` is how late it
+// fired on average and p50/p99 are taken over every one of them. The wheel
+// only knows ms, so up to 1 ms of it is the tick.
+//
+//   make bench
+//   ./bench/timer_bench [seconds]
+//
+#include <poll.h>
+#include "../timer_wheel.c"
+#include "bench.h"
+
+#define BENCH_OPS 65000
+#define BENCH_TIMERS 100
+#define BENCH_MAX_SAMPLES 1000000
+
+// Keeps BENCH_OPS timers spread over a day, every op replaces the oldest
+struct timer_ops {
+  uint32_t ids[BENCH_OPS];
+  uint32_t next;
+};
+
+static void add_cancel(void* context) {
+  struct timer_ops* ops = context;
+  int data;
+  if (ops->ids[ops->next]) timer_wheel_cancel(ops->ids[ops->next], &data);
+  ops->ids[ops->next] = timer_wheel_add(rand() % (24 * 60 * 60 * 1000), 0, ops->next);
+  if (++ops->next == BENCH_OPS) ops->next = 0;
+}
+
+static void bench_ops() {
+  static struct timer_ops ops;
+  srand(1);
+  bench_run("timer", "add_cancel", "65000 timers", add_cancel, &ops);
+
+  for (int i = 0; i < BENCH_OPS; i++) {
+    int data;
+    if (ops.ids[i]) timer_wheel_cancel(ops.ids[i], &data);
+  }
+}
+
+static void report_late(const char* name, const char* fixture, uint64_t* late, uint32_t count, uint64_t allocs, uint64_t bytes) {
+  qsort(late, count, sizeof(uint64_t), bench_compare_u64);
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < count; i++) total += late[i];
+
+  struct bench_result result = { "timer", name, fixture, count };
+  if (count) {
+    result.ns_op = (double)total / count;
+    result.p50_ns = late[count / 2];
+    result.p99_ns = late[count * 99 / 100];
+    result.allocs_op = (double)allocs / count;
+    result.bytes_op = (double)bytes / count;
+  }
+  bench_report(&result);
+}
+
+// How late a plain 10 ms `poll` wakes up, the floor for the wheel
+static void bench_poll(uint32_t seconds) {
+  static uint64_t late[BENCH_MAX_SAMPLES];
+  uint32_t count = 0;
+
+  uint64_t end = bench_now_ns() + (uint64_t)seconds * 1000000000ull;
+  while (bench_now_ns() < end && count < BENCH_MAX_SAMPLES) {
+    uint64_t deadline = bench_now_ns() + 10000000ull;
+    poll(NULL, 0, 10);
+    uint64_t now = bench_now_ns();
+    late[count++] = now > deadline ? now - deadline : 0;
+  }
+  report_late("poll_10ms", "", late, count, 0, 0);
+}
+
+// Periods clocks, graphs and status items commonly use, every timer does
+// `busy_us` of work when it fires
+static void bench_jitter(const char* name, uint32_t seconds, uint32_t busy_us) {
+  static const uint32_t periods[] = { 10, 16, 33, 100, 250, 1000, 2000 };
+  static uint64_t late[BENCH_MAX_SAMPLES];
+  uint32_t count = 0;
+
+  uint32_t ids[BENCH_TIMERS];
+  for (int i = 0; i < BENCH_TIMERS; i++) {
+    uint32_t period = periods[i % (sizeof(periods) / sizeof(periods[0]))];
+    ids[i] = timer_wheel_add(period, period, i);
+  }
+
+  uint64_t allocs = g_bench_allocs, bytes = g_bench_bytes;
+  uint64_t end = bench_now_ns() + (uint64_t)seconds * 1000000000ull;
+  while (bench_now_ns() < end) {
+    poll(NULL, 0, timer_wheel_due_in());
+    if (!timer_wheel_expire()) continue;
+
+    while (g_due >= 0) {
+      int64_t delta = (int64_t)bench_now_ns() - (int64_t)(g_timers[g_due].expires * 1000000);
+      if (count < BENCH_MAX_SAMPLES) late[count++] = delta < 0 ? 0 : delta;
+
+      uint32_t id;
+      int data;
+      bool periodic;
+      timer_wheel_pop(&id, &data, &periodic);
+      if (busy_us) {
+        uint64_t until = bench_now_ns() + busy_us * 1000ull;
+        while (bench_now_ns() < until);
+      }
+    }
+  }
+
+  for (int i = 0; i < BENCH_TIMERS; i++) {
+    int data;
+    timer_wheel_cancel(ids[i], &data);
+  }
+  report_late(name, "100 timers", late, count, g_bench_allocs - allocs, g_bench_bytes - bytes);
+}
+
+int main(int argc, char** argv) {
+  uint32_t seconds = argc > 1 ? atoi(argv[1]) : 2;
+  if (seconds == 0) seconds = 1;
+
+  bench_ops();
+  bench_poll(seconds);
+  bench_jitter("idle", seconds, 0);
+  bench_jitter("busy_200us", seconds, 200);
+  return 0;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+//
+// Stands in for the bar in benchmarks that include helper.c: every message
+// is taken and counted without going anywhere, and `send` answers with
+// `g_bench_reply` the way the bar answers a query. Nothing is ever
+// received, so the helper's own event loop mustn't be started. The last
+// message stays readable until the next one, for benchmarks checking what
+// was sent. While `g_bench_down` is set every message fails the way it
+// does once the bar went away.
+//
+static char* g_bench_reply = "";
+static bool g_bench_down = false;
+static uint64_t g_bench_messages = 0;
+static uint64_t g_bench_message_bytes = 0;
+static char* g_bench_last = NULL;
+static uint32_t g_bench_last_length = 0;
+
+static inline void transport_bench_take(char* message, uint32_t len) {
+  g_bench_messages++;
+  g_bench_message_bytes += len;
+  g_bench_last = message;
+  g_bench_last_length = len;
+}
+
+// Whether the last message has `arg` as one of its NUL-separated arguments
+static inline bool transport_bench_sent_arg(const char* arg) {
+  uint32_t length = strlen(arg);
+  for (uint32_t i = 0; g_bench_last && i < g_bench_last_length;) {
+    uint32_t end = i;
+    while (end < g_bench_last_length && g_bench_last[end]) end++;
+    if (end - i == length && memcmp(g_bench_last + i, arg, length) == 0) return true;
+    i = end + 1;
+  }
+  return false;
+}
+
+static bool transport_bench_register(char* bootstrap_name) {
+  return true;
+}
+
+static char* transport_bench_send(char* message, uint32_t len) {
+  if (g_bench_down) return NULL;
+  transport_bench_take(message, len);
+  return g_bench_reply;
+}
+
+static bool transport_bench_post(char* message, uint32_t len) {
+  if (g_bench_down) return false;
+  transport_bench_take(message, len);
+  return true;
+}
+
+static uint32_t transport_bench_request(char* message, uint32_t len) {
+  transport_bench_take(message, len);
+  return transport_next_seq();
+}
+
+static bool transport_bench_reply(uint32_t* seq, char** response) {
+  return transport_unstash(seq, response);
+}
+
+static int transport_bench_reply_fd() {
+  return -1;
+}
+
+static bool transport_bench_receive(env* event, int32_t timeout_ms) {
+  *event = NULL;
+  return false;
+}
+
+static void transport_bench_release(env event) { }
+
+static void transport_bench_forget() { }
+
+static struct transport g_transport_bench = {
+  .name = "bench",
+  .server_register = transport_bench_register,
+  .send = transport_bench_send,
+  .post = transport_bench_post,
+  .request = transport_bench_request,
+  .reply = transport_bench_reply,
+  .reply_fd = transport_bench_reply_fd,
+  .receive = transport_bench_receive,
+  .release = transport_bench_release,
+  .forget = transport_bench_forget
+};
+
+// Before anything in the helper asks for its transport
+static inline void transport_bench_use() {
+  g_transport = &g_transport_bench;
+}
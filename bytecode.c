@@ -0,0 +1,166 @@
+#include "bytecode.h"
+
+#ifdef __APPLE__
+#define BYTECODE_MTIME(st) (st).st_mtimespec
+#else
+#define BYTECODE_MTIME(st) (st).st_mtim
+#endif
+
+static struct bytecode_stats g_bytecode_stats = { 0 };
+
+// FNV-1a, a cached file is named after the hash of its source's path
+static uint64_t bytecode_hash(const char* path) {
+  uint64_t hash = 14695981039346656037ull;
+  for (const char* c = path; *c; c++) {
+    hash ^= (unsigned char)*c;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// Where `path` is cached, false when the cache is off or there's no home
+static bool bytecode_cache_path(const char* path, char* file, size_t size) {
+  const char* dir = getenv(BYTECODE_CACHE_ENV);
+  const char* home = NULL;
+  const char* suffix = "";
+
+  if (dir) {
+    if (!*dir) return false;
+  } else if ((home = getenv("XDG_CACHE_HOME")) && *home) {
+    dir = home;
+    suffix = "/sketchybar";
+  } else if ((home = getenv("HOME")) && *home) {
+    dir = home;
+    suffix = "/.cache/sketchybar";
+  } else {
+    return false;
+  }
+
+  int length = snprintf(file, size, "%s%s/%016llx.luac", dir, suffix,
+                        (unsigned long long)bytecode_hash(path));
+  return length > 0 && (size_t)length < size;
+}
+
+// Every dir on the way to `file`, the ones that exist already fail quietly
+static void bytecode_make_dirs(char* file) {
+  for (char* c = file + 1; *c; c++) {
+    if (*c != '/') continue;
+    *c = '\0';
+    mkdir(file, 0755);
+    *c = '/';
+  }
+}
+
+static bool bytecode_matches(struct bytecode_header* header, const char* path, uint32_t path_length, struct stat* source) {
+  return header->magic == BYTECODE_MAGIC
+         && header->path_length == path_length
+         && header->size == (int64_t)source->st_size
+         && header->mtime_sec == (int64_t)BYTECODE_MTIME(*source).tv_sec
+         && header->mtime_nsec == (int64_t)BYTECODE_MTIME(*source).tv_nsec;
+}
+
+// Pushes the cached chunk of `path` if it is still the one of the source
+static bool bytecode_read(lua_State* L, const char* file, const char* path, struct stat* source) {
+  FILE* cached = fopen(file, "rb");
+  if (!cached) return false;
+
+  uint32_t path_length = strlen(path);
+  struct bytecode_header header;
+  struct stat cached_stat;
+  char* contents = NULL;
+  bool loaded = false;
+
+  if (fread(&header, sizeof(header), 1, cached) != 1
+      || !bytecode_matches(&header, path, path_length, source)
+      || fstat(fileno(cached), &cached_stat) != 0
+      || cached_stat.st_size <= (off_t)(sizeof(header) + path_length)) {
+    fclose(cached);
+    return false;
+  }
+
+  size_t length = cached_stat.st_size - sizeof(header);
+  contents = malloc(length);
+  if (contents && fread(contents, 1, length, cached) == length
+      && memcmp(contents, path, path_length) == 0) {
+    // `b` only, whatever else ended up in there is never run as source
+    if (luaL_loadbufferx(L, contents + path_length, length - path_length, path, "b") == 0) {
+      loaded = true;
+    } else {
+      lua_pop(L, 1);
+    }
+  }
+
+  free(contents);
+  fclose(cached);
+  return loaded;
+}
+
+static int bytecode_writer(lua_State* L, const void* data, size_t size, void* file) {
+  return fwrite(data, 1, size, file) != size;
+}
+
+// Dumps the chunk on top of the stack for `path`. It's written to a file of
+// its own and moved over the old one, helpers starting side by side never
+// read half of it.
+static bool bytecode_write(lua_State* L, char* file, const char* path, struct stat* source) {
+  bytecode_make_dirs(file);
+
+  uint32_t length = strlen(file);
+  char temporary[length + 8];
+  memcpy(temporary, file, length);
+  memcpy(temporary + length, ".XXXXXX", 8);
+
+  int fd = mkstemp(temporary);
+  if (fd < 0) return false;
+  FILE* cached = fdopen(fd, "wb");
+  if (!cached) {
+    close(fd);
+    unlink(temporary);
+    return false;
+  }
+
+  struct bytecode_header header = {
+    .magic = BYTECODE_MAGIC,
+    .path_length = strlen(path),
+    .size = source->st_size,
+    .mtime_sec = BYTECODE_MTIME(*source).tv_sec,
+    .mtime_nsec = BYTECODE_MTIME(*source).tv_nsec
+  };
+
+  bool written = fwrite(&header, sizeof(header), 1, cached) == 1
+                 && fwrite(path, 1, header.path_length, cached) == header.path_length
+                 && lua_dump(L, bytecode_writer, cached) == 0
+                 && !ferror(cached);
+  if (fclose(cached) != 0) written = false;
+  if (!written || rename(temporary, file) != 0) {
+    unlink(temporary);
+    return false;
+  }
+  return true;
+}
+
+// `luaL_loadfile` through the cache: pushes the chunk and returns 0, or the
+// error message and its status. Failing to cache it isn't an error.
+int bytecode_loadfile(lua_State* L, const char* path) {
+  char file[PATH_MAX];
+  struct stat source;
+  if (stat(path, &source) != 0 || !bytecode_cache_path(path, file, sizeof(file))) {
+    return luaL_loadfile(L, path);
+  }
+
+  if (bytecode_read(L, file, path, &source)) {
+    g_bytecode_stats.hits++;
+    return 0;
+  }
+
+  g_bytecode_stats.misses++;
+  int status = luaL_loadfile(L, path);
+  if (status == 0 && !bytecode_write(L, file, path, &source)) {
+    g_bytecode_stats.failed++;
+  }
+  return status;
+}
+
+struct bytecode_stats bytecode_stats() {
+  return g_bytecode_stats;
+}
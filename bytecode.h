@@ -0,0 +1,45 @@
+#pragma once
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BYTECODE_CACHE_ENV "SKETCHYBAR_CACHE_DIR"
+#define BYTECODE_MAGIC 0x63626273
+
+//
+// The user config and the modules it requires are compiled once and kept
+// as bytecode, so a restarted helper skips lexing and parsing them. The
+// cache lives in `$SKETCHYBAR_CACHE_DIR`, or `$XDG_CACHE_HOME/sketchybar`
+// or `~/.cache/sketchybar` without it, an empty `$SKETCHYBAR_CACHE_DIR`
+// turns it off.
+//
+// A file is cached under the hash of its path, next to the path itself and
+// the size and mtime the file had when it was compiled. Anything that
+// doesn't match, bytecode from another LuaJIT that won't load included, is
+// compiled from the source again and replaces it. The debug info stays in,
+// errors still point at lines of the source.
+//
+struct bytecode_header {
+  uint32_t magic;
+  uint32_t path_length;
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+struct bytecode_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t failed;
+};
+
+int bytecode_loadfile(lua_State* L, const char* path);
+struct bytecode_stats bytecode_stats();
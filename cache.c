@@ -0,0 +1,162 @@
+#include "cache.h"
+
+static struct query_cache_rule* g_rules = NULL;
+static uint32_t g_rule_count = 0;
+
+static struct query_cache_entry* g_entries = NULL;
+static uint32_t g_entry_count = 0;
+
+static struct query_cache_stats g_stats = { 0 };
+static uint64_t g_generation = 0;
+
+static uint64_t query_cache_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct query_cache_rule* query_cache_find_rule(const char* query) {
+  for (uint32_t i = 0; i < g_rule_count; i++) {
+    if (strcmp(g_rules[i].query, query) == 0) return &g_rules[i];
+  }
+  return NULL;
+}
+
+static struct query_cache_entry* query_cache_find_entry(const char* query) {
+  for (uint32_t i = 0; i < g_entry_count; i++) {
+    if (strcmp(g_entries[i].query, query) == 0) return &g_entries[i];
+  }
+  return NULL;
+}
+
+static void query_cache_drop(lua_State* L, struct query_cache_entry* entry) {
+  luaL_unref(L, LUA_REGISTRYINDEX, entry->ref);
+  free(entry->query);
+  *entry = g_entries[--g_entry_count];
+  g_stats.invalidations++;
+}
+
+// Adds or replaces the rule for `query`, existing entries keep the TTL they
+// were stored with.
+bool query_cache_rule(const char* query, const char** events, uint32_t event_count, uint32_t ttl_ms) {
+  if (event_count > QUERY_CACHE_MAX_EVENTS) return false;
+
+  struct query_cache_rule* rule = query_cache_find_rule(query);
+  if (rule) {
+    for (uint32_t i = 0; i < rule->event_count; i++) free(rule->events[i]);
+  } else {
+    struct query_cache_rule* rules = realloc(g_rules, sizeof(struct query_cache_rule)
+                                                      * (g_rule_count + 1));
+    if (!rules) return false;
+    g_rules = rules;
+    rule = &g_rules[g_rule_count++];
+    rule->query = strdup(query);
+  }
+
+  rule->event_count = event_count;
+  rule->ttl_ms = ttl_ms;
+  for (uint32_t i = 0; i < event_count; i++) rule->events[i] = strdup(events[i]);
+  return true;
+}
+
+void query_cache_remove_rule(lua_State* L, const char* query) {
+  struct query_cache_entry* entry = query_cache_find_entry(query);
+  if (entry) query_cache_drop(L, entry);
+
+  struct query_cache_rule* rule = query_cache_find_rule(query);
+  if (!rule) return;
+
+  for (uint32_t i = 0; i < rule->event_count; i++) free(rule->events[i]);
+  free(rule->query);
+  *rule = g_rules[--g_rule_count];
+}
+
+// Pushes the cached value and returns true on a hit. A lazy request can be
+// served from an eagerly decoded result, but not the other way around.
+bool query_cache_get(lua_State* L, const char* query, bool lazy) {
+  if (!query_cache_find_rule(query)) return false;
+
+  struct query_cache_entry* entry = query_cache_find_entry(query);
+  if (entry && entry->expires <= query_cache_now_ms()) {
+    query_cache_drop(L, entry);
+    entry = NULL;
+  }
+
+  if (!entry || (entry->lazy && !lazy)) {
+    g_stats.misses++;
+    return false;
+  }
+
+  g_stats.hits++;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, entry->ref);
+  return true;
+}
+
+// Stores the value at `index` if there is a rule for `query`. Failed
+// queries (nil) are never cached.
+void query_cache_put(lua_State* L, const char* query, bool lazy, int index) {
+  struct query_cache_rule* rule = query_cache_find_rule(query);
+  if (!rule || lua_isnil(L, index)) return;
+
+  struct query_cache_entry* entry = query_cache_find_entry(query);
+  if (entry) luaL_unref(L, LUA_REGISTRYINDEX, entry->ref);
+  else {
+    struct query_cache_entry* entries = realloc(g_entries, sizeof(struct query_cache_entry)
+                                                          * (g_entry_count + 1));
+    if (!entries) return;
+    g_entries = entries;
+    entry = &g_entries[g_entry_count++];
+    entry->query = strdup(query);
+  }
+
+  lua_pushvalue(L, index);
+  entry->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  entry->lazy = lazy;
+  entry->expires = query_cache_now_ms() + rule->ttl_ms;
+}
+
+uint64_t query_cache_generation() {
+  return g_generation;
+}
+
+static bool query_cache_rule_lists(struct query_cache_rule* rule, const char* event) {
+  for (uint32_t i = 0; i < rule->event_count; i++) {
+    if (strcmp(rule->events[i], event) == 0) return true;
+  }
+  return false;
+}
+
+// Drops every entry whose rule lists `event`
+void query_cache_event(lua_State* L, const char* event) {
+  for (uint32_t i = 0; i < g_rule_count; i++) {
+    if (query_cache_rule_lists(&g_rules[i], event)) {
+      g_generation++;
+      break;
+    }
+  }
+
+  for (uint32_t i = 0; i < g_entry_count;) {
+    struct query_cache_rule* rule = query_cache_find_rule(g_entries[i].query);
+
+    // dropping moves the last entry into this slot
+    if (!rule || query_cache_rule_lists(rule, event)) query_cache_drop(L, &g_entries[i]);
+    else i++;
+  }
+}
+
+// Drops every entry starting with `prefix`, everything if it is NULL
+void query_cache_invalidate(lua_State* L, const char* prefix) {
+  g_generation++;
+  uint32_t prefix_length = prefix ? strlen(prefix) : 0;
+  for (uint32_t i = 0; i < g_entry_count;) {
+    if (strncmp(g_entries[i].query, prefix ? prefix : "", prefix_length) == 0)
+      query_cache_drop(L, &g_entries[i]);
+    else i++;
+  }
+}
+
+struct query_cache_stats query_cache_stats() {
+  struct query_cache_stats stats = g_stats;
+  stats.entries = g_entry_count;
+  return stats;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define QUERY_CACHE_TTL_MS 500
+#define QUERY_CACHE_MAX_EVENTS 8
+
+//
+// Query results are cached per command string, so every item reacting to
+// the same event shares a single round trip and decode. The key is the
+// command exactly as it is sent: "--query bar" for sketchybar and
+// "query --windows" for yabai, which can't collide.
+//
+// Only commands with a rule are cached. A rule lists the events that make
+// the result stale and a TTL as a fallback for changes no event reports.
+// Cached values are shared between callers, so they must not be modified.
+//
+// The generation changes whenever something could have made a result
+// stale. A result that was in flight while it changed is only stored if it
+// is put with the generation its query was sent in.
+//
+struct query_cache_rule {
+  char* query;
+  char* events[QUERY_CACHE_MAX_EVENTS];
+  uint32_t event_count;
+  uint32_t ttl_ms;
+};
+
+struct query_cache_entry {
+  char* query;
+  int ref;
+  bool lazy;
+  uint64_t expires;
+};
+
+struct query_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t invalidations;
+  uint32_t entries;
+};
+
+bool query_cache_rule(const char* query, const char** events, uint32_t event_count, uint32_t ttl_ms);
+void query_cache_remove_rule(lua_State* L, const char* query);
+
+bool query_cache_get(lua_State* L, const char* query, bool lazy);
+void query_cache_put(lua_State* L, const char* query, bool lazy, int index);
+uint64_t query_cache_generation();
+
+void query_cache_event(lua_State* L, const char* event);
+void query_cache_invalidate(lua_State* L, const char* prefix);
+
+struct query_cache_stats query_cache_stats();
@@ -0,0 +1,141 @@
+#include "callbacks.h"
+
+#define CALLBACK_INDEX_INITIAL_CAPACITY 64
+
+// Entries are never removed, so probing doesn't need tombstones
+static struct callback_entry* g_entries = NULL;
+static uint32_t g_capacity = 0;
+static uint32_t g_count = 0;
+static uint32_t g_callback_count = 0;
+
+static uint32_t callback_hash(const char* item, uint32_t item_length, const char* event, uint32_t event_length) {
+  uint32_t hash = 2166136261u;
+  for (uint32_t i = 0; i < item_length; i++) hash = (hash ^ (unsigned char)item[i]) * 16777619u;
+  hash = (hash ^ 0xff) * 16777619u;
+  for (uint32_t i = 0; i < event_length; i++) hash = (hash ^ (unsigned char)event[i]) * 16777619u;
+  return hash;
+}
+
+static struct callback_entry* callback_slot(struct callback_entry* entries, uint32_t capacity, const char* item, uint32_t item_length, const char* event, uint32_t event_length, uint32_t hash) {
+  uint32_t i = hash & (capacity - 1);
+  for (;;) {
+    struct callback_entry* entry = &entries[i];
+    if (!entry->key) return entry;
+    if (entry->hash == hash
+        && entry->item_length == item_length
+        && entry->event_length == event_length
+        && memcmp(entry->key, item, item_length) == 0
+        && memcmp(entry->key + item_length + 1, event, event_length) == 0) {
+      return entry;
+    }
+    i = (i + 1) & (capacity - 1);
+  }
+}
+
+static struct callback_entry* callback_find(const char* item, const char* event) {
+  if (g_count == 0) return NULL;
+
+  uint32_t item_length = strlen(item), event_length = strlen(event);
+  uint32_t hash = callback_hash(item, item_length, event, event_length);
+  struct callback_entry* entry = callback_slot(g_entries, g_capacity, item, item_length,
+                                               event, event_length, hash);
+  return entry->key ? entry : NULL;
+}
+
+static bool callback_grow() {
+  uint32_t capacity = g_capacity ? g_capacity * 2 : CALLBACK_INDEX_INITIAL_CAPACITY;
+  struct callback_entry* entries = calloc(capacity, sizeof(struct callback_entry));
+  if (!entries) return false;
+
+  for (uint32_t i = 0; i < g_capacity; i++) {
+    struct callback_entry* entry = &g_entries[i];
+    if (!entry->key) continue;
+    *callback_slot(entries, capacity, entry->key, entry->item_length,
+                   entry->key + entry->item_length + 1, entry->event_length,
+                   entry->hash) = *entry;
+  }
+
+  free(g_entries);
+  g_entries = entries;
+  g_capacity = capacity;
+  return true;
+}
+
+// Appends the function at `function` to the callbacks of (item, event)
+bool callback_index_add(lua_State* L, const char* item, const char* event, int function) {
+  if ((g_count + 1) * 4 > g_capacity * 3 && !callback_grow()) return false;
+
+  uint32_t item_length = strlen(item), event_length = strlen(event);
+  uint32_t hash = callback_hash(item, item_length, event, event_length);
+  struct callback_entry* entry = callback_slot(g_entries, g_capacity, item, item_length,
+                                               event, event_length, hash);
+
+  if (!entry->key) {
+    // "item\0event\0" in one allocation
+    char* key = malloc(item_length + event_length + 2);
+    if (!key) return false;
+    memcpy(key, item, item_length + 1);
+    memcpy(key + item_length + 1, event, event_length + 1);
+
+    *entry = (struct callback_entry) { key, item_length, event_length, hash };
+    g_count++;
+  }
+
+  if (entry->count == entry->capacity) {
+    uint32_t capacity = entry->capacity ? entry->capacity * 2 : 4;
+    int* refs = realloc(entry->refs, capacity * sizeof(int));
+    if (!refs) return false;
+    entry->refs = refs;
+    entry->capacity = capacity;
+  }
+
+  lua_pushvalue(L, function);
+  entry->refs[entry->count++] = luaL_ref(L, LUA_REGISTRYINDEX);
+  g_callback_count++;
+  return true;
+}
+
+static uint32_t callback_call(lua_State* L, struct callback_entry* entry, int item_index, int event_index, int env_index) {
+  if (!entry) return 0;
+
+  // a callback registering another one may move the entry
+  const char* key = entry->key;
+  uint32_t count = entry->count;
+  int refs[count];
+  memcpy(refs, entry->refs, count * sizeof(int));
+
+  for (uint32_t i = 0; i < count; i++) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, refs[i]);
+    lua_pushvalue(L, item_index);
+    lua_pushvalue(L, event_index);
+    lua_pushvalue(L, env_index);
+    if (lua_pcall(L, 3, 0, 0) != 0) {
+      fprintf(stderr, "Callback error (%s):\n", key[0] ? key : "*");
+      fprintf(stderr, "%s\n", lua_tostring(L, -1));
+      fflush(stderr);
+      lua_pop(L, 1);
+    }
+  }
+  return count;
+}
+
+// Calls everything registered for all events, for all events of `item`
+// and for `event` of `item`, in that order, with the values at the given
+// indices. An error is reported and doesn't stop the other callbacks.
+// Returns the number of callbacks called.
+uint32_t callback_index_dispatch(lua_State* L, const char* item, const char* event, int item_index, int event_index, int env_index) {
+  if (g_count == 0) return 0;
+
+  uint32_t called = callback_call(L, callback_find("", ""), item_index, event_index, env_index);
+  if (item[0]) {
+    called += callback_call(L, callback_find(item, ""), item_index, event_index, env_index);
+    if (event[0]) {
+      called += callback_call(L, callback_find(item, event), item_index, event_index, env_index);
+    }
+  }
+  return called;
+}
+
+uint32_t callback_index_count() {
+  return g_callback_count;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+//
+// Callbacks are indexed by (item, event), an empty item or event matches
+// every one: ("", "") gets all events, (item, "") all events of an item.
+// Each key holds its functions as registry refs in the order they were
+// registered, so dispatching an event is two hash lookups and a call per
+// function, and nothing at all for items without callbacks.
+//
+struct callback_entry {
+  char* key;
+  uint32_t item_length;
+  uint32_t event_length;
+  uint32_t hash;
+
+  int* refs;
+  uint32_t count;
+  uint32_t capacity;
+};
+
+bool callback_index_add(lua_State* L, const char* item, const char* event, int function);
+uint32_t callback_index_dispatch(lua_State* L, const char* item, const char* event, int item_index, int event_index, int env_index);
+uint32_t callback_index_count();
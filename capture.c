@@ -0,0 +1,116 @@
+#include "capture.h"
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+static int g_capture_fd = -1;
+
+bool capture_open(const char* path) {
+  capture_close();
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd == -1) return false;
+
+  struct stat info;
+  if (fstat(fd, &info) != 0
+      || (info.st_size == 0
+          && write(fd, CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH) != CAPTURE_MAGIC_LENGTH)) {
+    close(fd);
+    return false;
+  }
+
+  g_capture_fd = fd;
+  return true;
+}
+
+// A failed write stops the capture, half a record would make the rest of
+// the log unreadable
+void capture_event(const char* env) {
+  if (g_capture_fd == -1) return;
+
+  // the env ends with an empty key
+  uint32_t length = 0;
+  while (env[length]) {
+    length += strlen(&env[length]) + 1;
+    length += strlen(&env[length]) + 1;
+  }
+  length++;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t time_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+  char header[CAPTURE_RECORD_HEADER];
+  memcpy(header, &time_ns, sizeof(uint64_t));
+  memcpy(header + sizeof(uint64_t), &length, sizeof(uint32_t));
+
+  struct iovec parts[2] = { { header, sizeof(header) }, { (void*)env, length } };
+  if (writev(g_capture_fd, parts, 2) != (ssize_t)(sizeof(header) + length)) {
+    capture_close();
+  }
+}
+
+void capture_close() {
+  if (g_capture_fd == -1) return;
+  close(g_capture_fd);
+  g_capture_fd = -1;
+}
+
+bool capture_log_map(struct capture_log* log, const char* path) {
+  *log = (struct capture_log) { NULL, 0, 0 };
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size < CAPTURE_MAGIC_LENGTH) {
+    close(fd);
+    return false;
+  }
+
+  void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return false;
+
+  if (memcmp(data, CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH) != 0) {
+    munmap(data, info.st_size);
+    return false;
+  }
+
+  madvise(data, info.st_size, MADV_SEQUENTIAL);
+  log->data = data;
+  log->size = info.st_size;
+  log->offset = CAPTURE_MAGIC_LENGTH;
+  return true;
+}
+
+// Points `record` at the next event in the mapping. A record cut short,
+// the helper was killed halfway through writing it, ends the log.
+bool capture_log_next(struct capture_log* log, struct capture_record* record) {
+  if (log->size - log->offset < CAPTURE_RECORD_HEADER) return false;
+
+  const char* header = log->data + log->offset;
+  memcpy(&record->time_ns, header, sizeof(uint64_t));
+  memcpy(&record->length, header + sizeof(uint64_t), sizeof(uint32_t));
+
+  size_t left = log->size - log->offset - CAPTURE_RECORD_HEADER;
+  if (record->length == 0 || record->length > left) return false;
+
+  record->env = header + CAPTURE_RECORD_HEADER;
+  if (record->env[record->length - 1] != '\0') return false;
+
+  log->offset += CAPTURE_RECORD_HEADER + record->length;
+  return true;
+}
+
+void capture_log_rewind(struct capture_log* log) {
+  log->offset = CAPTURE_MAGIC_LENGTH;
+}
+
+void capture_log_unmap(struct capture_log* log) {
+  if (log->data) munmap((void*)log->data, log->size);
+  *log = (struct capture_log) { NULL, 0, 0 };
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define CAPTURE_ENV "SKETCHYBAR_CAPTURE"
+#define CAPTURE_MAGIC "SBEVLOG1"
+#define CAPTURE_MAGIC_LENGTH 8
+#define CAPTURE_RECORD_HEADER 12
+
+//
+// With `SKETCHYBAR_CAPTURE=<path>` set, every event is appended to a log
+// the moment it is received, before the queue gets to coalesce or drop
+// it, so a stutter can be replayed offline (see bench/replay_bench.c).
+//
+// The log starts with the 8 byte magic, every record after it is the
+// wall clock time in ns (uint64), the env's length (uint32), both in host
+// byte order, and the env as it came in. The log is only ever appended to,
+// runs of several helper starts end up one after the other.
+//
+// Every record is written with a single `writev`, nothing is buffered that
+// a crash could lose. `capture_event` runs on the receiver thread only.
+//
+bool capture_open(const char* path);
+void capture_event(const char* env);
+void capture_close();
+
+struct capture_log {
+  const char* data;
+  size_t size;
+  size_t offset;
+};
+
+struct capture_record {
+  uint64_t time_ns;
+  const char* env;
+  uint32_t length;
+};
+
+bool capture_log_map(struct capture_log* log, const char* path);
+bool capture_log_next(struct capture_log* log, struct capture_record* record);
+void capture_log_rewind(struct capture_log* log);
+void capture_log_unmap(struct capture_log* log);
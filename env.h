@@ -0,0 +1,73 @@
+#pragma once
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+//
+// An env is a packed list of NUL terminated keys and values, ended by an
+// empty key. The index holds the offsets and lengths of every pair, built
+// in a single pass so nothing is measured twice.
+//
+struct env_pair {
+  uint32_t key;
+  uint32_t key_length;
+  uint32_t value;
+  uint32_t value_length;
+};
+
+struct env_index {
+  const char* env;
+  struct env_pair* pairs;
+  uint32_t count;
+  uint32_t capacity;
+};
+
+// Indexes `env` into `index`, reusing its pairs. With `lower` set the keys
+// are lower-cased in place. Returns false if the index couldn't grow, with
+// the pairs indexed so far still usable.
+static inline bool env_index_build(struct env_index* index, char* env, bool lower) {
+  index->env = env;
+  index->count = 0;
+
+  uint32_t caret = 0;
+  while (env[caret]) {
+    if (index->count == index->capacity) {
+      uint32_t capacity = index->capacity ? index->capacity * 2 : 16;
+      struct env_pair* pairs = realloc(index->pairs, capacity * sizeof(struct env_pair));
+      if (!pairs) return false;
+      index->pairs = pairs;
+      index->capacity = capacity;
+    }
+
+    struct env_pair* pair = &index->pairs[index->count++];
+    pair->key = caret;
+    if (lower) {
+      while (env[caret]) {
+        env[caret] = tolower(env[caret]);
+        caret++;
+      }
+    } else {
+      caret += strlen(&env[caret]);
+    }
+    pair->key_length = caret - pair->key;
+
+    pair->value = caret + 1;
+    pair->value_length = strlen(&env[pair->value]);
+    caret = pair->value + pair->value_length + 1;
+  }
+  return true;
+}
+
+static inline struct env_pair* env_index_find(struct env_index* index, const char* key, uint32_t length) {
+  for (uint32_t i = 0; i < index->count; i++) {
+    struct env_pair* pair = &index->pairs[i];
+    if (pair->key_length == length
+        && memcmp(index->env + pair->key, key, length) == 0) {
+      return pair;
+    }
+  }
+  return NULL;
+}
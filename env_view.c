@@ -0,0 +1,180 @@
+#include "env_view.h"
+
+#define ENV_VIEW "sketchybar.env"
+
+struct env_view {
+  struct env_index index;
+  bool dirty;
+};
+
+static struct env_view* g_env_view = NULL;
+static int g_env_view_ref = LUA_NOREF;
+
+static void env_view_push_value(lua_State* L, struct env_view* view, struct env_pair* pair) {
+  lua_pushlstring(L, view->index.env + pair->value, pair->value_length);
+}
+
+static int env_view_index(lua_State* L) {
+  struct env_view* view = luaL_checkudata(L, 1, ENV_VIEW);
+
+  if (view->dirty) {
+    lua_getfenv(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    if (!lua_isnil(L, -1)) return 1;
+    lua_pop(L, 2);
+  }
+
+  size_t length;
+  const char* key = lua_type(L, 2) == LUA_TSTRING ? lua_tolstring(L, 2, &length)
+                                                   : NULL;
+  struct env_pair* pair = key ? env_index_find(&view->index, key, length) : NULL;
+  if (pair) env_view_push_value(L, view, pair);
+  else lua_pushnil(L);
+  return 1;
+}
+
+static int env_view_newindex(lua_State* L) {
+  struct env_view* view = luaL_checkudata(L, 1, ENV_VIEW);
+  lua_getfenv(L, 1);
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, 3);
+  lua_rawset(L, -3);
+  view->dirty = true;
+  return 0;
+}
+
+// upvalues: position in the event's pairs and whether the side table with
+// the assigned fields is being walked, which comes after them
+static int env_view_next(lua_State* L) {
+  struct env_view* view = luaL_checkudata(L, 1, ENV_VIEW);
+
+  if (!lua_toboolean(L, lua_upvalueindex(2))) {
+    uint32_t position = lua_tointeger(L, lua_upvalueindex(1));
+    while (position < view->index.count) {
+      struct env_pair* pair = &view->index.pairs[position++];
+      lua_pushlstring(L, view->index.env + pair->key, pair->key_length);
+
+      if (view->dirty) {
+        // assigned fields come from the side table instead
+        lua_getfenv(L, 1);
+        lua_pushvalue(L, -2);
+        lua_rawget(L, -2);
+        bool shadowed = !lua_isnil(L, -1);
+        lua_pop(L, 2);
+        if (shadowed) {
+          lua_pop(L, 1);
+          continue;
+        }
+      }
+
+      lua_pushinteger(L, position);
+      lua_replace(L, lua_upvalueindex(1));
+      env_view_push_value(L, view, pair);
+      return 2;
+    }
+
+    if (!view->dirty) {
+      lua_pushnil(L);
+      return 1;
+    }
+    lua_pushboolean(L, true);
+    lua_replace(L, lua_upvalueindex(2));
+    lua_pushnil(L);
+  } else {
+    lua_pushvalue(L, 2);
+  }
+
+  lua_getfenv(L, 1);
+  lua_insert(L, -2);
+  if (lua_next(L, -2)) return 2;
+  lua_pushnil(L);
+  return 1;
+}
+
+static int env_view_pairs(lua_State* L) {
+  luaL_checkudata(L, 1, ENV_VIEW);
+  lua_pushinteger(L, 0);
+  lua_pushboolean(L, false);
+  lua_pushcclosure(L, env_view_next, 2);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+static int env_view_tostring(lua_State* L) {
+  struct env_view* view = luaL_checkudata(L, 1, ENV_VIEW);
+  lua_pushfstring(L, "env: %d fields", (int)view->index.count);
+  return 1;
+}
+
+static int env_view_gc(lua_State* L) {
+  struct env_view* view = luaL_checkudata(L, 1, ENV_VIEW);
+  if (view->index.pairs) free(view->index.pairs);
+  view->index = (struct env_index) { 0 };
+  if (g_env_view == view) g_env_view = NULL;
+  return 0;
+}
+
+// Points the view at `env`, with its keys lower-cased in place, and pushes it
+void env_view_push(lua_State* L, char* env) {
+  if (!g_env_view) {
+    g_env_view = lua_newuserdata(L, sizeof(struct env_view));
+    *g_env_view = (struct env_view) { 0 };
+    luaL_getmetatable(L, ENV_VIEW);
+    lua_setmetatable(L, -2);
+    lua_newtable(L);
+    lua_setfenv(L, -2);
+    g_env_view_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+
+  // keys past a failed allocation are missing but the rest still works
+  env_index_build(&g_env_view->index, env, true);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, g_env_view_ref);
+}
+
+// The value of `key` in the current event or NULL, keys are lower-case
+const char* env_view_get(const char* key, uint32_t length) {
+  if (!g_env_view) return NULL;
+  struct env_pair* pair = env_index_find(&g_env_view->index, key, length);
+  return pair ? g_env_view->index.env + pair->value : NULL;
+}
+
+// The size of the current event's env, the empty key ending it included
+uint32_t env_view_length() {
+  if (!g_env_view || !g_env_view->index.env) return 0;
+  if (g_env_view->index.count == 0) return 1;
+
+  struct env_pair* last = &g_env_view->index.pairs[g_env_view->index.count - 1];
+  return last->value + last->value_length + 2;
+}
+
+// Empties the view once the event's callbacks are done with it
+void env_view_release(lua_State* L) {
+  if (!g_env_view) return;
+  g_env_view->index.env = NULL;
+  g_env_view->index.count = 0;
+
+  if (g_env_view->dirty) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, g_env_view_ref);
+    lua_newtable(L);
+    lua_setfenv(L, -2);
+    lua_pop(L, 1);
+    g_env_view->dirty = false;
+  }
+}
+
+void env_view_register(lua_State* L) {
+  luaL_newmetatable(L, ENV_VIEW);
+  lua_pushcfunction(L, env_view_index);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, env_view_newindex);
+  lua_setfield(L, -2, "__newindex");
+  lua_pushcfunction(L, env_view_pairs);
+  lua_setfield(L, -2, "__pairs");
+  lua_pushcfunction(L, env_view_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pushcfunction(L, env_view_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+}
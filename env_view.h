@@ -0,0 +1,29 @@
+#pragma once
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "env.h"
+
+//
+// The env handed to callbacks is a view into the event buffer instead of a
+// table filled with every key and value. The buffer is indexed in one pass
+// when the event comes in and a lua string is only created for the values a
+// callback actually reads, most read one or two out of ten or more.
+//
+// There is a single view for the whole process, it points at the current
+// event and is emptied once the callbacks returned: anything needed later
+// has to be copied out. Fields assigned by a callback live in a side table
+// until then and shadow the event's own.
+//
+// Stock LuaJIT doesn't look at `__pairs`, use `sb.pairs` to iterate.
+//
+
+void env_view_register(lua_State* L);
+void env_view_push(lua_State* L, char* env);
+const char* env_view_get(const char* key, uint32_t length);
+uint32_t env_view_length();
+void env_view_release(lua_State* L);
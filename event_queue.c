@@ -0,0 +1,252 @@
+#include "event_queue.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#define EVENT_QUEUE_MASK (EVENT_QUEUE_CAPACITY - 1)
+
+struct event_queue_policy_entry {
+  char* event;
+  enum event_policy policy;
+};
+
+static struct event_slot g_slots[EVENT_QUEUE_CAPACITY];
+
+// `g_head` is only written by the receiver and `g_tail` only by the lua
+// thread. Both count up forever, the slot is the index masked.
+static uint32_t g_head = 0;
+static uint32_t g_tail = 0;
+static bool g_closed = false;
+static int g_wake[2] = { -1, -1 };
+
+static struct event_queue_policy_entry g_policies[EVENT_QUEUE_MAX_POLICIES];
+static uint32_t g_policy_count = 0;
+
+// written by the receiver, read by the lua thread
+static uint64_t g_received = 0;
+static uint64_t g_dropped = 0;
+static uint32_t g_max_depth = 0;
+
+// lua thread only
+static uint64_t g_handled = 0;
+static uint64_t g_coalesced = 0;
+
+#define LOAD(value) __atomic_load_n(&(value), __ATOMIC_SEQ_CST)
+#define STORE(value, x) __atomic_store_n(&(value), (x), __ATOMIC_SEQ_CST)
+
+static uint32_t event_queue_hash(const char* item, const char* event) {
+  uint32_t hash = 2166136261u;
+  for (const char* c = item; *c; c++) hash = (hash ^ (unsigned char)*c) * 16777619u;
+  hash = (hash ^ 0xff) * 16777619u;
+  for (const char* c = event; *c; c++) hash = (hash ^ (unsigned char)*c) * 16777619u;
+  return hash;
+}
+
+static bool event_queue_set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+bool event_queue_init() {
+  if (pipe(g_wake) == -1) return false;
+  if (!event_queue_set_nonblocking(g_wake[0])
+      || !event_queue_set_nonblocking(g_wake[1])) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < EVENT_QUEUE_CAPACITY; i++) {
+    g_slots[i].data = malloc(EVENT_QUEUE_SLOT_SIZE);
+    if (!g_slots[i].data) return false;
+    g_slots[i].capacity = EVENT_QUEUE_SLOT_SIZE;
+  }
+  return true;
+}
+
+static void event_queue_wake() {
+  char byte = 0;
+  // a full pipe already wakes the reader
+  while (write(g_wake[1], &byte, 1) == -1 && errno == EINTR);
+}
+
+// Copies `env` into the next free slot, false if the ring is full
+bool event_queue_push(const char* env) {
+  uint32_t head = g_head;
+  uint32_t tail = LOAD(g_tail);
+  if (head - tail == EVENT_QUEUE_CAPACITY) {
+    STORE(g_dropped, g_dropped + 1);
+    return false;
+  }
+
+  // the env ends with an empty key
+  const char* item = "";
+  const char* event = "";
+  uint32_t item_offset = 0, event_offset = 0;
+  uint32_t length = 0;
+  while (env[length]) {
+    const char* key = &env[length];
+    uint32_t key_length = strlen(key);
+    uint32_t value = length + key_length + 1;
+
+    if (strcmp(key, "NAME") == 0) {
+      item = &env[value];
+      item_offset = value;
+    } else if (strcmp(key, "SENDER") == 0) {
+      event = &env[value];
+      event_offset = value;
+    }
+    length = value + strlen(&env[value]) + 1;
+  }
+  length++;
+
+  struct event_slot* slot = &g_slots[head & EVENT_QUEUE_MASK];
+  if (length > slot->capacity) {
+    char* data = realloc(slot->data, length);
+    if (!data) {
+      STORE(g_dropped, g_dropped + 1);
+      return false;
+    }
+    slot->data = data;
+    slot->capacity = length;
+  }
+
+  memcpy(slot->data, env, length);
+  slot->length = length;
+  slot->hash = event_queue_hash(item, event);
+  slot->item = item_offset;
+  slot->event = event_offset;
+
+  STORE(g_received, g_received + 1);
+  if (head + 1 - tail > g_max_depth) STORE(g_max_depth, head + 1 - tail);
+  STORE(g_head, head + 1);
+
+  // The lua thread checks `g_head` after moving `g_tail`, and this checks
+  // `g_tail` after moving `g_head`, so at least one side notices the other.
+  if (LOAD(g_tail) == head) event_queue_wake();
+  return true;
+}
+
+void event_queue_close() {
+  STORE(g_closed, true);
+  event_queue_wake();
+}
+
+static enum event_policy event_queue_find_policy(const char* event) {
+  for (uint32_t i = 0; i < g_policy_count; i++) {
+    if (strcmp(g_policies[i].event, event) == 0) return g_policies[i].policy;
+  }
+  return EVENT_POLICY_ALL;
+}
+
+// Whether a later event in the ring is the same item and event as `slot`
+static bool event_queue_superseded(struct event_slot* slot, uint32_t from, uint32_t head) {
+  const char* item = slot->item ? slot->data + slot->item : "";
+  const char* event = slot->event ? slot->data + slot->event : "";
+
+  for (uint32_t i = from; i != head; i++) {
+    struct event_slot* later = &g_slots[i & EVENT_QUEUE_MASK];
+    if (later->hash != slot->hash) continue;
+
+    const char* later_item = later->item ? later->data + later->item : "";
+    const char* later_event = later->event ? later->data + later->event : "";
+    if (strcmp(item, later_item) == 0 && strcmp(event, later_event) == 0)
+      return true;
+  }
+  return false;
+}
+
+// Returns the next event to handle, which stays valid until
+// `event_queue_done`. NULL if nothing arrived within `timeout_ms` (< 0
+// waits forever), or with `*closed` set once the receiver is gone and
+// everything was handled.
+// `fds` are polled along with the queue, every call sets their `revents`.
+// NULL is returned without `closed` set on a timeout or if one of them is
+// ready.
+char* event_queue_wait(int32_t timeout_ms, struct pollfd* fds, uint32_t count, bool* closed) {
+  *closed = false;
+  for (uint32_t i = 0; i < count; i++) fds[i].revents = 0;
+
+  for (;;) {
+    uint32_t tail = g_tail;
+    uint32_t head = LOAD(g_head);
+
+    while (tail != head) {
+      struct event_slot* slot = &g_slots[tail & EVENT_QUEUE_MASK];
+      const char* event = slot->event ? slot->data + slot->event : "";
+      if (g_policy_count == 0
+          || event_queue_find_policy(event) != EVENT_POLICY_LATEST
+          || !event_queue_superseded(slot, tail + 1, head)) {
+        // a steady stream of events mustn't starve the descriptors
+        if (count > 0) poll(fds, count, 0);
+        return slot->data;
+      }
+
+      g_coalesced++;
+      STORE(g_tail, ++tail);
+    }
+
+    if (LOAD(g_closed) && LOAD(g_head) == tail) {
+      *closed = true;
+      return NULL;
+    }
+
+    struct pollfd pfds[count + 1];
+    pfds[0] = (struct pollfd) { g_wake[0], POLLIN, 0 };
+    memcpy(pfds + 1, fds, count * sizeof(struct pollfd));
+    int ready = poll(pfds, count + 1, timeout_ms);
+    if (ready == -1 && errno != EINTR) return NULL;
+    if (ready == 0) return NULL;
+
+    bool other = false;
+    for (uint32_t i = 0; i < count; i++) {
+      fds[i].revents = pfds[i + 1].revents;
+      if (fds[i].revents) other = true;
+    }
+
+    char drain[64];
+    if (pfds[0].revents) while (read(g_wake[0], drain, sizeof(drain)) > 0);
+    if (other) {
+      // events that came in meanwhile are picked up on the next call
+      return NULL;
+    }
+  }
+}
+
+void event_queue_done() {
+  g_handled++;
+  STORE(g_tail, g_tail + 1);
+}
+
+// `EVENT_POLICY_ALL` removes the policy of `event`
+bool event_queue_policy(const char* event, enum event_policy policy) {
+  for (uint32_t i = 0; i < g_policy_count; i++) {
+    if (strcmp(g_policies[i].event, event) != 0) continue;
+
+    if (policy == EVENT_POLICY_ALL) {
+      free(g_policies[i].event);
+      g_policies[i] = g_policies[--g_policy_count];
+    } else {
+      g_policies[i].policy = policy;
+    }
+    return true;
+  }
+
+  if (policy == EVENT_POLICY_ALL) return true;
+  if (g_policy_count == EVENT_QUEUE_MAX_POLICIES) return false;
+
+  char* name = strdup(event);
+  if (!name) return false;
+  g_policies[g_policy_count++] = (struct event_queue_policy_entry) { name, policy };
+  return true;
+}
+
+struct event_queue_stats event_queue_stats() {
+  struct event_queue_stats stats;
+  stats.depth = LOAD(g_head) - g_tail;
+  stats.max_depth = LOAD(g_max_depth);
+  stats.received = LOAD(g_received);
+  stats.handled = g_handled;
+  stats.dropped = LOAD(g_dropped);
+  stats.coalesced = g_coalesced;
+  return stats;
+}
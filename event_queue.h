@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <poll.h>
+
+#define EVENT_QUEUE_CAPACITY 256
+#define EVENT_QUEUE_SLOT_SIZE 1024
+#define EVENT_QUEUE_MAX_POLICIES 64
+
+//
+// Events are received on their own thread and handed to the thread running
+// lua through this queue, so a slow callback never keeps the bar waiting
+// on the port. The receiver copies every env into a slot of a ring that is
+// allocated up front and hands the slot over, the lua thread gives it back
+// once the handler returns. One producer and one consumer, so the ring
+// only needs its two indices to be atomic.
+//
+// The lua thread sleeps on a pipe the receiver writes to when it adds to
+// an empty ring, which lets it wait for events and a deadline at once.
+//
+// An event whose policy is `EVENT_POLICY_LATEST` is skipped if the same
+// item already has the same event queued behind it, only the newest one is
+// handled. A full ring drops new events.
+//
+enum event_policy {
+  EVENT_POLICY_ALL,
+  EVENT_POLICY_LATEST
+};
+
+struct event_slot {
+  char* data;
+  uint32_t length;
+  uint32_t capacity;
+
+  // of `NAME` and `SENDER`, which identify a repeated event
+  uint32_t hash;
+  uint32_t item;
+  uint32_t event;
+};
+
+struct event_queue_stats {
+  uint32_t depth;
+  uint32_t max_depth;
+  uint64_t received;
+  uint64_t handled;
+  uint64_t dropped;
+  uint64_t coalesced;
+};
+
+bool event_queue_init();
+
+// receiver thread
+bool event_queue_push(const char* env);
+void event_queue_close();
+
+// lua thread
+char* event_queue_wait(int32_t timeout_ms, struct pollfd* fds, uint32_t count, bool* closed);
+void event_queue_done();
+bool event_queue_policy(const char* event, enum event_policy policy);
+struct event_queue_stats event_queue_stats();
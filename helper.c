@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
@@ -11,189 +12,1214 @@
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
-#include <cJSON.h>
 #include "sketchybar.h"
 #include "parsing.h"
+#include "yabai.h"
+#include "cache.h"
+#include "shadow.h"
+#include "pacer.h"
+#include "event_queue.h"
+#include "callbacks.h"
+#include "env_view.h"
+#include "timer_wheel.h"
+#include "spawn.h"
+#include "stats.h"
+#include "bytecode.h"
 #include "./lua/libs.h"
 
 
 #define MACH_HELPER "git.lua.sketchybar"
-#define YABAI_RECV_BUFFER 1024
 
 lua_State *Lg;
-char* yabai_socket_path = NULL;
 
 
 
+// `sb.json_parse(str, lazy)`, with `lazy` set objects and arrays are returned
+// as proxies that decode members on first access (see json_proxy.c)
 int yabai_json_parse(lua_State *Ls) {
-  const char* json = lua_tostring(Ls, 1);
-  json_to_lua_table(Ls, json);
+  size_t len;
+  const char* json = lua_tolstring(Ls, 1, &len);
+  bool lazy = lua_toboolean(Ls, 2);
+  if (!json || !(lazy ? json_decode_lazy(Ls, json, len)
+                      : json_decode(Ls, json, len))) {
+    lua_pushnil(Ls);
+  }
   return 1;
 }
 
-struct sockaddr_un unix_socket(char* socket_path) {
-  struct sockaddr_un address;
-  memset(&address, 0, sizeof(struct sockaddr_un));
-  address.sun_family = AF_UNIX;
-  strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
-  return address;
+int yabai_set_socket_path_lua(lua_State *Ls) {
+  const char* path = luaL_checkstring(Ls, 1);
+  lua_pushboolean(Ls, yabai_set_socket_path(path));
+  return 1;
 }
 
-int yabai_set_socket_path(lua_State *Ls) {
-  const char* path = lua_tostring(Ls, 1);
-  yabai_socket_path = malloc(strlen(path) + 1);
-  strcpy(yabai_socket_path, path);
+int yabai_set_timeout_lua(lua_State *Ls) {
+  yabai_set_timeout(luaL_checkinteger(Ls, 1));
   return 0;
 }
 
-char generate_message(const char* command, char** message_buf) {
-  int command_len = strlen(command);
-  *message_buf = malloc(command_len * 2);
-  char* mbuf = *message_buf;
-  char message_len = 0;
-  mbuf[message_len++] = '\0';
-  mbuf[message_len++] = '\0';
-  mbuf[message_len++] = '\0';
-  mbuf[message_len++] = '\0';
+// Pushes a finished request's result. Errors are pushed as `nil, message`,
+// an empty response as `0` and everything else is decoded from JSON.
+static int yabai_push_response(lua_State *Ls, struct yabai_request* request, bool lazy) {
+  if (request->error) {
+    lua_pushnil(Ls);
+    lua_pushstring(Ls, request->error);
+    return 2;
+  }
 
-  for (int i = 0; i < command_len; i++) {
-    char c = command[i];
-    if (c == ' ') mbuf[message_len++] = '\0';
-    else if (c == 0) break;
-    else mbuf[message_len++] = c;
+  if (request->response.length == 0) {
+    lua_pushinteger(Ls, 0);
+    return 1;
   }
 
-  mbuf[message_len++] = '\0';
-  mbuf[message_len++] = '\0';
-  mbuf[0] = message_len - 4;
+  if (!(lazy ? json_stream_push_lazy(Ls, &request->response)
+             : json_stream_push(Ls, &request->response))) {
+    lua_pushnil(Ls);
+    lua_pushfstring(Ls, "invalid JSON response: %s", request->response.buffer);
+    return 2;
+  }
+  return 1;
+}
 
-  return message_len;
+// Anything that isn't a query might change what the queries return, so
+// the cached ones are dropped before it is sent. True if it was one.
+static bool yabai_cache_invalidate(lua_State* Ls, const char* command) {
+  if (strncmp(command, "query ", 6) == 0) return false;
+  query_cache_invalidate(Ls, "query ");
+  return true;
 }
 
-int recv_all(int fd, char **message) {
-  *message = malloc(1);
-  *message[0] = '\0';
+int yabai_query(lua_State *Ls) {
+  const char *command = luaL_checkstring(Ls, 1);
+  bool lazy = lua_toboolean(Ls, 2);
 
-  char buffer[YABAI_RECV_BUFFER];
-  int bytes_total = 0;
-  while(1) {
-    int bytes = recv(fd, (void*)buffer, YABAI_RECV_BUFFER, 0);
-    if (bytes == -1) return -1; // error
-    if (bytes == 0) break; // no data
+  if (query_cache_get(Ls, command, lazy)) return 1;
+  yabai_cache_invalidate(Ls, command);
 
-    bytes_total += bytes;
-    *message = realloc(*message, strlen(*message) + 1 + YABAI_RECV_BUFFER);
-    strncat(*message, buffer, bytes);
+  struct yabai_request request;
+  if (yabai_request_begin(&request, command))
+    yabai_request_wait(&request, 1);
 
-    if (bytes < YABAI_RECV_BUFFER) break; // done
-  }
-  return bytes_total;
+  int returns = yabai_push_response(Ls, &request, lazy);
+  yabai_request_free(&request);
+  if (returns == 1) query_cache_put(Ls, command, lazy, -1);
+  return returns;
 }
 
-int yabai_query(lua_State *Ls) {
-  if (yabai_socket_path == NULL) return -1;
+// `sb.yabai_query_many({ "query --spaces", "query --windows" })` runs every
+// query concurrently and returns `results, errors`. A failed query leaves
+// `false` in `results` and its message at the same index in `errors`.
+// Pass `true` as the second argument to get lazy proxies back. Commands that
+// aren't queries invalidate the cache like they do in `sb.yabai_query`,
+// and queries that ran alongside one aren't cached: they may have been
+// answered before or after it.
+int yabai_query_many(lua_State *Ls) {
+  luaL_checktype(Ls, 1, LUA_TTABLE);
+  int count = lua_objlen(Ls, 1);
+  bool lazy = lua_toboolean(Ls, 2);
 
-  const char *command = lua_tostring(Ls, 1);
-  char *send_message = NULL, *recv_message = NULL;
-  char send_len = generate_message(command, &send_message);
-  struct sockaddr_un address = unix_socket(yabai_socket_path);
+  lua_createtable(Ls, count, 0);
+  lua_newtable(Ls);
+  int results = lua_gettop(Ls) - 1, errors = results + 1;
 
-  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct yabai_request requests[YABAI_MAX_INFLIGHT];
+  for (int batch = 0; batch < count; batch += YABAI_MAX_INFLIGHT) {
+    int batch_count = count - batch < YABAI_MAX_INFLIGHT ? count - batch
+                                                         : YABAI_MAX_INFLIGHT;
 
-  if (fd == -1) {
-    fprintf(stderr, "Could not open socket [%d]\n", errno);
-    return -1;
-  }
-  if (connect(fd, (struct sockaddr *) &address, sizeof(struct sockaddr_un) - 1) == -1) {
-    fprintf(stderr, "Could not open connection [%d]\n", errno);
-    return -1;
+    bool cached[YABAI_MAX_INFLIGHT];
+    bool changes = false;
+    for (int i = 0; i < batch_count; i++) {
+      lua_rawgeti(Ls, 1, batch + i + 1);
+      const char* command = lua_tostring(Ls, -1);
+      cached[i] = command && query_cache_get(Ls, command, lazy);
+      if (command && !cached[i] && yabai_cache_invalidate(Ls, command))
+        changes = true;
+      if (cached[i]) {
+        lua_rawseti(Ls, results, batch + i + 1);
+        requests[i] = (struct yabai_request) { .fd = -1 };
+        json_stream_init(&requests[i].response);
+      }
+      else if (command) yabai_request_begin(&requests[i], command);
+      else {
+        requests[i] = (struct yabai_request) { .fd = -1 };
+        json_stream_init(&requests[i].response);
+        requests[i].error = "query is not a string";
+      }
+      lua_pop(Ls, 1);
+    }
+
+    yabai_request_wait(requests, batch_count);
+
+    for (int i = 0; i < batch_count; i++) {
+      if (cached[i]) continue;
+      if (yabai_push_response(Ls, &requests[i], lazy) == 2) {
+        lua_rawseti(Ls, errors, batch + i + 1);
+        lua_pop(Ls, 1);
+        lua_pushboolean(Ls, false);
+      } else if (!changes) {
+        lua_rawgeti(Ls, 1, batch + i + 1);
+        query_cache_put(Ls, lua_tostring(Ls, -1), lazy, -2);
+        lua_pop(Ls, 1);
+      }
+      lua_rawseti(Ls, results, batch + i + 1);
+      yabai_request_free(&requests[i]);
+    }
   }
-  if (send(fd, send_message, send_len, 0) == -1) {
-    fprintf(stderr, "Could not send message [%d]\n", errno);
-    return -1;
+
+  return 2;
+}
+
+// `sb.cache_rule(query, events, ttl_ms)` caches `query` until one of
+// `events` (a name or a list of names) arrives or `ttl_ms` passes.
+// `sb.cache_rule(query, false)` stops caching it.
+int query_cache_rule_lua(lua_State *Ls) {
+  const char* query = luaL_checkstring(Ls, 1);
+  if (lua_isboolean(Ls, 2) && !lua_toboolean(Ls, 2)) {
+    query_cache_remove_rule(Ls, query);
+    return 0;
   }
-  if (recv_all(fd, &recv_message) == -1) {
-    fprintf(stderr, "Could not receive data over socket [%d]\n", errno);
-    return -1;
+
+  // read before the event names below are pushed over slot 3
+  uint32_t ttl = luaL_optinteger(Ls, 3, QUERY_CACHE_TTL_MS);
+  const char* events[QUERY_CACHE_MAX_EVENTS];
+  uint32_t event_count = 0;
+  if (lua_type(Ls, 2) == LUA_TSTRING) {
+    events[event_count++] = lua_tostring(Ls, 2);
+  } else if (lua_istable(Ls, 2)) {
+    int count = lua_objlen(Ls, 2);
+    if (count > QUERY_CACHE_MAX_EVENTS)
+      return luaL_error(Ls, "at most %d events per cache rule", QUERY_CACHE_MAX_EVENTS);
+
+    for (int i = 1; i <= count; i++) {
+      // left on the stack so the strings stay alive until they are copied
+      lua_rawgeti(Ls, 2, i);
+      events[event_count++] = luaL_checkstring(Ls, -1);
+    }
   }
 
-  close(fd);
+  lua_pushboolean(Ls, query_cache_rule(query, events, event_count, ttl));
+  return 1;
+}
+
+// `sb.cache_get(query, lazy)` returns `value, true` on a hit
+int query_cache_get_lua(lua_State *Ls) {
+  const char* query = luaL_checkstring(Ls, 1);
+  if (!query_cache_get(Ls, query, lua_toboolean(Ls, 2))) return 0;
+  lua_pushboolean(Ls, true);
+  return 2;
+}
 
-  int returns = 0;
-  if (strlen(recv_message) == 0) {
-    lua_pushinteger(Ls, 0);
-    returns = 1;
-  } else if (json_to_lua_table(Ls, recv_message)) {
-    returns = 1;
-  }else {
-    fprintf(stderr, "JSON error\n");
-    fprintf(stderr, "Command: %s\n", command);
-    fprintf(stderr, "%s\n", recv_message);
-  };
-  free(send_message);
-  free(recv_message);
-  return returns;
+// `sb.cache_put(query, lazy, value)`
+int query_cache_put_lua(lua_State *Ls) {
+  query_cache_put(Ls, luaL_checkstring(Ls, 1), lua_toboolean(Ls, 2), 3);
+  return 0;
+}
+
+// `sb.cache_invalidate(prefix)`, drops everything without a prefix
+int query_cache_invalidate_lua(lua_State *Ls) {
+  query_cache_invalidate(Ls, luaL_optstring(Ls, 1, NULL));
+  return 0;
+}
+
+int query_cache_stats_lua(lua_State *Ls) {
+  struct query_cache_stats stats = query_cache_stats();
+  lua_createtable(Ls, 0, 4);
+  lua_pushnumber(Ls, stats.hits);
+  lua_setfield(Ls, -2, "hits");
+  lua_pushnumber(Ls, stats.misses);
+  lua_setfield(Ls, -2, "misses");
+  lua_pushnumber(Ls, stats.invalidations);
+  lua_setfield(Ls, -2, "invalidations");
+  lua_pushinteger(Ls, stats.entries);
+  lua_setfield(Ls, -2, "entries");
+  return 1;
+}
+
+// `sb.invalidate(item)` forgets what was sent to `item`, its next `--set`
+// goes through in full. Needed when something outside of the helper
+// changes the item.
+int shadow_invalidate_lua(lua_State *Ls) {
+  shadow_invalidate(luaL_checkstring(Ls, 1));
+  return 0;
+}
+
+// `sb.forget()` forgets every item
+int shadow_reset_lua(lua_State *Ls) {
+  shadow_reset();
+  return 0;
+}
+
+// `sb.shadow(false)` sends every `--set` as it is
+int shadow_enable_lua(lua_State *Ls) {
+  luaL_checktype(Ls, 1, LUA_TBOOLEAN);
+  shadow_set_enabled(lua_toboolean(Ls, 1));
+  return 0;
+}
+
+int shadow_stats_lua(lua_State *Ls) {
+  struct shadow_stats stats = shadow_stats();
+  lua_createtable(Ls, 0, 6);
+  lua_pushnumber(Ls, stats.suppressed);
+  lua_setfield(Ls, -2, "suppressed");
+  lua_pushnumber(Ls, stats.suppressed_commands);
+  lua_setfield(Ls, -2, "suppressed_commands");
+  lua_pushnumber(Ls, stats.sent);
+  lua_setfield(Ls, -2, "sent");
+  lua_pushinteger(Ls, stats.items);
+  lua_setfield(Ls, -2, "items");
+  lua_pushinteger(Ls, stats.properties);
+  lua_setfield(Ls, -2, "properties");
+  lua_pushinteger(Ls, stats.pending);
+  lua_setfield(Ls, -2, "pending");
+  return 1;
+}
+
+static struct command_filter g_shadow = { shadow_filter, shadow_mark, shadow_sent, shadow_reset };
+
+//
+// Commands are batched into one message per event: `handler` opens a
+// transaction before calling into lua and commits it afterwards, and
+// `sb.batch(fn)` does the same for code running outside of a callback.
+// Batches nest, only the outermost one is committed.
+//
+// Queries need their reply, so they flush whatever is pending and are sent
+// on their own.
+//
+static uint32_t g_batch_depth = 0;
+
+static void batch_begin() {
+  if (g_batch_depth++ == 0) transaction_create();
+}
+
+static void batch_end() {
+  if (g_batch_depth > 0 && --g_batch_depth == 0) transaction_commit();
+}
+
+static void batch_flush() {
+  if (g_batch_depth == 0) return;
+  transaction_commit();
+  transaction_create();
+}
+
+// `sb.callback_register(item, event, fn)`, a nil item or event matches all
+static int callback_register_lua(lua_State *L) {
+  const char* item = luaL_optstring(L, 1, "");
+  const char* event = luaL_optstring(L, 2, "");
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+
+  if (!callback_index_add(L, item, event, 3))
+    return luaL_error(L, "out of memory registering a callback");
+  return 0;
+}
+
+// `sb.callback_dispatch(item, event, env)` is what `sb.callback` is unless
+// it gets replaced, `handler` calls the index directly in that case.
+static int callback_dispatch_lua(lua_State *L) {
+  lua_settop(L, 3);
+  const char* item = lua_isstring(L, 1) ? lua_tostring(L, 1) : "";
+  const char* event = lua_isstring(L, 2) ? lua_tostring(L, 2) : "";
+  lua_pushinteger(L, callback_index_dispatch(L, item, event, 1, 2, 3));
+  return 1;
+}
+
+//
+// Events are dispatched without allocating once things are warmed up:
+//
+// - `sketchybar.callback` is looked up once after the config is loaded and
+//   kept in the registry (see `handler_cache_callback`), so replacing it
+//   later on has no effect. As long as it is `sb.callback_dispatch` the
+//   callback index is used directly.
+// - keys are upper-case because sketchybar was designed with shell
+//   scripting in mind, lower-case is more conventional for lua. They are
+//   lowered in place while the event is indexed.
+// - the env is a view into the event (see `env_view.h`), only the item,
+//   the event and the values callbacks read become lua strings. It is only
+//   valid during the callback, anything needed later has to be copied out.
+//
+static int g_handler_callback = LUA_NOREF;
+static bool g_handler_native = false;
+
+void handler_cache_callback(lua_State* L) {
+  luaL_unref(L, LUA_REGISTRYINDEX, g_handler_callback);
+  lua_getglobal(L, "sketchybar");
+  lua_getfield(L, -1, "callback");
+  g_handler_native = lua_tocfunction(L, -1) == callback_dispatch_lua;
+  if (lua_isfunction(L, -1)) {
+    g_handler_callback = luaL_ref(L, LUA_REGISTRYINDEX);
+  } else {
+    g_handler_callback = LUA_NOREF;
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
 }
 
 void handler(env env) {
-  if (!Lg) { return; }
-
-  uint32_t caret = 0;
-  char* item = "";
-  char* event = "";
-  lua_newtable(Lg);
-  for(;;) {
-    if (!env[caret]) break;
-    char* key = &env[caret];
-    int key_len = strlen(key);
-    char* value = &env[caret + key_len + 1];
-    int value_len = strlen(value);
-
-    // keys are upper-case because sketchybar was designed with shell scripting
-    // in mind. lower-case is more conventional for lua.
-    for(int i = 0; i < key_len; i++) { key[i] = tolower(key[i]); }
-
-    lua_pushlstring(Lg, key, strlen(key));
-    lua_pushlstring(Lg, value, strlen(value));
-    lua_settable(Lg, -3);
-
-    if (strcmp(key, "name") == 0) {
-      item = value;
-    } else if (strcmp(key, "sender") == 0) {
-      event = value;
-    }
-    caret += key_len + value_len + 2;
-  }
-
-  // Get `callback` from the `sketchybar` global, this way callback handling
-  // can be overridden by users.
-  //
-  // However, it would be more performant to only do this table lookup once
-  // when `core.lua` is loaded and then store the event callback in the lua
-  // registry. Not sure which approach is best.
-  lua_getglobal(Lg, "sketchybar");
-  lua_getfield(Lg, -1, "callback");
-  if (lua_isfunction(Lg, -1) == 1) {
-    lua_pushlstring(Lg, item, strlen(item));
-    lua_pushlstring(Lg, event, strlen(event));
-    lua_pushvalue(Lg, -5);
-    int callback_success = lua_pcall(Lg, 3, 0, 0);
-    if (callback_success != 0) {
-      fprintf(stderr, "Callback error:\n");
-      fprintf(stderr, "%s\n", lua_tostring(Lg, -1));
-      fflush(stderr);
-    }
+  if (!Lg || g_handler_callback == LUA_NOREF) { return; }
+
+  // callback, item, event, env
+  lua_rawgeti(Lg, LUA_REGISTRYINDEX, g_handler_callback);
+  lua_pushnil(Lg);
+  lua_pushnil(Lg);
+  env_view_push(Lg, env);
+  int item = lua_gettop(Lg) - 2, event = item + 1, view = item + 2;
+
+  const char* name = env_view_get("name", 4);
+  const char* sender = env_view_get("sender", 6);
+  if (!name) name = "";
+  if (!sender) sender = "";
+  lua_pushstring(Lg, name);
+  lua_replace(Lg, item);
+  lua_pushstring(Lg, sender);
+  lua_replace(Lg, event);
+
+  // cached queries are dropped before any callback gets to see the event
+  query_cache_event(Lg, sender);
+
+  uint64_t start = stats_now_ns();
+  batch_begin();
+  if (g_handler_native) {
+    callback_index_dispatch(Lg, name, sender, item, event, view);
+  } else if (lua_pcall(Lg, 3, 0, 0) != 0) {
+    fprintf(stderr, "Callback error:\n");
+    fprintf(stderr, "%s\n", lua_tostring(Lg, -1));
+    fflush(stderr);
   }
+  batch_end();
+  stats_dispatch(name, sender, env_view_length(), stats_now_ns() - start);
+  env_view_release(Lg);
   lua_settop(Lg, 0);
 }
 
+// `sb.serialize(config, extra)` returns the `key=value` arguments for a
+// config table and a table holding its special keys (or nil)
+static int serialize_config_lua(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  const char* extra = luaL_optstring(L, 2, NULL);
+  lua_settop(L, 2);
+  lua_pushnil(L);
+
+  uint32_t length;
+  char* pairs = parse_kv_table(L, 1, 3, extra, &length);
+  lua_pushlstring(L, pairs, length);
+  lua_insert(L, 3);
+  return 2;
+}
+
+// `sb.serializer_configure(key_aliases, special_keys)`
+static int serializer_configure_lua(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  parse_kv_configure(L, 1, 2);
+  return 0;
+}
+
 static int sketchybar_cmd(lua_State *L) {
   const char* message = lua_tostring(L, 1);
+  if (!message) return 0;
+
+  if (g_batch_depth > 0 && strncmp(message, "--query", 7) == 0) {
+    transaction_commit();
+    char* result = sketchybar((char*)message);
+    lua_pushstring(L, result);
+    transaction_create();
+    return 1;
+  }
+
   char* result = sketchybar((char*)message);
   lua_pushstring(L, result);
   return 1;
 }
 
+//
+// `sb.command_argv({ "--set", name, "label=it's \"quoted\"" })` sends the
+// arguments as they are, nothing is split or unquoted. Config tables can be
+// passed as arguments and become one `key=value` argument per pair.
+// `sb.setv(name, key, value, ...)` is a shorthand for `--set`.
+//
+// The arguments are collected in their own buffer first, so an error
+// halfway through doesn't leave half a command in a batch.
+//
+static struct parse_kv_buffer g_argv = { 0 };
+
+static int command_argv_send(lua_State *L) {
+  bool query = g_argv.length >= 8 && memcmp(g_argv.data, "--query", 8) == 0;
+
+  char* result;
+  if (g_batch_depth > 0 && query) {
+    transaction_commit();
+    result = sketchybar_argv(g_argv.data, g_argv.length);
+    transaction_create();
+  } else {
+    result = sketchybar_argv(g_argv.data, g_argv.length);
+  }
+
+  lua_pushstring(L, result);
+  return 1;
+}
+
+static int command_argv_lua(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int count = lua_objlen(L, 1);
+
+  g_argv.length = 0;
+  for (int i = 1; i <= count; i++) {
+    lua_rawgeti(L, 1, i);
+    parse_kv_argument(L, -1, &g_argv);
+    lua_pop(L, 1);
+  }
+
+  if (g_argv.length == 0) return 0;
+  return command_argv_send(L);
+}
+
+static int setv_lua(lua_State *L) {
+  int top = lua_gettop(L);
+  luaL_checkstring(L, 1);
+  if (top % 2 == 0) return luaL_error(L, "sb.setv expects key value pairs");
+
+  g_argv.length = 0;
+  lua_pushliteral(L, "--set");
+  parse_kv_argument(L, -1, &g_argv);
+  lua_pop(L, 1);
+  parse_kv_argument(L, 1, &g_argv);
+
+  for (int i = 2; i < top; i += 2) parse_kv_pair_argument(L, i, i + 1, &g_argv);
+  return command_argv_send(L);
+}
+
+// `sb.batch(fn, ...)` calls `fn` and sends every command it issues as one
+// message, returning whatever `fn` returns
+static int batch_lua(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  int base = lua_gettop(L);
+
+  batch_begin();
+  int status = lua_pcall(L, base - 1, LUA_MULTRET, 0);
+  batch_end();
+
+  if (status != 0) return lua_error(L);
+  return lua_gettop(L);
+}
+
+// `sb.flush()` sends the commands batched so far right away
+static int flush_lua(lua_State *L) {
+  batch_flush();
+  return 0;
+}
+
+//
+// `sb.pace(frame_ms)` holds commands back for up to `frame_ms` (16 without
+// an argument) and sends them combined once per frame, with repeated sets
+// of a property merged into the last one. `sb.pace(0)` sends everything as
+// it comes again.
+//
+// `sb.urgent(fn, ...)` sends the commands issued by `fn` right away, along
+// with everything held back before them.
+//
+static struct command_scheduler g_pacer = { pacer_queue, pacer_take, pacer_due_in };
+
+static int pace_lua(lua_State *L) {
+  int frame_ms = lua_isboolean(L, 1)
+                 ? (lua_toboolean(L, 1) ? PACER_DEFAULT_FRAME_MS : 0)
+                 : luaL_optinteger(L, 1, PACER_DEFAULT_FRAME_MS);
+  if (frame_ms < 0) return luaL_error(L, "sb.pace expects a frame length >= 0");
+
+  pacer_configure(frame_ms);
+  if (frame_ms == 0) command_scheduler_flush();
+  return 0;
+}
+
+static int urgent_lua(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  int base = lua_gettop(L);
+
+  // commands of the surrounding batch were issued first and go first
+  batch_begin();
+  batch_flush();
+  pacer_urgent(true);
+  int status = lua_pcall(L, base - 1, LUA_MULTRET, 0);
+  batch_flush();
+  pacer_urgent(false);
+  batch_end();
+
+  if (status != 0) return lua_error(L);
+  return lua_gettop(L);
+}
+
+static int pace_stats_lua(lua_State *L) {
+  struct pacer_stats stats = pacer_stats();
+  lua_createtable(L, 0, 4);
+  lua_pushnumber(L, stats.frames);
+  lua_setfield(L, -2, "frames");
+  lua_pushnumber(L, stats.messages);
+  lua_setfield(L, -2, "messages");
+  lua_pushnumber(L, stats.merged);
+  lua_setfield(L, -2, "merged");
+  lua_pushnumber(L, stats.bypassed);
+  lua_setfield(L, -2, "bypassed");
+  return 1;
+}
+
+//
+// `sb.coalesce(event, "latest")` only handles the newest of the `event`s an
+// item has queued while lua was busy, `sb.coalesce(event, "all")` handles
+// every one of them again.
+//
+static int coalesce_lua(lua_State *L) {
+  static const char* policies[] = { "all", "latest", NULL };
+  const char* event = luaL_checkstring(L, 1);
+  enum event_policy policy = luaL_checkoption(L, 2, "latest", policies);
+
+  if (!event_queue_policy(event, policy))
+    return luaL_error(L, "at most %d coalesced events", EVENT_QUEUE_MAX_POLICIES);
+  return 0;
+}
+
+static int event_stats_lua(lua_State *L) {
+  struct event_queue_stats stats = event_queue_stats();
+  lua_createtable(L, 0, 6);
+  lua_pushinteger(L, stats.depth);
+  lua_setfield(L, -2, "depth");
+  lua_pushinteger(L, stats.max_depth);
+  lua_setfield(L, -2, "max_depth");
+  lua_pushnumber(L, stats.received);
+  lua_setfield(L, -2, "received");
+  lua_pushnumber(L, stats.handled);
+  lua_setfield(L, -2, "handled");
+  lua_pushnumber(L, stats.dropped);
+  lua_setfield(L, -2, "dropped");
+  lua_pushnumber(L, stats.coalesced);
+  lua_setfield(L, -2, "coalesced");
+  return 1;
+}
+
+//
+// `sb.every(ms, fn)` calls `fn(id)` every `ms`, `sb.after(ms, fn)` once after
+// `ms`, both return an id for `sb.cancel(id)`. Timers are kept in the helper
+// and run between events, so a clock or a cpu graph doesn't need the bar
+// to send an `update_freq` event for every tick. Everything that is due at
+// the same time runs in one batch and is sent as one message.
+//
+static void timers_run() {
+  if (!timer_wheel_expire()) return;
+
+  batch_begin();
+  uint32_t id;
+  int ref;
+  bool periodic;
+  while (timer_wheel_pop(&id, &ref, &periodic)) {
+    lua_rawgeti(Lg, LUA_REGISTRYINDEX, ref);
+    // a one-shot timer is gone already, nothing else needs the function
+    if (!periodic) luaL_unref(Lg, LUA_REGISTRYINDEX, ref);
+
+    lua_pushnumber(Lg, id);
+    if (lua_pcall(Lg, 1, 0, 0) != 0) {
+      fprintf(stderr, "Timer error:\n");
+      fprintf(stderr, "%s\n", lua_tostring(Lg, -1));
+      fflush(stderr);
+      lua_pop(Lg, 1);
+    }
+  }
+  batch_end();
+}
+
+static struct event_timers g_timers = { timer_wheel_due_in, timers_run };
+
+static int timer_add(lua_State *L, bool periodic) {
+  lua_Integer ms = luaL_checkinteger(L, 1);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  if (ms < (periodic ? 1 : 0) || ms > UINT32_MAX)
+    return luaL_error(L, "invalid timer interval %d", (int)ms);
+
+  lua_pushvalue(L, 2);
+  int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  uint32_t id = timer_wheel_add(ms, periodic ? ms : 0, ref);
+  if (id == 0) {
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    return luaL_error(L, "could not add a timer");
+  }
+  lua_pushnumber(L, id);
+  return 1;
+}
+
+static int every_lua(lua_State *L) {
+  return timer_add(L, true);
+}
+
+static int after_lua(lua_State *L) {
+  return timer_add(L, false);
+}
+
+static int cancel_lua(lua_State *L) {
+  int ref;
+  bool cancelled = timer_wheel_cancel(luaL_checkinteger(L, 1), &ref);
+  if (cancelled) luaL_unref(L, LUA_REGISTRYINDEX, ref);
+  lua_pushboolean(L, cancelled);
+  return 1;
+}
+
+static int timer_stats_lua(lua_State *L) {
+  struct timer_wheel_stats stats = timer_wheel_stats();
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, stats.active);
+  lua_setfield(L, -2, "active");
+  lua_pushnumber(L, stats.fired);
+  lua_setfield(L, -2, "fired");
+  lua_pushnumber(L, stats.fired ? (double)stats.late_ms / stats.fired : 0);
+  lua_setfield(L, -2, "mean_late_ms");
+  lua_pushnumber(L, stats.max_late_ms);
+  lua_setfield(L, -2, "max_late_ms");
+  return 1;
+}
+
+//
+// Only the coroutines `sb.async` and `sb.await_all` run are yielded to wait
+// for a process or a query, core.lua keeps them as the weak keys of
+// `sb.async_threads`. Any other coroutine waits in place like the main
+// thread does: it was resumed by someone else, a yield would go to them.
+//
+#define ASYNC_THREADS "sketchybar.async"
+
+static bool async_thread(lua_State* L) {
+  if (lua_pushthread(L) == 1) {
+    lua_pop(L, 1);
+    return false;
+  }
+  lua_getfield(L, LUA_REGISTRYINDEX, ASYNC_THREADS);
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 2);
+    return false;
+  }
+  lua_pushvalue(L, -2);
+  lua_rawget(L, -2);
+  bool async = lua_toboolean(L, -1);
+  lua_pop(L, 3);
+  return async;
+}
+
+static void async_threads_register(lua_State* L) {
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_pushliteral(L, "k");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, LUA_REGISTRYINDEX, ASYNC_THREADS);
+}
+
+//
+// `sb.spawn(command, fn)` runs `command` without blocking lua and calls
+// `fn(output, status)` once it exited. Without `fn` it yields the calling
+// coroutine until then and returns `output, status` (see `sb.async`), and
+// anywhere else it just waits. `status` is the exit code, -1 if
+// the process couldn't be started.
+//
+// `command` is a table of arguments or a string split at spaces like a
+// sketchybar command. A string using anything a shell would have to deal
+// with (pipes, variables, globs, redirects) is run by `/bin/sh -c`.
+//
+// `sb.spawn_limit(n)` caps how many run at the same time, the rest wait.
+//
+#define SPAWN_SHELL_CHARACTERS "|&;<>()$`\\*?[]{}~#=\n\t"
+
+static struct parse_kv_buffer g_spawn_argv = { 0 };
+static struct command_buffer g_spawn_command = { 0 };
+
+static bool spawn_append_argument(struct command_buffer* buffer, const char* argument) {
+  uint32_t length = strlen(argument) + 1;
+  if (!command_buffer_reserve(buffer, length)) return false;
+  memcpy(buffer->data + buffer->length, argument, length);
+  buffer->length += length;
+  return true;
+}
+
+// The arguments in the wire format, NULL if there are none
+static const char* spawn_arguments(lua_State* L, int index) {
+  if (lua_istable(L, index)) {
+    g_spawn_argv.length = 0;
+    int count = lua_objlen(L, index);
+    for (int i = 1; i <= count; i++) {
+      lua_rawgeti(L, index, i);
+      parse_kv_argument(L, -1, &g_spawn_argv);
+      lua_pop(L, 1);
+    }
+    if (g_spawn_argv.length == 0 || !parse_kv_reserve(&g_spawn_argv, 1)) return NULL;
+    g_spawn_argv.data[g_spawn_argv.length++] = '\0';
+    return g_spawn_argv.data;
+  }
+
+  const char* command = luaL_checkstring(L, index);
+  g_spawn_command.length = 0;
+  bool appended = strpbrk(command, SPAWN_SHELL_CHARACTERS)
+                  ? spawn_append_argument(&g_spawn_command, "/bin/sh")
+                    && spawn_append_argument(&g_spawn_command, "-c")
+                    && spawn_append_argument(&g_spawn_command, command)
+                  : command_buffer_append(&g_spawn_command, command);
+
+  if (!appended || g_spawn_command.length == 0
+      || !command_buffer_reserve(&g_spawn_command, 1)) {
+    return NULL;
+  }
+  g_spawn_command.data[g_spawn_command.length++] = '\0';
+  return g_spawn_command.data;
+}
+
+static uint32_t spawn_arguments_length(const char* args) {
+  uint32_t length = 0;
+  while (args[length]) length += strlen(args + length) + 1;
+  return length + 1;
+}
+
+static int spawn_lua(lua_State *L) {
+  const char* args = spawn_arguments(L, 1);
+  if (!args) return luaL_error(L, "sb.spawn needs a command");
+
+  if (lua_isfunction(L, 2)) {
+    lua_pushvalue(L, 2);
+  } else if (async_thread(L)) {
+    lua_pushthread(L);
+  } else {
+    struct spawn_result result;
+    spawn_run(args, &result);
+    lua_pushlstring(L, result.output ? result.output : "", result.length);
+    lua_pushinteger(L, result.status);
+    spawn_result_free(&result);
+    return 2;
+  }
+
+  int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (!spawn_start(args, spawn_arguments_length(args), ref)) {
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    return luaL_error(L, "out of memory starting a process");
+  }
+
+  if (lua_isfunction(L, 2)) return 0;
+  return lua_yield(L, 0);
+}
+
+static int spawn_limit_lua(lua_State *L) {
+  spawn_limit(luaL_checkinteger(L, 1));
+  return 0;
+}
+
+// `sb.stats()`, see stats.h
+static int stats_lua(lua_State *L) {
+  stats_push(L);
+  return 1;
+}
+
+static int stats_reset_lua(lua_State *L) {
+  stats_reset();
+  return 0;
+}
+
+// `sb.loadfile(path)` is `loadfile` through the bytecode cache (see
+// bytecode.h), the user config and its modules are loaded with it
+static int loadfile_lua(lua_State *L) {
+  if (bytecode_loadfile(L, luaL_checkstring(L, 1)) == 0) return 1;
+  lua_pushnil(L);
+  lua_insert(L, -2);
+  return 2;
+}
+
+static int bytecode_stats_lua(lua_State *L) {
+  struct bytecode_stats stats = bytecode_stats();
+  lua_createtable(L, 0, 3);
+  lua_pushnumber(L, stats.hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, stats.misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushnumber(L, stats.failed);
+  lua_setfield(L, -2, "failed");
+  return 1;
+}
+
+static int spawn_stats_lua(lua_State *L) {
+  struct spawn_stats stats = spawn_stats();
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, stats.running);
+  lua_setfield(L, -2, "running");
+  lua_pushinteger(L, stats.pending);
+  lua_setfield(L, -2, "pending");
+  lua_pushnumber(L, stats.started);
+  lua_setfield(L, -2, "started");
+  lua_pushnumber(L, stats.failed);
+  lua_setfield(L, -2, "failed");
+  return 1;
+}
+
+// Hands the output of finished processes to whoever is waiting for it,
+// all in one batch
+static void spawn_loop_ready(struct pollfd* fds, uint32_t count) {
+  spawn_ready(fds, count);
+  if (spawn_due_in() != 0) return;
+
+  batch_begin();
+  struct spawn_result result;
+  while (spawn_pop(&result)) {
+    lua_rawgeti(Lg, LUA_REGISTRYINDEX, result.data);
+    luaL_unref(Lg, LUA_REGISTRYINDEX, result.data);
+
+    if (lua_isthread(Lg, -1)) {
+      lua_State* co = lua_tothread(Lg, -1);
+      lua_pushlstring(co, result.output ? result.output : "", result.length);
+      lua_pushinteger(co, result.status);
+      int status = lua_resume(co, 2);
+      if (status != 0 && status != LUA_YIELD) {
+        fprintf(stderr, "Spawn error:\n");
+        fprintf(stderr, "%s\n", lua_tostring(co, -1));
+        fflush(stderr);
+      }
+    } else {
+      lua_pushlstring(Lg, result.output ? result.output : "", result.length);
+      lua_pushinteger(Lg, result.status);
+      if (lua_pcall(Lg, 2, 0, 0) != 0) {
+        fprintf(stderr, "Spawn error:\n");
+        fprintf(stderr, "%s\n", lua_tostring(Lg, -1));
+        fflush(stderr);
+      }
+    }
+    lua_settop(Lg, 0);
+    spawn_result_free(&result);
+  }
+  batch_end();
+}
+
+//
+// `sb.query_async(query, lazy)` and `sb.yabai_query_async(command, lazy)`
+// are `sb.query` and `sb.yabai_query` for coroutines (see `sb.async`). The
+// query is sent right away, but the coroutine only continues once the reply
+// is there and the events arriving meanwhile are handled as usual. Any
+// number of coroutines can wait at the same time, `sb.await_all` runs
+// several functions side by side and waits for all of them. Outside of
+// them both wait like the plain queries.
+//
+// The bar gets as long to answer as for any other query, nil is returned
+// after that. yabai gets its usual timeout and fails with `nil, message`.
+//
+
+enum query_kind { QUERY_BAR, QUERY_YABAI };
+
+struct query {
+  enum query_kind kind;
+  // bar queries are matched by seq, yabai queries have a socket each. A
+  // bar query sent before the transport's epoch changed gets no reply.
+  uint32_t seq;
+  uint32_t epoch;
+  char* response;
+  int fd;
+  // the waiting coroutine
+  int ref;
+  bool lazy;
+  bool done;
+  uint64_t deadline;
+  // for `stats`, bar queries are recorded once they are resumed
+  uint64_t started_ns;
+  uint32_t sent;
+
+  // the cache key and the cache generation the query was sent in
+  char* key;
+  uint64_t generation;
+
+  struct yabai_request yabai;
+};
+
+static struct query* g_queries = NULL;
+static uint32_t g_query_count = 0;
+static uint32_t g_query_capacity = 0;
+
+static struct command_buffer g_query_command = { 0 };
+
+static uint64_t query_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Takes the coroutine on top of the stack along
+static bool query_add(lua_State* L, struct query* query, const char* key, uint32_t timeout_ms) {
+  if (g_query_count == g_query_capacity) {
+    uint32_t capacity = g_query_capacity ? g_query_capacity * 2 : 16;
+    struct query* queries = realloc(g_queries, capacity * sizeof(struct query));
+    if (!queries) return false;
+    g_queries = queries;
+    g_query_capacity = capacity;
+  }
+
+  query->key = strdup(key);
+  if (!query->key) return false;
+  query->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  query->done = false;
+  query->deadline = query_now_ms() + timeout_ms;
+  query->started_ns = stats_now_ns();
+  query->generation = query_cache_generation();
+  g_queries[g_query_count++] = *query;
+  return true;
+}
+
+// Queries need their reply, so the batch so far goes out before them
+static char* query_bar_send(char* message) {
+  if (g_batch_depth == 0) return sketchybar(message);
+
+  transaction_commit();
+  char* result = sketchybar(message);
+  transaction_create();
+  return result;
+}
+
+static bool query_bar_push(lua_State* L, const char* response, bool lazy) {
+  uint32_t length = response ? strlen(response) : 0;
+  if (length == 0 || !(lazy ? json_decode_lazy(L, response, length)
+                            : json_decode(L, response, length))) {
+    lua_pushnil(L);
+    return false;
+  }
+  return true;
+}
+
+static int query_async_lua(lua_State *L) {
+  const char* query = luaL_checkstring(L, 1);
+  bool lazy = lua_toboolean(L, 2);
+  const char* key = lua_pushfstring(L, "--query %s", query);
+  if (query_cache_get(L, key, lazy)) return 1;
+
+  if (!async_thread(L)) {
+    if (query_bar_push(L, query_bar_send((char*)key), lazy))
+      query_cache_put(L, key, lazy, -1);
+    return 1;
+  }
+
+  if (g_batch_depth > 0) {
+    transaction_commit();
+    transaction_create();
+  }
+  command_scheduler_flush();
+
+  g_query_command.length = 0;
+  if (!command_buffer_append(&g_query_command, key)
+      || !command_buffer_reserve(&g_query_command, 1)) {
+    return luaL_error(L, "out of memory sending a query");
+  }
+  g_query_command.data[g_query_command.length] = '\0';
+
+  uint32_t seq = transport_get()->request(g_query_command.data,
+                                         g_query_command.length + 1);
+  if (seq == 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+
+  // a reply to a query that isn't pending anymore is dropped
+  struct query pending = { .kind = QUERY_BAR, .seq = seq, .epoch = transport_epoch(),
+                           .fd = -1, .lazy = lazy, .sent = g_query_command.length + 1 };
+  lua_pushthread(L);
+  if (!query_add(L, &pending, key, TRANSPORT_REPLY_TIMEOUT_MS))
+    return luaL_error(L, "out of memory sending a query");
+  return lua_yield(L, 0);
+}
+
+static int yabai_query_async_lua(lua_State *L) {
+  if (!async_thread(L)) return yabai_query(L);
+
+  const char* command = luaL_checkstring(L, 1);
+  bool lazy = lua_toboolean(L, 2);
+  if (query_cache_get(L, command, lazy)) return 1;
+
+  yabai_cache_invalidate(L, command);
+
+  struct query pending = { .kind = QUERY_YABAI, .lazy = lazy };
+  if (!yabai_request_begin(&pending.yabai, command)) {
+    int returns = yabai_push_response(L, &pending.yabai, lazy);
+    yabai_request_free(&pending.yabai);
+    return returns;
+  }
+  pending.fd = pending.yabai.fd;
+
+  lua_pushthread(L);
+  if (!query_add(L, &pending, command, yabai_timeout())) {
+    yabai_request_free(&pending.yabai);
+    return luaL_error(L, "out of memory sending a query");
+  }
+  return lua_yield(L, 0);
+}
+
+// Its reply was given up on or lost with the connection
+static bool query_bar_abandoned(struct query* query) {
+  return query->kind == QUERY_BAR && query->epoch != transport_epoch();
+}
+
+static bool query_bar_pending() {
+  for (uint32_t i = 0; i < g_query_count; i++) {
+    if (g_queries[i].kind == QUERY_BAR && !g_queries[i].done) return true;
+  }
+  return false;
+}
+
+// The bar's replies all arrive on one descriptor
+static uint32_t query_fds(struct pollfd* fds, uint32_t max) {
+  uint32_t count = 0;
+  int reply_fd = query_bar_pending() ? transport_get()->reply_fd() : -1;
+  if (reply_fd != -1 && count < max)
+    fds[count++] = (struct pollfd) { reply_fd, POLLIN, 0 };
+
+  for (uint32_t i = 0; i < g_query_count && count < max; i++) {
+    if (g_queries[i].kind == QUERY_YABAI && !g_queries[i].done)
+      fds[count++] = (struct pollfd) { g_queries[i].fd, POLLIN, 0 };
+  }
+  return count;
+}
+
+static int32_t query_due_in() {
+  if (g_query_count == 0) return -1;
+
+  // replies that came in while something else waited for the bar
+  if (transport_stashed() && query_bar_pending()) return 0;
+
+  uint64_t now = query_now_ms();
+  int32_t due_in = -1;
+  for (uint32_t i = 0; i < g_query_count; i++) {
+    if (g_queries[i].done || g_queries[i].deadline <= now
+        || query_bar_abandoned(&g_queries[i])) {
+      return 0;
+    }
+    due_in = event_server_min_timeout(due_in, g_queries[i].deadline - now);
+  }
+  return due_in;
+}
+
+static void query_resume(struct query* query) {
+  lua_rawgeti(Lg, LUA_REGISTRYINDEX, query->ref);
+  luaL_unref(Lg, LUA_REGISTRYINDEX, query->ref);
+  lua_State* co = lua_tothread(Lg, -1);
+
+  int returns = 1;
+  if (query->kind == QUERY_BAR) {
+    stats_command("--query", query->sent,
+                  query->response ? strlen(query->response) : 0,
+                  stats_now_ns() - query->started_ns);
+    query_bar_push(co, query->response, query->lazy);
+    free(query->response);
+  } else {
+    yabai_request_expire(&query->yabai);
+    returns = yabai_push_response(co, &query->yabai, query->lazy);
+    yabai_request_free(&query->yabai);
+  }
+
+  // an event might have made the result stale while it was in flight
+  if (returns == 1 && query->generation == query_cache_generation())
+    query_cache_put(co, query->key, query->lazy, -1);
+  free(query->key);
+
+  int status = lua_resume(co, returns);
+  if (status != 0 && status != LUA_YIELD) {
+    fprintf(stderr, "Query error:\n");
+    fprintf(stderr, "%s\n", lua_tostring(co, -1));
+    fflush(stderr);
+  }
+  lua_settop(Lg, 0);
+}
+
+// Takes the bar's replies so far and hands them to their queries
+static void query_collect_replies() {
+  struct transport* transport = transport_get();
+  uint32_t seq;
+  char* response;
+  while (transport->reply(&seq, &response)) {
+    struct query* query = NULL;
+    for (uint32_t i = 0; i < g_query_count && !query; i++) {
+      if (g_queries[i].kind == QUERY_BAR && !g_queries[i].done && g_queries[i].seq == seq)
+        query = &g_queries[i];
+    }
+
+    if (!query) {
+      free(response);
+      continue;
+    }
+    query->response = response;
+    query->done = true;
+  }
+}
+
+// Reads what poll found and gives up on the queries past their deadline,
+// before any coroutine is resumed: a query it starts could get the number
+// of a descriptor that was just closed.
+static void query_loop_ready(struct pollfd* fds, uint32_t count) {
+  if (g_query_count == 0) return;
+  if (query_bar_pending()) query_collect_replies();
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (!fds[i].revents) continue;
+
+    for (uint32_t j = 0; j < g_query_count; j++) {
+      struct query* query = &g_queries[j];
+      if (query->kind != QUERY_YABAI || query->done || query->fd != fds[i].fd)
+        continue;
+      query->done = !yabai_request_read(&query->yabai);
+      break;
+    }
+  }
+
+  // A bar query that timed out might still be answered and the transport
+  // might not be able to tell. It gives up on every outstanding reply then
+  // and the other bar queries fail as well, instead of getting the wrong
+  // answer.
+  uint64_t now = query_now_ms();
+  for (uint32_t i = 0; i < g_query_count; i++) {
+    struct query* query = &g_queries[i];
+    if (query->kind == QUERY_BAR && !query->done && query->deadline <= now
+        && !query_bar_abandoned(query)) {
+      transport_get()->forget();
+      break;
+    }
+  }
+
+  bool done = false;
+  for (uint32_t i = 0; i < g_query_count; i++) {
+    if (g_queries[i].deadline <= now || query_bar_abandoned(&g_queries[i]))
+      g_queries[i].done = true;
+    done |= g_queries[i].done;
+  }
+  if (!done) return;
+
+  batch_begin();
+  for (uint32_t i = 0; i < g_query_count;) {
+    if (!g_queries[i].done) {
+      i++;
+      continue;
+    }
+
+    // queries started by the coroutine are added at the end
+    struct query query = g_queries[i];
+    g_queries[i] = g_queries[--g_query_count];
+    query_resume(&query);
+  }
+  batch_end();
+}
+
+//
+// Queries, child processes and the stats signal are polled along with the
+// events. Queries are read first, spawn tolerates its descriptors being
+// reported ready when they are not.
+//
+static uint32_t loop_fds(struct pollfd* fds, uint32_t max) {
+  uint32_t count = query_fds(fds, max);
+  count += spawn_fds(fds + count, max - count);
+  return count + stats_fds(fds + count, max - count);
+}
+
+static void loop_ready(struct pollfd* fds, uint32_t count) {
+  query_loop_ready(fds, count);
+  spawn_loop_ready(fds, count);
+  stats_ready(fds, count);
+}
+
+static int32_t loop_due_in() {
+  return event_server_min_timeout(query_due_in(), spawn_due_in());
+}
+
+static struct event_fds g_loop_fds = { loop_fds, loop_ready, loop_due_in };
+
 int luaL_load_sketchybar(lua_State *L) {
   lua_newtable(L);
 
@@ -201,6 +1227,98 @@ int luaL_load_sketchybar(lua_State *L) {
   lua_pushcfunction(L, *sketchybar_cmd);
   lua_settable(L, -3);
 
+  lua_pushliteral(L, "command_argv");
+  lua_pushcfunction(L, *command_argv_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "setv");
+  lua_pushcfunction(L, *setv_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "batch");
+  lua_pushcfunction(L, *batch_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "flush");
+  lua_pushcfunction(L, *flush_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "pace");
+  lua_pushcfunction(L, *pace_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "urgent");
+  lua_pushcfunction(L, *urgent_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "pace_stats");
+  lua_pushcfunction(L, *pace_stats_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "callback_register");
+  lua_pushcfunction(L, *callback_register_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "callback_dispatch");
+  lua_pushcfunction(L, *callback_dispatch_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "coalesce");
+  lua_pushcfunction(L, *coalesce_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "event_stats");
+  lua_pushcfunction(L, *event_stats_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "every");
+  lua_pushcfunction(L, *every_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "after");
+  lua_pushcfunction(L, *after_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "cancel");
+  lua_pushcfunction(L, *cancel_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "timer_stats");
+  lua_pushcfunction(L, *timer_stats_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "spawn");
+  lua_pushcfunction(L, *spawn_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "async_threads");
+  async_threads_register(L);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "spawn_limit");
+  lua_pushcfunction(L, *spawn_limit_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "spawn_stats");
+  lua_pushcfunction(L, *spawn_stats_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "stats");
+  lua_pushcfunction(L, *stats_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "stats_reset");
+  lua_pushcfunction(L, *stats_reset_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "loadfile");
+  lua_pushcfunction(L, *loadfile_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "bytecode_stats");
+  lua_pushcfunction(L, *bytecode_stats_lua);
+  lua_settable(L, -3);
+
   lua_pushliteral(L, "helper_name");
   lua_pushliteral(L, MACH_HELPER);
   lua_settable(L, -3);
@@ -209,14 +1327,77 @@ int luaL_load_sketchybar(lua_State *L) {
   lua_pushcfunction(L, *yabai_query);
   lua_settable(L, -3);
 
+  lua_pushliteral(L, "yabai_query_async");
+  lua_pushcfunction(L, *yabai_query_async_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "query_async");
+  lua_pushcfunction(L, *query_async_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "yabai_query_many");
+  lua_pushcfunction(L, *yabai_query_many);
+  lua_settable(L, -3);
+
   lua_pushliteral(L, "yabai_set_socket_path");
-  lua_pushcfunction(L, *yabai_set_socket_path);
+  lua_pushcfunction(L, *yabai_set_socket_path_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "yabai_set_timeout");
+  lua_pushcfunction(L, *yabai_set_timeout_lua);
   lua_settable(L, -3);
 
   lua_pushliteral(L, "json_parse");
   lua_pushcfunction(L, *yabai_json_parse);
   lua_settable(L, -3);
 
+  lua_pushliteral(L, "serialize");
+  lua_pushcfunction(L, *serialize_config_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "serializer_configure");
+  lua_pushcfunction(L, *serializer_configure_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "cache_rule");
+  lua_pushcfunction(L, *query_cache_rule_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "cache_get");
+  lua_pushcfunction(L, *query_cache_get_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "cache_put");
+  lua_pushcfunction(L, *query_cache_put_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "cache_invalidate");
+  lua_pushcfunction(L, *query_cache_invalidate_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "cache_stats");
+  lua_pushcfunction(L, *query_cache_stats_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "invalidate");
+  lua_pushcfunction(L, *shadow_invalidate_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "forget");
+  lua_pushcfunction(L, *shadow_reset_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "shadow");
+  lua_pushcfunction(L, *shadow_enable_lua);
+  lua_settable(L, -3);
+
+  lua_pushliteral(L, "shadow_stats");
+  lua_pushcfunction(L, *shadow_stats_lua);
+  lua_settable(L, -3);
+
+  json_proxy_register(L);
+  env_view_register(L);
+
   lua_setglobal(L, "sketchybar");
 
 
@@ -243,11 +1424,36 @@ int luaL_load_sketchybar(lua_State *L) {
     lua_settop(L, 0);
   }
 
+  handler_cache_callback(L);
+
   return 0;
 }
 
 int main (int argc, char** argv) {
-  event_server_init(handler, MACH_HELPER);
+  if (!event_server_init(handler, MACH_HELPER)) {
+    fprintf(stderr, "Could not register %s over %s\n", MACH_HELPER,
+                                                      transport_get()->name);
+    return 1;
+  }
+
+  // unchanged properties are dropped before anything reaches the bar
+  g_command_filter = &g_shadow;
+  // held back and merged per frame once `sb.pace` is on
+  g_command_scheduler = &g_pacer;
+  // `sb.every` and `sb.after` run between events
+  g_event_timers = &g_timers;
+  // async queries and child process pipes are polled along with the events
+  g_event_fds = &g_loop_fds;
+
+  char* capture = getenv(CAPTURE_ENV);
+  if (capture && !capture_open(capture)) {
+    fprintf(stderr, "Could not open capture log %s\n", capture);
+  }
+
+  // `kill -USR1` writes the latency histograms out as JSON
+  if (!stats_dump_on(SIGUSR1)) {
+    fprintf(stderr, "Could not install the stats signal handler\n");
+  }
 
   Lg = luaL_newstate();
   if (!Lg) return 1;
@@ -256,6 +1462,7 @@ int main (int argc, char** argv) {
 
   event_server_run(handler);
 
+  capture_close();
   lua_close(Lg);
   return 0;
 }
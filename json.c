@@ -0,0 +1,663 @@
+#include "json.h"
+
+void json_stream_init(struct json_stream* stream) {
+  *stream = (struct json_stream) { 0 };
+}
+
+void json_stream_free(struct json_stream* stream) {
+  if (stream->buffer && !stream->borrowed) free(stream->buffer);
+  if (stream->containers) free(stream->containers);
+  if (stream->stack) free(stream->stack);
+  *stream = (struct json_stream) { 0 };
+}
+
+// Returns space for at least `bytes` more bytes after the current end of the
+// buffer. One extra byte is always kept free for the NUL terminator.
+char* json_stream_reserve(struct json_stream* stream, uint32_t bytes) {
+  if (stream->capacity - stream->length < bytes + 1) {
+    uint32_t capacity = stream->capacity ? stream->capacity : bytes + 1;
+    while (capacity - stream->length < bytes + 1) capacity *= 2;
+
+    char* grown = realloc(stream->buffer, capacity);
+    if (!grown) return NULL;
+    stream->buffer = grown;
+    stream->capacity = capacity;
+  }
+  return stream->buffer + stream->length;
+}
+
+static bool json_grow(void** array, uint32_t* capacity, uint32_t count, size_t size) {
+  if (count < *capacity) return true;
+  uint32_t grown_capacity = *capacity ? *capacity * 2 : 16;
+  void* grown = realloc(*array, grown_capacity * size);
+  if (!grown) return false;
+  *array = grown;
+  *capacity = grown_capacity;
+  return true;
+}
+
+//
+// The scan only ever has to look at quotes, backslashes, brackets and commas.
+// Where SIMD is available it tests 16 bytes at a time for any of them and
+// skips blocks without a hit, which is most of the bytes in string values.
+//
+#if !defined(JSON_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define JSON_SIMD
+#define JSON_MASK_STRIDE 1
+
+static inline uint64_t json_block_mask(const char* block) {
+  __m128i bytes = _mm_loadu_si128((const __m128i*)block);
+  __m128i quotes = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('"')),
+                                _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\')));
+  __m128i braces = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('{')),
+                                _mm_cmpeq_epi8(bytes, _mm_set1_epi8('}')));
+  __m128i brackets = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('[')),
+                                  _mm_cmpeq_epi8(bytes, _mm_set1_epi8(']')));
+  __m128i commas = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(','));
+  __m128i hits = _mm_or_si128(_mm_or_si128(quotes, braces),
+                              _mm_or_si128(brackets, commas));
+  return (uint32_t)_mm_movemask_epi8(hits);
+}
+#elif !defined(JSON_NO_SIMD) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define JSON_SIMD
+#define JSON_MASK_STRIDE 4
+
+// NEON has no movemask, narrowing by 4 bits leaves one nibble per byte
+static inline uint64_t json_block_mask(const char* block) {
+  uint8x16_t bytes = vld1q_u8((const uint8_t*)block);
+  uint8x16_t quotes = vorrq_u8(vceqq_u8(bytes, vdupq_n_u8('"')),
+                               vceqq_u8(bytes, vdupq_n_u8('\\')));
+  uint8x16_t braces = vorrq_u8(vceqq_u8(bytes, vdupq_n_u8('{')),
+                               vceqq_u8(bytes, vdupq_n_u8('}')));
+  uint8x16_t brackets = vorrq_u8(vceqq_u8(bytes, vdupq_n_u8('[')),
+                                 vceqq_u8(bytes, vdupq_n_u8(']')));
+  uint8x16_t commas = vceqq_u8(bytes, vdupq_n_u8(','));
+  uint8x16_t hits = vorrq_u8(vorrq_u8(quotes, braces),
+                             vorrq_u8(brackets, commas));
+  uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(hits), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0)
+         & 0x8888888888888888ull;
+}
+#endif
+
+static inline bool json_is_whitespace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Handles the byte at `i` and returns the offset of the next byte that needs
+// looking at. An escape skips the byte after it, even if that byte is part of
+// the next chunk.
+static inline uint32_t json_scan_byte(struct json_stream* stream, uint32_t i) {
+  char c = stream->buffer[i];
+
+  if (stream->in_string) {
+    if (c == '\\') return i + 2;
+    if (c == '"') stream->in_string = false;
+    return i + 1;
+  }
+
+  switch (c) {
+    case '"':
+      stream->in_string = true;
+      break;
+
+    case '{': case '[':
+      if (stream->depth >= JSON_MAX_DEPTH
+          || !json_grow((void**)&stream->containers,
+                        &stream->container_capacity,
+                        stream->container_count,
+                        sizeof(struct json_container))
+          || !json_grow((void**)&stream->stack,
+                        &stream->stack_capacity,
+                        stream->depth,
+                        sizeof(struct json_frame)     )) {
+        stream->error = true;
+        break;
+      }
+
+      stream->stack[stream->depth++] = (struct json_frame) {
+        stream->container_count, 0, i
+      };
+      stream->containers[stream->container_count++]
+        = (struct json_container) { 0, 0, 0 };
+      break;
+
+    case '}': case ']': {
+      if (stream->depth == 0) {
+        stream->error = true;
+        break;
+      }
+      struct json_frame* frame = &stream->stack[--stream->depth];
+      struct json_container* container = &stream->containers[frame->container];
+
+      // Without commas the container holds one element or none, which is
+      // only the case if nothing but whitespace follows the open bracket.
+      container->count = frame->commas + 1;
+      if (frame->commas == 0) {
+        uint32_t j = i;
+        while (j > frame->open + 1 && json_is_whitespace(stream->buffer[j - 1])) j--;
+        if (j == frame->open + 1) container->count = 0;
+      }
+      container->end = i + 1;
+      container->next = stream->container_count;
+
+      if (stream->depth == 0) {
+        stream->complete = true;
+        stream->end = i + 1;
+      }
+      break;
+    }
+
+    case ',':
+      if (stream->depth > 0) stream->stack[stream->depth - 1].commas++;
+      break;
+  }
+
+  return i + 1;
+}
+
+static bool json_scan(struct json_stream* stream) {
+  uint32_t length = stream->length;
+  uint32_t next = stream->scanned;
+
+#ifdef JSON_SIMD
+  for (uint32_t block = next;
+       block + 16 <= length && !stream->complete && !stream->error;
+       block += 16                                                ) {
+    uint64_t mask = json_block_mask(stream->buffer + block);
+    while (mask) {
+      uint32_t i = block + __builtin_ctzll(mask) / JSON_MASK_STRIDE;
+      mask &= mask - 1;
+      if (i < next) continue;
+      next = json_scan_byte(stream, i);
+      if (stream->complete || stream->error) break;
+    }
+    if (next < block + 16) next = block + 16;
+  }
+#endif
+
+  while (next < length && !stream->complete && !stream->error) {
+    next = json_scan_byte(stream, next);
+  }
+
+  stream->scanned = next;
+  return !stream->error;
+}
+
+// Appends `bytes` that were written into the space returned by
+// `json_stream_reserve` and scans them.
+bool json_stream_commit(struct json_stream* stream, uint32_t bytes) {
+  stream->length += bytes;
+  stream->buffer[stream->length] = '\0';
+  if (stream->error) return false;
+  return json_scan(stream);
+}
+
+
+//
+// decoding
+//
+
+// Object keys repeat a lot (every window in `query --windows` has the same
+// 30 or so), so the decoder keeps the last few it pushed in stack slots and
+// hands out copies of those instead of going through lua's string table.
+#define JSON_KEY_CACHE 64
+
+struct json_key {
+  const char* key;
+  uint32_t length;
+};
+
+struct json_decoder {
+  lua_State* L;
+  const char* cursor;
+  const char* end;
+  struct json_container* containers;
+  uint32_t container_count;
+  uint32_t next_container;
+  uint32_t depth;
+
+  char* scratch;
+  uint32_t scratch_capacity;
+
+  int key_base;
+  struct json_key keys[JSON_KEY_CACHE];
+};
+
+static inline void json_skip_whitespace(struct json_decoder* decoder) {
+  while (decoder->cursor < decoder->end) {
+    char c = *decoder->cursor;
+    if (c != ' ' && c != '\t' && c != '\n' && c != '\r') break;
+    decoder->cursor++;
+  }
+}
+
+static inline bool json_expect(struct json_decoder* decoder, char c) {
+  json_skip_whitespace(decoder);
+  if (decoder->cursor >= decoder->end || *decoder->cursor != c) return false;
+  decoder->cursor++;
+  return true;
+}
+
+static bool json_scratch_reserve(struct json_decoder* decoder, uint32_t bytes) {
+  if (bytes <= decoder->scratch_capacity) return true;
+  uint32_t capacity = decoder->scratch_capacity ? decoder->scratch_capacity : 256;
+  while (capacity < bytes) capacity *= 2;
+  char* grown = realloc(decoder->scratch, capacity);
+  if (!grown) return false;
+  decoder->scratch = grown;
+  decoder->scratch_capacity = capacity;
+  return true;
+}
+
+static inline int json_hex(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static bool json_read_codepoint(struct json_decoder* decoder, uint32_t* codepoint) {
+  if (decoder->end - decoder->cursor < 4) return false;
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) {
+    int digit = json_hex(decoder->cursor[i]);
+    if (digit < 0) return false;
+    value = (value << 4) | digit;
+  }
+  decoder->cursor += 4;
+  *codepoint = value;
+  return true;
+}
+
+static uint32_t json_utf8_encode(uint32_t codepoint, char* out) {
+  if (codepoint < 0x80) {
+    out[0] = codepoint;
+    return 1;
+  } else if (codepoint < 0x800) {
+    out[0] = 0xC0 | (codepoint >> 6);
+    out[1] = 0x80 | (codepoint & 0x3F);
+    return 2;
+  } else if (codepoint < 0x10000) {
+    out[0] = 0xE0 | (codepoint >> 12);
+    out[1] = 0x80 | ((codepoint >> 6) & 0x3F);
+    out[2] = 0x80 | (codepoint & 0x3F);
+    return 3;
+  }
+  out[0] = 0xF0 | (codepoint >> 18);
+  out[1] = 0x80 | ((codepoint >> 12) & 0x3F);
+  out[2] = 0x80 | ((codepoint >> 6) & 0x3F);
+  out[3] = 0x80 | (codepoint & 0x3F);
+  return 4;
+}
+
+// Strings without escapes are pushed straight out of the buffer, the rest are
+// unescaped into the decoder's scratch space first.
+static bool json_push_string(struct json_decoder* decoder) {
+  const char* start = ++decoder->cursor;
+  const char* caret = start;
+  while (caret < decoder->end && *caret != '"' && *caret != '\\') caret++;
+  if (caret >= decoder->end) return false;
+
+  if (*caret == '"') {
+    lua_pushlstring(decoder->L, start, caret - start);
+    decoder->cursor = caret + 1;
+    return true;
+  }
+
+  // Unescaping never grows a string, so the raw length is enough
+  const char* close = caret;
+  while (close < decoder->end && *close != '"') close += (*close == '\\') ? 2 : 1;
+  if (close >= decoder->end) return false;
+  if (!json_scratch_reserve(decoder, close - start)) return false;
+
+  uint32_t length = caret - start;
+  memcpy(decoder->scratch, start, length);
+  decoder->cursor = caret;
+
+  while (*decoder->cursor != '"') {
+    char c = *decoder->cursor++;
+    if (c != '\\') {
+      decoder->scratch[length++] = c;
+      continue;
+    }
+
+    c = *decoder->cursor++;
+    switch (c) {
+      case 'b': decoder->scratch[length++] = '\b'; break;
+      case 'f': decoder->scratch[length++] = '\f'; break;
+      case 'n': decoder->scratch[length++] = '\n'; break;
+      case 'r': decoder->scratch[length++] = '\r'; break;
+      case 't': decoder->scratch[length++] = '\t'; break;
+      case 'u': {
+        uint32_t codepoint;
+        if (!json_read_codepoint(decoder, &codepoint)) return false;
+        // an escape after a high surrogate that isn't its low half is
+        // decoded on its own
+        if (codepoint >= 0xD800 && codepoint <= 0xDBFF
+            && decoder->end - decoder->cursor >= 6
+            && decoder->cursor[0] == '\\' && decoder->cursor[1] == 'u') {
+          const char* second = decoder->cursor;
+          uint32_t low;
+          decoder->cursor += 2;
+          if (json_read_codepoint(decoder, &low) && low >= 0xDC00 && low <= 0xDFFF)
+            codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+          else
+            decoder->cursor = second;
+        }
+        length += json_utf8_encode(codepoint, decoder->scratch + length);
+        break;
+      }
+      default: decoder->scratch[length++] = c; break;
+    }
+  }
+
+  lua_pushlstring(decoder->L, decoder->scratch, length);
+  decoder->cursor++;
+  return true;
+}
+
+static inline uint32_t json_key_slot(const char* key, uint32_t length) {
+  uint32_t hash = length * 31;
+  if (length > 0) hash += (uint8_t)key[0] * 7
+                          + (uint8_t)key[length / 2] * 3
+                          + (uint8_t)key[length - 1];
+  return hash & (JSON_KEY_CACHE - 1);
+}
+
+static bool json_push_key(struct json_decoder* decoder) {
+  const char* start = decoder->cursor + 1;
+  const char* caret = start;
+  while (caret < decoder->end && *caret != '"' && *caret != '\\') caret++;
+  if (caret >= decoder->end) return false;
+  if (*caret == '\\') return json_push_string(decoder);
+
+  uint32_t length = caret - start;
+  uint32_t slot = json_key_slot(start, length);
+  struct json_key* cached = &decoder->keys[slot];
+
+  if (cached->key && cached->length == length
+      && memcmp(cached->key, start, length) == 0) {
+    lua_pushvalue(decoder->L, decoder->key_base + slot);
+  } else {
+    lua_pushlstring(decoder->L, start, length);
+    lua_pushvalue(decoder->L, -1);
+    lua_replace(decoder->L, decoder->key_base + slot);
+    *cached = (struct json_key) { start, length };
+  }
+
+  decoder->cursor = caret + 1;
+  return true;
+}
+
+static bool json_match_literal(struct json_decoder* decoder, const char* literal, uint32_t len) {
+  if ((uint32_t)(decoder->end - decoder->cursor) < len
+      || memcmp(decoder->cursor, literal, len) != 0) {
+    return false;
+  }
+  decoder->cursor += len;
+  return true;
+}
+
+static bool json_push_value(struct json_decoder* decoder);
+
+static bool json_push_container(struct json_decoder* decoder, bool object) {
+  lua_State* L = decoder->L;
+  if (decoder->next_container >= decoder->container_count
+      || ++decoder->depth > JSON_MAX_DEPTH
+      || !lua_checkstack(L, 4)) {
+    return false;
+  }
+
+  uint32_t count = decoder->containers[decoder->next_container++].count;
+  decoder->cursor++;
+
+  if (object) lua_createtable(L, 0, count);
+  else lua_createtable(L, count, 0);
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (i > 0 && !json_expect(decoder, ',')) return false;
+
+    if (object) {
+      json_skip_whitespace(decoder);
+      if (decoder->cursor >= decoder->end || *decoder->cursor != '"'
+          || !json_push_key(decoder)
+          || !json_expect(decoder, ':')
+          || !json_push_value(decoder)) {
+        return false;
+      }
+      lua_rawset(L, -3);
+    } else {
+      if (!json_push_value(decoder)) return false;
+      lua_rawseti(L, -2, i + 1);
+    }
+  }
+
+  decoder->depth--;
+  return json_expect(decoder, object ? '}' : ']');
+}
+
+static bool json_push_value(struct json_decoder* decoder) {
+  json_skip_whitespace(decoder);
+  if (decoder->cursor >= decoder->end) return false;
+
+  lua_State* L = decoder->L;
+  switch (*decoder->cursor) {
+    case '{': return json_push_container(decoder, true);
+    case '[': return json_push_container(decoder, false);
+    case '"': return json_push_string(decoder);
+    case 't':
+      lua_pushboolean(L, true);
+      return json_match_literal(decoder, "true", 4);
+    case 'f':
+      lua_pushboolean(L, false);
+      return json_match_literal(decoder, "false", 5);
+    case 'n':
+      lua_pushnil(L);
+      return json_match_literal(decoder, "null", 4);
+    default: {
+      // the buffer is always NUL terminated so strtod can't run off the end
+      char* number_end;
+      double number = strtod(decoder->cursor, &number_end);
+      if (number_end == decoder->cursor || number_end > decoder->end) return false;
+      lua_pushnumber(L, number);
+      decoder->cursor = number_end;
+      return true;
+    }
+  }
+}
+
+//
+// A lazy document only decodes what is read, so it is walked once the way
+// the decoder would walk it before it is handed out, without pushing
+// anything. The scan only tracks strings and brackets, this catches the
+// rest: separators, literals, numbers and escapes. It fails exactly where
+// json_push_at would.
+//
+
+static bool json_skip_string(struct json_decoder* decoder) {
+  const char* caret = decoder->cursor + 1;
+  while (caret < decoder->end && *caret != '"') {
+    if (*caret++ != '\\') continue;
+    if (caret >= decoder->end) return false;
+    if (*caret++ != 'u') continue;
+
+    uint32_t codepoint;
+    decoder->cursor = caret;
+    if (!json_read_codepoint(decoder, &codepoint)) return false;
+    caret = decoder->cursor;
+  }
+  if (caret >= decoder->end) return false;
+  decoder->cursor = caret + 1;
+  return true;
+}
+
+static bool json_skip_value(struct json_decoder* decoder);
+
+static bool json_skip_container(struct json_decoder* decoder, bool object) {
+  if (decoder->next_container >= decoder->container_count
+      || ++decoder->depth > JSON_MAX_DEPTH) {
+    return false;
+  }
+
+  uint32_t count = decoder->containers[decoder->next_container++].count;
+  decoder->cursor++;
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (i > 0 && !json_expect(decoder, ',')) return false;
+
+    if (object) {
+      json_skip_whitespace(decoder);
+      if (decoder->cursor >= decoder->end || *decoder->cursor != '"'
+          || !json_skip_string(decoder)
+          || !json_expect(decoder, ':')) {
+        return false;
+      }
+    }
+    if (!json_skip_value(decoder)) return false;
+  }
+
+  decoder->depth--;
+  return json_expect(decoder, object ? '}' : ']');
+}
+
+static bool json_skip_value(struct json_decoder* decoder) {
+  json_skip_whitespace(decoder);
+  if (decoder->cursor >= decoder->end) return false;
+
+  switch (*decoder->cursor) {
+    case '{': return json_skip_container(decoder, true);
+    case '[': return json_skip_container(decoder, false);
+    case '"': return json_skip_string(decoder);
+    case 't': return json_match_literal(decoder, "true", 4);
+    case 'f': return json_match_literal(decoder, "false", 5);
+    case 'n': return json_match_literal(decoder, "null", 4);
+    default: {
+      char* number_end;
+      strtod(decoder->cursor, &number_end);
+      if (number_end == decoder->cursor || number_end > decoder->end) return false;
+      decoder->cursor = number_end;
+      return true;
+    }
+  }
+}
+
+static bool json_document_valid(struct json_document* document, uint32_t offset) {
+  struct json_decoder decoder = {
+    .cursor = document->buffer + offset,
+    .end = document->buffer + document->length,
+    .containers = document->containers,
+    .container_count = document->container_count
+  };
+  return json_skip_value(&decoder);
+}
+
+// Decodes the value starting at `offset` of a scanned buffer. `container` is
+// the index of the first container at or after `offset`.
+bool json_push_at(lua_State* L, struct json_document* document, uint32_t offset, uint32_t container) {
+  struct json_decoder decoder = {
+    .L = L,
+    .cursor = document->buffer + offset,
+    .end = document->buffer + document->length,
+    .containers = document->containers,
+    .container_count = document->container_count,
+    .next_container = container
+  };
+
+  int top = lua_gettop(L);
+  if (!lua_checkstack(L, JSON_KEY_CACHE + 8)) return false;
+  lua_settop(L, top + JSON_KEY_CACHE);
+  decoder.key_base = top + 1;
+
+  bool success = json_push_value(&decoder);
+  if (decoder.scratch) free(decoder.scratch);
+
+  if (success) {
+    lua_replace(L, top + 1);
+    lua_settop(L, top + 1);
+  } else {
+    lua_settop(L, top);
+  }
+  return success;
+}
+
+static bool json_stream_document(struct json_stream* stream, struct json_document* document) {
+  if (stream->error || stream->depth > 0 || stream->in_string
+      || stream->length == 0) {
+    return false;
+  }
+
+  *document = (struct json_document) {
+    .buffer = stream->buffer,
+    .length = stream->complete ? stream->end : stream->length,
+    .containers = stream->containers,
+    .container_count = stream->container_count
+  };
+  return true;
+}
+
+// Decodes a scanned stream and pushes the result. Nothing is pushed if the
+// JSON is malformed or incomplete.
+bool json_stream_push(lua_State* L, struct json_stream* stream) {
+  struct json_document document;
+  return json_stream_document(stream, &document)
+         && json_push_at(L, &document, 0, 0);
+}
+
+// Same as `json_stream_push` but containers are pushed as lazy proxies. The
+// proxy takes over the stream's buffer, the stream is empty afterwards.
+bool json_stream_push_lazy(lua_State* L, struct json_stream* stream) {
+  struct json_document document;
+  if (!json_stream_document(stream, &document)) return false;
+
+  char first = document.buffer[0];
+  uint32_t offset = 0;
+  while (first == ' ' || first == '\t' || first == '\n' || first == '\r')
+    first = document.buffer[++offset];
+
+  if (first != '{' && first != '[') return json_push_at(L, &document, 0, 0);
+  if (!json_document_valid(&document, offset)) return false;
+
+  if (stream->borrowed) {
+    char* buffer = malloc(document.length + 1);
+    if (!buffer) return false;
+    memcpy(buffer, document.buffer, document.length);
+    buffer[document.length] = '\0';
+    document.buffer = buffer;
+  }
+
+  json_proxy_push(L, &document, offset);
+  stream->buffer = NULL;
+  stream->containers = NULL;
+  json_stream_free(stream);
+  return true;
+}
+
+// `json` has to be NUL terminated at `len`
+bool json_decode(lua_State* L, const char* json, uint32_t len) {
+  struct json_stream stream;
+  json_stream_init(&stream);
+  stream.buffer = (char*)json;
+  stream.length = len;
+  stream.capacity = len + 1;
+  stream.borrowed = true;
+
+  bool success = json_scan(&stream) && json_stream_push(L, &stream);
+  json_stream_free(&stream);
+  return success;
+}
+
+bool json_decode_lazy(lua_State* L, const char* json, uint32_t len) {
+  struct json_stream stream;
+  json_stream_init(&stream);
+  stream.buffer = (char*)json;
+  stream.length = len;
+  stream.capacity = len + 1;
+  stream.borrowed = true;
+
+  bool success = json_scan(&stream) && json_stream_push_lazy(L, &stream);
+  json_stream_free(&stream);
+  return success;
+}
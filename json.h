@@ -0,0 +1,83 @@
+#pragma once
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define JSON_MAX_DEPTH 256
+
+//
+// JSON is decoded in two passes.
+//
+// The scan runs over the raw bytes as they arrive and only tracks strings and
+// brackets. For every container it records how many elements it holds and
+// where it ends, and it notices when the top-level value is complete. It
+// keeps its state between calls so it can be fed a socket read at a time.
+//
+// The decode then walks the finished buffer once, pushing values straight
+// onto the lua stack with tables sized from the recorded counts.
+//
+// Alternatively the buffer and its containers are kept around as a document
+// and handed to lua as a proxy that only decodes what is actually read, see
+// json_proxy.c. `end` and `next` (the first container after this one's
+// subtree) let the proxy skip over values it isn't interested in. Such a
+// document is checked by walking it once without decoding anything, so it
+// is refused wherever the eager decode would fail.
+//
+struct json_container {
+  uint32_t count;
+  uint32_t end;
+  uint32_t next;
+};
+
+struct json_frame {
+  uint32_t container;
+  uint32_t commas;
+  uint32_t open;
+};
+
+struct json_stream {
+  char* buffer;
+  uint32_t length;
+  uint32_t capacity;
+  bool borrowed;
+
+  struct json_container* containers;
+  uint32_t container_count;
+  uint32_t container_capacity;
+
+  struct json_frame* stack;
+  uint32_t depth;
+  uint32_t stack_capacity;
+
+  uint32_t scanned;
+  uint32_t end;
+  bool in_string;
+  bool complete;
+  bool error;
+};
+
+struct json_document {
+  char* buffer;
+  uint32_t length;
+  struct json_container* containers;
+  uint32_t container_count;
+};
+
+void json_stream_init(struct json_stream* stream);
+void json_stream_free(struct json_stream* stream);
+
+char* json_stream_reserve(struct json_stream* stream, uint32_t bytes);
+bool json_stream_commit(struct json_stream* stream, uint32_t bytes);
+
+bool json_stream_push(lua_State* L, struct json_stream* stream);
+bool json_stream_push_lazy(lua_State* L, struct json_stream* stream);
+bool json_decode(lua_State* L, const char* json, uint32_t len);
+bool json_decode_lazy(lua_State* L, const char* json, uint32_t len);
+bool json_push_at(lua_State* L, struct json_document* document, uint32_t offset, uint32_t container);
+
+void json_proxy_register(lua_State* L);
+void json_proxy_push(lua_State* L, struct json_document* document, uint32_t offset);
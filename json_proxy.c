@@ -0,0 +1,391 @@
+#include "json.h"
+
+//
+// Lazy JSON values.
+//
+// A document userdata owns the raw buffer and the container index from the
+// scan and frees both when it is collected. Every object or array in it is
+// exposed as a proxy userdata pointing at the container's offset. A proxy's
+// environment table doubles as its cache: whatever `__index` decodes is
+// stored there, and it also holds a reference to the document so the buffer
+// lives as long as any proxy into it.
+//
+// Nested containers come back as proxies themselves, so reading
+// `windows[3].frame.x` decodes exactly one number.
+//
+// Stock LuaJIT doesn't look at `__pairs`/`__ipairs`, use `sb.pairs` and
+// `sb.ipairs` (or `sb.materialize` for a plain table) to iterate.
+//
+
+#define JSON_DOCUMENT "sketchybar.json_document"
+#define JSON_PROXY "sketchybar.json_proxy"
+
+struct json_proxy {
+  struct json_document* document;
+  uint32_t offset;
+  uint32_t container;
+
+  // offsets and container indices of every array element, built on the
+  // first indexed read so `ipairs`-style loops don't rescan from the start
+  uint32_t* elements;
+};
+
+static char g_json_document_key;
+
+static inline bool json_proxy_is_object(struct json_proxy* proxy) {
+  return proxy->document->buffer[proxy->offset] == '{';
+}
+
+static inline uint32_t json_proxy_count(struct json_proxy* proxy) {
+  return proxy->document->containers[proxy->container].count;
+}
+
+static inline uint32_t json_proxy_skip_whitespace(const char* buffer, uint32_t offset) {
+  while (buffer[offset] == ' ' || buffer[offset] == '\t'
+         || buffer[offset] == '\n' || buffer[offset] == '\r') {
+    offset++;
+  }
+  return offset;
+}
+
+// Returns the offset just past the value at `offset`, `child` is advanced
+// past any containers the value holds.
+static uint32_t json_proxy_skip_value(struct json_document* document, uint32_t offset, uint32_t* child) {
+  const char* buffer = document->buffer;
+  char c = buffer[offset];
+
+  if (c == '{' || c == '[') {
+    struct json_container* container = &document->containers[*child];
+    *child = container->next;
+    return container->end;
+  }
+
+  if (c == '"') {
+    offset++;
+    while (offset < document->length && buffer[offset] != '"')
+      offset += buffer[offset] == '\\' ? 2 : 1;
+    return offset + 1;
+  }
+
+  while (offset < document->length && buffer[offset] != ','
+         && buffer[offset] != '}' && buffer[offset] != ']'
+         && buffer[offset] != ' ' && buffer[offset] != '\n'
+         && buffer[offset] != '\t' && buffer[offset] != '\r') {
+    offset++;
+  }
+  return offset;
+}
+
+//
+// Member walking. `cursor` starts just after the open bracket, each call moves
+// it past one element and reports where the element's value (and for objects
+// its key) starts.
+//
+struct json_member {
+  uint32_t key;
+  uint32_t key_length;
+  bool key_escaped;
+  uint32_t value;
+  uint32_t child;
+};
+
+static void json_proxy_next_member(struct json_proxy* proxy, uint32_t* cursor, uint32_t* child, struct json_member* member) {
+  struct json_document* document = proxy->document;
+  const char* buffer = document->buffer;
+  uint32_t offset = json_proxy_skip_whitespace(buffer, *cursor);
+  if (buffer[offset] == ',') offset = json_proxy_skip_whitespace(buffer, offset + 1);
+
+  if (json_proxy_is_object(proxy)) {
+    member->key = offset + 1;
+    member->key_escaped = false;
+    offset++;
+    while (buffer[offset] != '"') {
+      if (buffer[offset] == '\\') {
+        member->key_escaped = true;
+        offset++;
+      }
+      offset++;
+    }
+    member->key_length = offset - member->key;
+    offset = json_proxy_skip_whitespace(buffer, offset + 1);
+    offset = json_proxy_skip_whitespace(buffer, offset + 1);
+  }
+
+  member->value = offset;
+  member->child = *child;
+  *cursor = json_proxy_skip_value(document, offset, child);
+}
+
+static void json_proxy_push_key(lua_State* L, struct json_proxy* proxy, struct json_member* member) {
+  if (!member->key_escaped) {
+    lua_pushlstring(L, proxy->document->buffer + member->key, member->key_length);
+  } else if (!json_push_at(L, proxy->document, member->key - 1, member->child)) {
+    lua_pushnil(L);
+  }
+}
+
+static void json_proxy_build_elements(struct json_proxy* proxy) {
+  uint32_t count = json_proxy_count(proxy);
+  proxy->elements = malloc(sizeof(uint32_t) * 2 * (count ? count : 1));
+  if (!proxy->elements) return;
+
+  uint32_t cursor = proxy->offset + 1, child = proxy->container + 1;
+  struct json_member member;
+  for (uint32_t i = 0; i < count; i++) {
+    json_proxy_next_member(proxy, &cursor, &child, &member);
+    proxy->elements[2 * i] = member.value;
+    proxy->elements[2 * i + 1] = member.child;
+  }
+}
+
+static bool json_proxy_find(lua_State* L, struct json_proxy* proxy, int key, uint32_t* value, uint32_t* child) {
+  uint32_t count = json_proxy_count(proxy);
+
+  if (!json_proxy_is_object(proxy)) {
+    if (lua_type(L, key) != LUA_TNUMBER) return false;
+    lua_Number number = lua_tonumber(L, key);
+    uint32_t index = (uint32_t)number;
+    if ((lua_Number)index != number || index < 1 || index > count) return false;
+
+    if (!proxy->elements) json_proxy_build_elements(proxy);
+    if (!proxy->elements) return false;
+    *value = proxy->elements[2 * (index - 1)];
+    *child = proxy->elements[2 * (index - 1) + 1];
+    return true;
+  }
+
+  if (lua_type(L, key) != LUA_TSTRING) return false;
+  size_t key_length;
+  const char* key_string = lua_tolstring(L, key, &key_length);
+
+  uint32_t cursor = proxy->offset + 1, next_child = proxy->container + 1;
+  struct json_member member;
+  for (uint32_t i = 0; i < count; i++) {
+    json_proxy_next_member(proxy, &cursor, &next_child, &member);
+
+    bool match;
+    if (!member.key_escaped) {
+      match = member.key_length == key_length
+              && memcmp(proxy->document->buffer + member.key,
+                        key_string, key_length         ) == 0;
+    } else {
+      json_proxy_push_key(L, proxy, &member);
+      match = lua_rawequal(L, -1, key);
+      lua_pop(L, 1);
+    }
+
+    if (match) {
+      *value = member.value;
+      *child = member.child;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Pushes the value at `value`, containers become proxies sharing the
+// document of `proxy` (at stack index `index`).
+static void json_proxy_push_value(lua_State* L, int index, struct json_proxy* proxy, uint32_t value, uint32_t child) {
+  char c = proxy->document->buffer[value];
+  if (c != '{' && c != '[') {
+    if (!json_push_at(L, proxy->document, value, child)) lua_pushnil(L);
+    return;
+  }
+
+  struct json_proxy* nested = lua_newuserdata(L, sizeof(struct json_proxy));
+  *nested = (struct json_proxy) { proxy->document, value, child, NULL };
+  luaL_getmetatable(L, JSON_PROXY);
+  lua_setmetatable(L, -2);
+
+  lua_createtable(L, 0, 1);
+  lua_pushlightuserdata(L, &g_json_document_key);
+  lua_getfenv(L, index);
+  lua_pushlightuserdata(L, &g_json_document_key);
+  lua_rawget(L, -2);
+  lua_remove(L, -2);
+  lua_rawset(L, -3);
+  lua_setfenv(L, -2);
+}
+
+// Looks `key` up in the cache and decodes it on a miss
+static void json_proxy_get(lua_State* L, int index, int key) {
+  struct json_proxy* proxy = lua_touserdata(L, index);
+
+  lua_getfenv(L, index);
+  lua_pushvalue(L, key);
+  lua_rawget(L, -2);
+  if (!lua_isnil(L, -1)) {
+    lua_remove(L, -2);
+    return;
+  }
+  lua_pop(L, 1);
+
+  uint32_t value, child;
+  if (!json_proxy_find(L, proxy, key, &value, &child)) {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    return;
+  }
+
+  json_proxy_push_value(L, index, proxy, value, child);
+  lua_pushvalue(L, key);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -4);
+  lua_remove(L, -2);
+}
+
+static int json_proxy_index(lua_State* L) {
+  luaL_checkudata(L, 1, JSON_PROXY);
+  json_proxy_get(L, 1, 2);
+  return 1;
+}
+
+static int json_proxy_len(lua_State* L) {
+  struct json_proxy* proxy = luaL_checkudata(L, 1, JSON_PROXY);
+  lua_pushinteger(L, json_proxy_is_object(proxy) ? 0 : json_proxy_count(proxy));
+  return 1;
+}
+
+// upvalues: cursor, next child container, elements left
+static int json_proxy_next(lua_State* L) {
+  struct json_proxy* proxy = luaL_checkudata(L, 1, JSON_PROXY);
+  uint32_t cursor = lua_tointeger(L, lua_upvalueindex(1));
+  uint32_t child = lua_tointeger(L, lua_upvalueindex(2));
+  uint32_t remaining = lua_tointeger(L, lua_upvalueindex(3));
+
+  while (remaining > 0) {
+    struct json_member member;
+    json_proxy_next_member(proxy, &cursor, &child, &member);
+    remaining--;
+
+    if (json_proxy_is_object(proxy)) json_proxy_push_key(L, proxy, &member);
+    else lua_pushinteger(L, json_proxy_count(proxy) - remaining);
+
+    json_proxy_get(L, 1, lua_gettop(L));
+    if (lua_isnil(L, -1)) {
+      // `null` members are skipped like nil table entries
+      lua_pop(L, 2);
+      continue;
+    }
+
+    lua_pushinteger(L, cursor);
+    lua_replace(L, lua_upvalueindex(1));
+    lua_pushinteger(L, child);
+    lua_replace(L, lua_upvalueindex(2));
+    lua_pushinteger(L, remaining);
+    lua_replace(L, lua_upvalueindex(3));
+    return 2;
+  }
+
+  lua_pushnil(L);
+  return 1;
+}
+
+static int json_proxy_pairs(lua_State* L) {
+  struct json_proxy* proxy = luaL_checkudata(L, 1, JSON_PROXY);
+  lua_pushinteger(L, proxy->offset + 1);
+  lua_pushinteger(L, proxy->container + 1);
+  lua_pushinteger(L, json_proxy_count(proxy));
+  lua_pushcclosure(L, json_proxy_next, 3);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+static int json_proxy_inext(lua_State* L) {
+  lua_Integer index = luaL_checkinteger(L, 2) + 1;
+  lua_pushinteger(L, index);
+  json_proxy_get(L, 1, lua_gettop(L));
+  if (lua_isnil(L, -1)) return 1;
+  return 2;
+}
+
+static int json_proxy_ipairs(lua_State* L) {
+  luaL_checkudata(L, 1, JSON_PROXY);
+  lua_pushcfunction(L, json_proxy_inext);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, 0);
+  return 3;
+}
+
+static int json_proxy_tostring(lua_State* L) {
+  struct json_proxy* proxy = luaL_checkudata(L, 1, JSON_PROXY);
+  lua_pushfstring(L, "json %s: %p", json_proxy_is_object(proxy) ? "object"
+                                                                : "array",
+                                    (void*)proxy                            );
+  return 1;
+}
+
+static int json_proxy_gc(lua_State* L) {
+  struct json_proxy* proxy = luaL_checkudata(L, 1, JSON_PROXY);
+  if (proxy->elements) free(proxy->elements);
+  proxy->elements = NULL;
+  return 0;
+}
+
+static int json_document_gc(lua_State* L) {
+  struct json_document* document = luaL_checkudata(L, 1, JSON_DOCUMENT);
+  if (document->buffer) free(document->buffer);
+  if (document->containers) free(document->containers);
+  *document = (struct json_document) { 0 };
+  return 0;
+}
+
+// Decodes a proxy (or returns anything else unchanged) into plain tables
+static int json_proxy_materialize(lua_State* L) {
+  struct json_proxy* proxy = luaL_testudata(L, 1, JSON_PROXY);
+  if (!proxy) {
+    lua_settop(L, 1);
+    return 1;
+  }
+  if (!json_push_at(L, proxy->document, proxy->offset, proxy->container))
+    lua_pushnil(L);
+  return 1;
+}
+
+// Takes ownership of `document`'s buffer and containers
+void json_proxy_push(lua_State* L, struct json_document* document, uint32_t offset) {
+  struct json_document* owned = lua_newuserdata(L, sizeof(struct json_document));
+  *owned = *document;
+  luaL_getmetatable(L, JSON_DOCUMENT);
+  lua_setmetatable(L, -2);
+
+  struct json_proxy* proxy = lua_newuserdata(L, sizeof(struct json_proxy));
+  *proxy = (struct json_proxy) { owned, offset, 0, NULL };
+  luaL_getmetatable(L, JSON_PROXY);
+  lua_setmetatable(L, -2);
+
+  lua_createtable(L, 0, 1);
+  lua_pushlightuserdata(L, &g_json_document_key);
+  lua_pushvalue(L, -4);
+  lua_rawset(L, -3);
+  lua_setfenv(L, -2);
+  lua_remove(L, -2);
+}
+
+// Creates the metatables and adds `pairs`, `ipairs` and `materialize` to the
+// table on top of the stack.
+void json_proxy_register(lua_State* L) {
+  luaL_newmetatable(L, JSON_DOCUMENT);
+  lua_pushcfunction(L, json_document_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, JSON_PROXY);
+  lua_pushcfunction(L, json_proxy_index);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, json_proxy_len);
+  lua_setfield(L, -2, "__len");
+  lua_pushcfunction(L, json_proxy_pairs);
+  lua_setfield(L, -2, "__pairs");
+  lua_pushcfunction(L, json_proxy_ipairs);
+  lua_setfield(L, -2, "__ipairs");
+  lua_pushcfunction(L, json_proxy_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pushcfunction(L, json_proxy_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  lua_pushcfunction(L, json_proxy_materialize);
+  lua_setfield(L, -2, "materialize");
+}
@@ -33,6 +33,83 @@ local F_OK, X_OK, W_OK, R_OK = 0, 1, 2, 4
 local fmt = string.format
 local callbacks = {{}}
 
+-- `sb.batch(fn)` sends all commands issued by `fn` as one message and
+-- `sb.flush()` sends what has been batched so far. Callbacks are always
+-- batched by the helper.
+sb.batch = sb.batch or function(fn, ...) return fn(...) end
+sb.flush = sb.flush or function() end
+
+-- The helper drops `--set` properties that wouldn't change anything.
+-- `sb.invalidate(item)` forgets what was sent to an item that was changed
+-- from somewhere else, `sb.forget()` forgets everything.
+sb.invalidate = sb.invalidate or function(item) end
+sb.forget = sb.forget or function() end
+sb.shadow = sb.shadow or function(enabled) end
+
+-- `sb.pace(16)` sends what piled up once per 16 ms frame, with repeated
+-- sets of a property merged. `sb.urgent(fn)` skips the wait for commands
+-- that can't be late.
+sb.pace = sb.pace or function(frame_ms) end
+sb.urgent = sb.urgent or function(fn, ...) return fn(...) end
+
+-- These events only report the current state, so when an item has several
+-- of one queued up while lua is busy only the newest is handled.
+-- `sb.coalesce(event, "all")` handles every one of them again.
+sb.coalesce = sb.coalesce or function(event, policy) end
+for _, event in ipairs({
+  "front_app_switched", "space_change", "display_change",
+  "space_windows_change", "volume_change", "brightness_change",
+  "power_source_change", "wifi_change", "media_change", "routine"
+}) do
+  sb.coalesce(event, "latest")
+end
+
+-- `sb.every(ms, fn)` and `sb.after(ms, fn)` run `fn` from the helper without
+-- a round trip through the bar, `sb.cancel(id)` stops them. Use these
+-- instead of `update_freq` for clocks and other periodic updates.
+sb.every = sb.every or function(ms, fn) end
+sb.after = sb.after or function(ms, fn) end
+sb.cancel = sb.cancel or function(id) return false end
+
+-- `sb.spawn(command, fn)` starts a process and hands its output to `fn`,
+-- without `fn` it waits and returns it. Standalone this always waits.
+sb.spawn = sb.spawn or function(command, fn)
+  if type(command) == "table" then command = table.concat(command, " ") end
+  local fd = io.popen(command)
+  local result = fd:read("*a")
+  fd:close()
+  if fn then fn(result, 0) else return result, 0 end
+end
+sb.spawn_limit = sb.spawn_limit or function(limit) end
+
+-- `sb.stats()` returns latency histograms per item and event, per command
+-- sent to the bar and per yabai command, along with byte counts.
+-- `sb.stats_reset()` starts over. Standalone nothing is measured.
+sb.stats = sb.stats or function()
+  return { dispatch = {}, commands = {}, posts = {}, yabai = {}, counters = {} }
+end
+sb.stats_reset = sb.stats_reset or function() end
+
+-- `sb.loadfile(path)` is `loadfile` that keeps the compiled chunk in a
+-- cache dir until the file changes, the user config and the modules it
+-- requires are loaded with it. `sb.bytecode_stats()` counts hits and misses.
+sb.loadfile = sb.loadfile or loadfile
+sb.bytecode_stats = sb.bytecode_stats or function()
+  return { hits = 0, misses = 0, failed = 0 }
+end
+
+-- `sb.query_async` and `sb.yabai_query_async` only wait in the calling
+-- coroutine, see `sb.await_all`. Standalone they're the plain queries.
+sb.query_async = sb.query_async or function(query, lazy)
+  return sb.query(query, lazy)
+end
+sb.yabai_query_async = sb.yabai_query_async or function(command, lazy)
+  return sb.yabai_command(command, lazy)
+end
+
+local cache_get = sb.cache_get or function() end
+local cache_put = sb.cache_put or function() end
+
 local __value__ = setmetatable({}, { __tostring__ = "<value>" })
 local __drop__ = setmetatable({}, { __tostring__ = "<drop>" })
 
@@ -101,15 +178,22 @@ local function nested_get_ensure(tbl, ...)
   return value
 end
 
+-- The helper keeps callbacks in an index keyed by (item, event), `callbacks`
+-- is only used when running without it.
+local callback_register = sb.callback_register
+
 local function register_callback_global(fn)
+  if callback_register then return callback_register(nil, nil, fn) end
   local global_callbacks = nested_get_ensure(callbacks, 1)
   table.insert(global_callbacks, fn)
 end
 local function register_callback_item(item, fn)
+  if callback_register then return callback_register(item, nil, fn) end
   local item_callbacks = nested_get_ensure(callbacks, item, 1)
   table.insert(item_callbacks, fn)
 end
 local function register_callback_item_event(item, event, fn)
+  if callback_register then return callback_register(item, event, fn) end
   local item_event_callbacks = nested_get_ensure(callbacks, item, event)
   table.insert(item_event_callbacks, fn)
 end
@@ -206,33 +290,57 @@ local function event_name(name)
   return alias or name
 end
 
+-- `next` instead of a loop that returns right away, the loop would abort
+-- every trace going through `sb.set`
 local function table_not_empty(tbl)
-  if type(tbl) ~= "table" then return false end
-  for k in pairs(tbl) do
-    return true
-  end
-  return false
+  return type(tbl) == "table" and next(tbl) ~= nil
 end
 
--- the inspect library can properly quote strings that contain "" or ''
-local sanitize_value = inspect
+--
+-- The helper serializes configs natively (parsing.c), the functions below
+-- are only used when this script is run directly by luajit and produce the
+-- same output.
+--
+-- Booleans become on/off, numbers for `*color` keys are written in hex and
+-- values are quoted for the way the helper splits commands into arguments.
+-- A `"` can't appear inside double quotes so it is written as `"'"'"`.
+--
+local function quote_value(v)
+  if v ~= "" and not string.find(v, "[ \"']") then return v end
+  return '"' .. string.gsub(v, '"', [["'"'"]]) .. '"'
+end
+
+local function format_value(k, v)
+  local v_t = type(v)
+  if v_t == "boolean" then
+    return v and "on" or "off"
+  elseif v_t == "number" then
+    if string.sub(k, -5) == "color" then return fmt("0x%08x", v) end
+    return tostring(v)
+  elseif v_t == "string" then
+    return quote_value(v)
+  end
+  error(fmt("cannot serialize a %s value for '%s'", v_t, k))
+end
 
 local function insert_kv(t, k, v)
   if k == nil then return end
   local alias = key_aliases[k] or k
   if alias ~= __drop__ then
-    table.insert(t, alias .. "=" .. sanitize_value(v))
+    table.insert(t, alias .. "=" .. format_value(alias, v))
   end
 end
 
-local function serialize_keys(tbl, acc, s)
+local function serialize_keys(tbl, acc, s, specials)
   if type(tbl) ~= "table" then
     insert_kv(acc, s, tbl)
   else
     local prefix = (s ~= nil) and (s .. ".") or ""
     for k, v in pairs(tbl) do
-      if k == __value__ or k == 1 then
-        insert_kv(acc, s, v)
+      if specials ~= nil and special_keys[k] then
+        specials[k] = v
+      elseif k == __value__ or k == 1 then
+        serialize_keys(v, acc, s)
       else
         serialize_keys(v, acc, prefix .. k)
       end
@@ -241,40 +349,49 @@ local function serialize_keys(tbl, acc, s)
   return acc
 end
 
-local function preprocess_config(tbl)
+local function serialize_lua(tbl, extra)
   local specials = {}
-  for k, v in pairs(tbl) do
-    if special_keys[k] then
-      specials[k] = v
-      tbl[k] = nil
-    end
-  end
-  return tbl, specials
+  local args = serialize_keys(tbl, {}, nil, specials)
+  if extra ~= nil then table.insert(args, extra) end
+  return table.concat(args, " "), specials
 end
 
-local function serialize_config(tbl, extra)
-  local tail = extra ~= nil and (" " .. extra) or ""
-  if table_not_empty(tbl) then
-    local config, specials = preprocess_config(tbl)
-    local args = serialize_keys(config, {})
-    if #args == 0 and extra ~= nil then
-      return string.sub(tail, 2), specials
+sb.serialize = sb.serialize or serialize_lua
+if sb.serializer_configure then
+  sb.serializer_configure(key_aliases, special_keys)
+end
+
+--
+-- `sb.command_argv` sends a list of arguments without any quoting or
+-- splitting (see helper.c). Config tables in the list become one
+-- `key=value` argument per pair. Without the helper the arguments are
+-- quoted and joined into a regular command.
+--
+local function argv_to_command(argv)
+  local args = {}
+  for _, arg in ipairs(argv) do
+    if type(arg) == "table" then
+      local config = serialize_lua(arg)
+      if config ~= "" then table.insert(args, config) end
     else
-      return table.concat(args, " ") .. tail, specials
+      table.insert(args, format_value("", arg))
     end
-  elseif type(tbl) == "string" then
-    return tbl .. tail, {}
   end
+  return table.concat(args, " ")
+end
+
+local command_argv = sb.command_argv or function(argv)
+  return command(argv_to_command(argv))
 end
+sb.command_argv = command_argv
 
--- this is not a direct wrapper of `sketchybar --set` so it needs to be renamed
-local function set_s(name, config, extra)
-  local base = "--set %s %s"
-  local config_arg, specials = serialize_config(config, extra)
-  if config_arg == nil then
-    return nil, specials
+sb.setv = sb.setv or function(name, ...)
+  local config = {}
+  for i = 1, select("#", ...), 2 do
+    local k, v = select(i, ...)
+    config[k] = v
   end
-  return fmt(base, name, config_arg), specials
+  return command_argv({ "--set", name, config })
 end
 
 --
@@ -285,7 +402,11 @@ end
 local function process_subs(tbl)
   local tbl_t = type(tbl)
   if tbl_t == "string" then
-    return { events = tbl }
+    local subs = { events = {}, event_callbacks = {}, global_callbacks = {} }
+    for event in string.gmatch(tbl, "%S+") do
+      table.insert(subs.events, event_name(event))
+    end
+    return subs
   elseif tbl_t == "table" then
     local subs = { events = {}, event_callbacks = {}, global_callbacks = {} }
     for k, v in pairs(tbl) do
@@ -313,27 +434,29 @@ local function process_subs(tbl)
       end
     end
 
-    subs.events = table.concat(subs.events, " ")
     return subs
   end
 end
 
-local function process_events(tbl)
+local function process_events(tbl, argv)
   local tbl_t = type(tbl)
   if tbl_t == "string" then
-    return tbl
+    for event in string.gmatch(tbl, "%S+") do
+      table.insert(argv, event)
+    end
   elseif tbl_t == "table" then
-    local events = {}
     for _, v in ipairs(tbl) do
       local v_t = type(v)
       if v_t == "string" then
-        table.insert(events, v)
+        table.insert(argv, v)
       elseif v_t == "table" then
-        table.insert(events, table.concat(v, " "))
+        for _, e in ipairs(v) do
+          table.insert(argv, e)
+        end
       end
     end
-    return table.concat(events, " ")
   end
+  return argv
 end
 
 local function remove_s(name)
@@ -344,22 +467,29 @@ local function add_item_s(name, position)
   return fmt("--add item %s %s", name, position)
 end
 
-local function add_batch_s(item_type, name, item_config)
-  local config, specials = set_s(name, item_config, "mach_helper=\"" .. helper_name .. "\"")
-  local position = specials.position or "left"
-  local subscribe, events = specials.subscribe, specials.events
-  local cmd = fmt("--add %s %s %s %s", item_type, name, position, config)
+-- The special keys of the config are read here, the serializer skips them
+local function add_batch_argv(item_type, name, item_config)
+  local argv = {
+    "--add", item_type, name, item_config.position or "left",
+    "--set", name, item_config, "mach_helper=" .. helper_name
+  }
 
   -- Add events if the item requires them
+  local events, subscribe = item_config.events, item_config.subscribe
   if events ~= nil then
-    local event_args = process_events(events)
-    cmd = cmd .. " --add event " .. event_args
+    table.insert(argv, "--add")
+    table.insert(argv, "event")
+    process_events(events, argv)
   end
 
   -- Subscribe to events
   if subscribe ~= nil then
     local subs = process_subs(subscribe)
-    cmd = cmd .. " --subscribe " .. name .. " " .. subs.events
+    table.insert(argv, "--subscribe")
+    table.insert(argv, name)
+    for _, event in ipairs(subs.events) do
+      table.insert(argv, event)
+    end
     for _, f in ipairs(subs.global_callbacks) do
       register_callback_item(name, f)
     end
@@ -368,15 +498,25 @@ local function add_batch_s(item_type, name, item_config)
     end
   end
 
-  return cmd
+  return argv
+end
+
+-- A string config is split into arguments like the rest of a string
+-- command, see `config_command`
+local function add_batch(item_type, name, item_config)
+  if type(item_config) == "string" then
+    local argv = add_batch_argv(item_type, name, {})
+    return command(argv_to_command(argv) .. " " .. item_config)
+  end
+  return command_argv(add_batch_argv(item_type, name, item_config or {}))
 end
 
 function sb.item(name, item_config)
-  return command(add_batch_s("item", name, item_config))
+  return add_batch("item", name, item_config)
 end
 
 function sb.space(name, item_config)
-  return command(add_batch_s("space", name, item_config))
+  return add_batch("space", name, item_config)
 end
 
 local function add_space_s(name, position)
@@ -408,12 +548,6 @@ local function add_event_s(name, ns_notification)
   end
 end
 
-local function bar_s(config)
-  local config_arg = serialize_config(config)
-  if config_arg == nil then return end
-  return fmt("--bar %s", config_arg)
-end
-
 local function clone_s(parent, name, position)
   if position ~= nil then
     fmt("--clone %s %s %s", parent, name, position)
@@ -422,12 +556,6 @@ local function clone_s(parent, name, position)
   end
 end
 
-local function defaults_s(config)
-  local config_arg = serialize_config(config)
-  if config_arg == nil then return end
-  return fmt("--default %s", config_arg)
-end
-
 local function reorder_s(...)
   local args = { ... }
   return fmt("--reorder", table.concat(args, " "))
@@ -442,23 +570,24 @@ local function push_s(name, ...)
   return fmt("--push %s %s", name, table.concat(points, " "))
 end
 
-local function trigger_s(event, env)
-  local env_arg = serialize_config(env)
-  if env_arg == nil then
-    return fmt("--trigger %s", event)
-  else
-    return fmt("--trigger %s %s", event, table.concat(env_arg, " "))
-  end
-end
 
 
 --
 -- Actual sketchybar commands
 --
 
+-- `config` is either a config table or a string of `key=value` arguments
+local function config_command(argv, config)
+  if type(config) == "string" then
+    return command(argv_to_command(argv) .. " " .. config)
+  elseif table_not_empty(config) then
+    table.insert(argv, config)
+    return command_argv(argv)
+  end
+end
+
 function sb.set(name, config)
-  local cmd, specials = set_s(name, config)
-  return command(cmd)
+  return config_command({ "--set", name }, config)
 end
 
 function sb.remove(name)
@@ -494,7 +623,7 @@ function sb.add_event(name, ns_notification)
 end
 
 function sb.bar(config)
-  return command(bar_s(config))
+  return config_command({ "--bar" }, config)
 end
 
 function sb.clone(parent, name, position)
@@ -502,7 +631,7 @@ function sb.clone(parent, name, position)
 end
 
 function sb.defaults(config)
-  return command(defaults_s(config))
+  return config_command({ "--default" }, config)
 end
 
 function sb.reorder(...)
@@ -522,7 +651,8 @@ function sb.push(name, ...)
 end
 
 function sb.trigger(event, env)
-  return command(trigger_s(event, env))
+  if env == nil then return command_argv({ "--trigger", event }) end
+  return config_command({ "--trigger", event }, env)
 end
 
 function sb.update()
@@ -532,8 +662,9 @@ end
 
 
 -- Main callback handler. This is called by the C helper and should probably
--- not be called directly.
-function sb.callback(item, event, env)
+-- not be called directly. The helper dispatches through its callback index
+-- without calling into lua first unless this is replaced.
+sb.callback = sb.callback_dispatch or function(item, event, env)
   dispatch_calls(callbacks[1], item, event, env)
   dispatch_calls(nested_get(callbacks, item, 1), item, event, env)
   dispatch_calls(nested_get(callbacks, item, event), item, event, env)
@@ -585,9 +716,26 @@ function sb.subscribe_events(item, event_callbacks)
 end
 
 
-function sb.query(query)
-  local response = command("--query " .. query)
-  return sb.json_parse(response)
+-- With `lazy` set the result is a proxy that only decodes the fields that
+-- are actually read, which is a lot cheaper when a callback only needs one
+-- or two values out of `sb.query("bar")`. Use `sb.pairs`/`sb.ipairs` to loop
+-- over a proxy and `sb.materialize` to turn it into a plain table.
+--
+-- Queries with a `sb.cache_rule` are answered from the helper's cache until
+-- one of the rule's events arrives, so all items handling the same event
+-- share one round trip. Cached results are shared, don't modify them.
+--
+-- ```
+-- sb.cache_rule("--query bar", { "bar_changed" }, 2000)
+-- ```
+function sb.query(query, lazy)
+  local key = "--query " .. query
+  local cached, hit = cache_get(key, lazy)
+  if hit then return cached end
+
+  local result = sb.json_parse(command(key), lazy)
+  cache_put(key, lazy, result)
+  return result
 end
 
 function sb.reset()
@@ -604,6 +752,7 @@ function sb.reset()
     end
   end
   sb.command(remove_all)
+  sb.forget()
 end
 
 function sb.event_names()
@@ -622,10 +771,95 @@ end
 -- General utility functions
 --
 
+-- luajit doesn't honor `__pairs`/`__ipairs` so these are needed to iterate
+-- the lazy query results and the env passed to callbacks. They work on plain
+-- tables as well.
+function sb.pairs(tbl)
+  local mt = getmetatable(tbl)
+  if mt ~= nil and mt.__pairs ~= nil then return mt.__pairs(tbl) end
+  return pairs(tbl)
+end
+
+function sb.ipairs(tbl)
+  local mt = getmetatable(tbl)
+  if mt ~= nil and mt.__ipairs ~= nil then return mt.__ipairs(tbl) end
+  return ipairs(tbl)
+end
+
+-- The coroutines below are the only ones the helper yields to wait for a
+-- process or a query, in any other one those wait in place
+local async_threads = sb.async_threads or setmetatable({}, { __mode = "k" })
+
+-- `sb.async(fn, ...)` runs `fn` in a coroutine, so `sb.spawn` and
+-- `sb.shell` in it let other events be handled while a command runs.
+function sb.async(fn, ...)
+  local co = coroutine.create(fn)
+  async_threads[co] = true
+  local ok, err = coroutine.resume(co, ...)
+  if not ok then
+    print("Async error:")
+    print(err)
+  end
+  return co
+end
+
+-- `sb.await_all(fn, ...)` calls every `fn` in a coroutine of its own and
+-- returns what each of them returned first, in order, once all of them are
+-- done. Queries and processes they start are in flight at the same time:
+--
+-- ```
+-- sb.async(function()
+--   local spaces, windows = sb.await_all(
+--     function() return sb.yabai_query_async("query --spaces") end,
+--     function() return sb.yabai_query_async("query --windows") end)
+-- end)
+-- ```
+--
+-- Outside of `sb.async` the functions simply run one after the other. An
+-- error in one of them is raised once all of them are done.
+function sb.await_all(...)
+  local fns = { ... }
+  local count = select("#", ...)
+  local parent = coroutine.running()
+  if parent == nil or not async_threads[parent] then
+    local results = {}
+    for i = 1, count do results[i] = fns[i]() end
+    return unpack(results, 1, count)
+  end
+
+  local results, remaining, waiting, failure = {}, count, false, nil
+  for i = 1, count do
+    local co = coroutine.create(function()
+      local ok, result = pcall(fns[i])
+      if ok then results[i] = result
+      elseif failure == nil then failure = result end
+
+      remaining = remaining - 1
+      if remaining == 0 and waiting then
+        local resumed, err = coroutine.resume(parent)
+        if not resumed then
+          print("Async error:")
+          print(err)
+        end
+      end
+    end)
+    async_threads[co] = true
+    local ok, err = coroutine.resume(co)
+    if not ok and failure == nil then failure = err end
+  end
+
+  if remaining > 0 then
+    waiting = true
+    coroutine.yield()
+  end
+  if failure ~= nil then error(failure, 0) end
+  return unpack(results, 1, count)
+end
+
+-- `sb.shell(command)` waits for the command's output. Inside of
+-- `sb.async` it only waits in the coroutine, see `sb.spawn`.
 function sb.shell(command, trim)
-  local fd = io.popen(command)
-  local result = fd:read("*a")
-  fd:close()
+  local result = sb.spawn(command)
   if trim ~= false and string.sub(result, -1) == "\n" then
     return string.sub(result, 1, -2)
   end
@@ -638,16 +872,24 @@ end
 --
 
 local function resolve_yabai_binary()
-  local bin_path = sb.shell("which yabai")
-  if bin_path ~= "" and (C.access(bin_path, X_OK) == 0) then
-    return bin_path
+  for dir in string.gmatch(os.getenv("PATH") or "", "[^:]+") do
+    local bin_path = dir .. "/yabai"
+    if C.access(bin_path, X_OK) == 0 then return bin_path end
   end
 end
 
-local function yabai_command_standard(command)
-  local result = sb.shell("yabai -m " .. command)
+local function yabai_command_standard(command, lazy)
+  local cached, hit = cache_get(command, lazy)
+  if hit then return cached end
+  if string.sub(command, 1, 6) ~= "query " and sb.cache_invalidate then
+    sb.cache_invalidate("query ")
+  end
+
+  local result = sb.spawn("yabai -m " .. command)
   if result ~= nil then
-    return sb.json_parse(result)
+    result = sb.json_parse(result, lazy)
+    cache_put(command, lazy, result)
+    return result
   end
 end
 
@@ -663,7 +905,19 @@ local function resolve_yabai_socket()
   end
 end
 
+-- The yabai queries most callbacks make, dropped on the events that change
+-- them. Any yabai command that isn't a query drops them as well.
+local function setup_yabai_cache()
+  if sb.cache_rule == nil then return end
+  sb.cache_rule("query --spaces", { "space_change", "display_change" })
+  sb.cache_rule("query --displays", { "display_change" })
+  sb.cache_rule("query --windows", {
+    "window_focus", "front_app_switched", "space_change", "display_change"
+  })
+end
+
 function sb.setup_yabai()
+  setup_yabai_cache()
   local socket = resolve_yabai_socket()
   if socket ~= nil then
     sb.yabai_communication_mode = "socket"
@@ -840,6 +1094,18 @@ local function resolve_config_dir()
   )
 end
 
+-- Takes the place of the searcher for lua files in `package.loaders`, with
+-- the same messages, only it loads them through the bytecode cache
+local function cached_searcher(name)
+  local path, err = package.searchpath(name, package.path)
+  if path == nil then return err end
+  local chunk, load_err = sb.loadfile(path)
+  if chunk == nil then
+    error(fmt("error loading module '%s' from file '%s':\n\t%s", name, path, load_err), 0)
+  end
+  return chunk
+end
+
 local function load_user_config()
   local config_dir = resolve_config_dir()
   if not path_exists(config_dir) then return end
@@ -859,9 +1125,12 @@ local function load_user_config()
     package.cpath = package.cpath .. ";" .. lib_search
   end
 
+  package.loaders[2] = cached_searcher
+
   if init_file ~= nil then
-    local user_config = assert(loadfile(init_file))
-    local status, err = pcall(user_config)
+    local user_config = assert(sb.loadfile(init_file))
+    -- everything the config sets up goes out as a single message
+    local status, err = pcall(sb.batch, user_config)
     if not status then
       print("Error loading user config")
       print(err)
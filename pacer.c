@@ -0,0 +1,251 @@
+#include "pacer.h"
+
+// Everything a frame holds is copied into `g_arena`, commands and
+// properties refer to it by offset. A merged value is appended rather than
+// overwritten, the arena is only reset once the frame is sent.
+struct pacer_buffer {
+  char* data;
+  uint32_t length;
+  uint32_t capacity;
+};
+
+static struct pacer_buffer g_arena = { 0 };
+static struct pacer_buffer g_frame = { 0 };
+
+static struct pacer_command* g_commands = NULL;
+static uint32_t g_command_count = 0;
+static uint32_t g_command_capacity = 0;
+
+static struct pacer_property* g_properties = NULL;
+static uint32_t g_property_count = 0;
+static uint32_t g_property_capacity = 0;
+
+// sets before this command can't be merged into anymore
+static uint32_t g_barrier = 0;
+
+static uint32_t g_frame_ms = 0;
+static uint32_t g_urgent = 0;
+static uint64_t g_last_flush = 0;
+static struct pacer_stats g_stats = { 0 };
+
+static uint64_t pacer_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool pacer_grow(void** data, uint32_t* capacity, uint32_t count, uint32_t size) {
+  if (count <= *capacity) return true;
+
+  uint32_t new_capacity = *capacity ? *capacity : 64;
+  while (new_capacity < count) new_capacity *= 2;
+
+  void* new_data = realloc(*data, (size_t)new_capacity * size);
+  if (!new_data) return false;
+  *data = new_data;
+  *capacity = new_capacity;
+  return true;
+}
+
+static bool pacer_append(struct pacer_buffer* buffer, const char* data, uint32_t length) {
+  if (!pacer_grow((void**)&buffer->data, &buffer->capacity, buffer->length + length, 1))
+    return false;
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+  return true;
+}
+
+static inline uint32_t pacer_next(const char* args, uint32_t end, uint32_t offset) {
+  while (offset < end && args[offset]) offset++;
+  return offset < end ? offset + 1 : end;
+}
+
+static inline bool pacer_is_command(const char* arg) {
+  return arg[0] == '-' && arg[1] == '-';
+}
+
+// Replies can't wait for the frame, and an `--animate` would spill over
+// into every command that follows it in the combined message.
+static bool pacer_bypass(const char* args, uint32_t end) {
+  for (uint32_t offset = 0; offset < end; offset = pacer_next(args, end, offset)) {
+    if (strcmp(&args[offset], "--query") == 0
+        || strcmp(&args[offset], "--animate") == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static struct pacer_command* pacer_add_command(bool set, const char* data, uint32_t length) {
+  if (!pacer_grow((void**)&g_commands, &g_command_capacity,
+                  g_command_count + 1, sizeof(struct pacer_command))) {
+    return NULL;
+  }
+
+  uint32_t offset = g_arena.length;
+  if (!pacer_append(&g_arena, data, length)) return NULL;
+
+  struct pacer_command* command = &g_commands[g_command_count++];
+  command->set = set;
+  command->offset = offset;
+  command->length = length;
+  command->first_property = -1;
+  command->last_property = -1;
+  return command;
+}
+
+static struct pacer_command* pacer_find_set(const char* item, uint32_t length) {
+  for (uint32_t i = g_barrier; i < g_command_count; i++) {
+    struct pacer_command* command = &g_commands[i];
+    if (command->set && command->length == length
+        && memcmp(g_arena.data + command->offset, item, length) == 0) {
+      return command;
+    }
+  }
+  return NULL;
+}
+
+// The key includes the `=` so an argument without one only merges with
+// the exact same argument.
+static bool pacer_set_property(struct pacer_command* command, const char* arg, uint32_t length) {
+  const char* equals = memchr(arg, '=', length);
+  uint32_t key_length = equals ? equals - arg + 1 : length;
+
+  for (int32_t i = command->first_property; i >= 0; i = g_properties[i].next) {
+    struct pacer_property* property = &g_properties[i];
+    if (property->key_length == key_length
+        && memcmp(g_arena.data + property->key, arg, key_length) == 0) {
+      uint32_t value = g_arena.length;
+      if (!pacer_append(&g_arena, arg + key_length, length - key_length)) return false;
+      property->value = value;
+      property->value_length = length - key_length;
+      g_stats.merged++;
+      return true;
+    }
+  }
+
+  if (!pacer_grow((void**)&g_properties, &g_property_capacity,
+                  g_property_count + 1, sizeof(struct pacer_property))) {
+    return false;
+  }
+
+  uint32_t key = g_arena.length;
+  if (!pacer_append(&g_arena, arg, length)) return false;
+
+  int32_t index = g_property_count++;
+  g_properties[index] = (struct pacer_property) { key, key_length,
+                                                  key + key_length,
+                                                  length - key_length, -1 };
+  if (command->last_property >= 0) g_properties[command->last_property].next = index;
+  else command->first_property = index;
+  command->last_property = index;
+  return true;
+}
+
+// `frame_ms` 0 turns pacing off, the caller has to send what is left
+void pacer_configure(uint32_t frame_ms) {
+  g_frame_ms = frame_ms;
+}
+
+// Commands queued while urgent bypass the frame, calls nest
+void pacer_urgent(bool urgent) {
+  if (urgent) g_urgent++;
+  else if (g_urgent > 0) g_urgent--;
+}
+
+// Takes the NUL terminated arguments of a message (with the extra NUL at
+// the end) into the current frame. Returns false if the message has to be
+// sent right away, after sending what the frame holds.
+bool pacer_queue(char* args, uint32_t length) {
+  uint32_t end = length > 0 ? length - 1 : 0;
+  if (g_frame_ms == 0 || g_urgent > 0 || pacer_bypass(args, end)) {
+    if (g_frame_ms > 0) g_stats.bypassed++;
+    return false;
+  }
+
+  // a failed allocation loses at most this message, the frame stays intact
+  uint32_t offset = 0;
+  while (offset < end) {
+    uint32_t next = pacer_next(args, end, offset);
+
+    if (strcmp(&args[offset], "--set") == 0 && next < end && args[next] != '/') {
+      uint32_t item_length = pacer_next(args, end, next) - next - 1;
+      struct pacer_command* command = pacer_find_set(&args[next], item_length);
+      if (!command) command = pacer_add_command(true, &args[next], item_length);
+      if (!command) return true;
+
+      offset = pacer_next(args, end, next);
+      while (offset < end && !pacer_is_command(&args[offset])) {
+        next = pacer_next(args, end, offset);
+        if (!pacer_set_property(command, &args[offset], next - offset - 1))
+          return true;
+        offset = next;
+      }
+      continue;
+    }
+
+    // anything else is copied as it is, up to the next command
+    uint32_t start = offset;
+    offset = next;
+    while (offset < end && !pacer_is_command(&args[offset]))
+      offset = pacer_next(args, end, offset);
+
+    if (!pacer_add_command(false, &args[start], offset - start)) return true;
+    g_barrier = g_command_count;
+  }
+
+  g_stats.messages++;
+  return true;
+}
+
+// Returns the frame as one message and starts the next one, NULL if there
+// is nothing to send. The message is only valid until the next call.
+char* pacer_take(uint32_t* length) {
+  if (g_command_count == 0) return NULL;
+
+  g_frame.length = 0;
+  bool ok = true;
+  for (uint32_t i = 0; ok && i < g_command_count; i++) {
+    struct pacer_command* command = &g_commands[i];
+    if (!command->set) {
+      ok = pacer_append(&g_frame, g_arena.data + command->offset, command->length);
+      continue;
+    }
+
+    ok = pacer_append(&g_frame, "--set", 6)
+         && pacer_append(&g_frame, g_arena.data + command->offset, command->length)
+         && pacer_append(&g_frame, "", 1);
+
+    for (int32_t j = command->first_property; ok && j >= 0; j = g_properties[j].next) {
+      struct pacer_property* property = &g_properties[j];
+      ok = pacer_append(&g_frame, g_arena.data + property->key, property->key_length)
+           && pacer_append(&g_frame, g_arena.data + property->value, property->value_length)
+           && pacer_append(&g_frame, "", 1);
+    }
+  }
+  ok = ok && pacer_append(&g_frame, "", 1);
+
+  g_arena.length = 0;
+  g_command_count = 0;
+  g_property_count = 0;
+  g_barrier = 0;
+  g_last_flush = pacer_now_ms();
+  if (!ok) return NULL;
+
+  g_stats.frames++;
+  *length = g_frame.length;
+  return g_frame.data;
+}
+
+// Milliseconds until the frame should be sent, -1 if it is empty
+int32_t pacer_due_in() {
+  if (g_command_count == 0) return -1;
+
+  uint64_t now = pacer_now_ms();
+  uint64_t due = g_last_flush + g_frame_ms;
+  return due > now ? (int32_t)(due - now) : 0;
+}
+
+struct pacer_stats pacer_stats() {
+  return g_stats;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define PACER_DEFAULT_FRAME_MS 16
+
+//
+// The pacer holds outgoing commands back for up to one frame and sends
+// everything that piled up as a single message. Sets of the same
+// `item.property` within a frame are merged, only the last value is sent,
+// so a storm of mouse or window events costs one message per frame no
+// matter how many callbacks ran.
+//
+// The first message after a quiet frame is sent right away, only the ones
+// following it within the budget are held back.
+//
+// Order is kept: a set is only merged into an earlier one if no other
+// command came in between, anything but a `--set` is a barrier. Messages
+// that need a reply (`--query`) or that hold an `--animate` are never
+// held, they flush the frame and are sent on their own.
+//
+struct pacer_command {
+  bool set;
+  // set: the item name, otherwise the arguments as they came in
+  uint32_t offset;
+  uint32_t length;
+  int32_t first_property;
+  int32_t last_property;
+};
+
+struct pacer_property {
+  uint32_t key;
+  uint32_t key_length;
+  uint32_t value;
+  uint32_t value_length;
+  int32_t next;
+};
+
+struct pacer_stats {
+  uint64_t frames;
+  uint64_t messages;
+  uint64_t merged;
+  uint64_t bypassed;
+};
+
+void pacer_configure(uint32_t frame_ms);
+void pacer_urgent(bool urgent);
+
+bool pacer_queue(char* args, uint32_t length);
+char* pacer_take(uint32_t* length);
+int32_t pacer_due_in();
+
+struct pacer_stats pacer_stats();
@@ -1,177 +1,366 @@
 #include "parsing.h"
 
-char* parse_kv_table(lua_State* state, char* prefix) {
-  lua_pushnil(state);
-  const char* key,* value;
-  char* kv_pairs = NULL;
-  char hex[16];
-
-  while (lua_next(state, -2)) {
-    uint32_t kv_pair_len = kv_pairs ? strlen(kv_pairs) : 0;
-    if (lua_isnil(state, -2)) {
-      if (kv_pairs) free(kv_pairs);
-      return NULL;
+//
+// Config tables are serialized into `key=value` pairs for `--set`, `--bar`
+// and friends. Nested tables are flattened into dotted keys, `[1]` of a
+// nested table is the value of the key itself:
+//
+//   { label = { "text", padding = { left = 8 } }, drawing = true }
+//
+//   label=text label.padding_left=8 drawing=on
+//
+// Everything is written into buffers that are kept between calls, so after
+// the first few items a call doesn't allocate at all.
+//
+// For `sb.command_argv` the pairs are written as arguments in the wire
+// format instead (NUL terminated, nothing quoted), see parse_kv_argument.
+//
+
+#define PARSE_KV_MAX_DEPTH 32
+
+struct parse_kv_alias {
+  char* key;
+  uint32_t key_length;
+
+  // NULL drops the key
+  char* alias;
+  uint32_t alias_length;
+};
+
+// Where the pairs of the current call go. `specials` is the stack index
+// special keys are collected in, 0 serializes them like any other key and
+// -1 drops them.
+struct parse_kv_output {
+  struct parse_kv_buffer* buffer;
+  bool argv;
+  int specials;
+};
+
+static struct parse_kv_alias* g_aliases = NULL;
+static uint32_t g_alias_count = 0;
+
+static char** g_special_keys = NULL;
+static uint32_t g_special_key_count = 0;
+
+static struct parse_kv_buffer g_pairs = { 0 };
+static struct parse_kv_buffer g_key = { 0 };
+
+bool parse_kv_reserve(struct parse_kv_buffer* buffer, uint32_t bytes) {
+  if (buffer->length + bytes <= buffer->capacity) return true;
+
+  uint32_t capacity = buffer->capacity ? buffer->capacity : 256;
+  while (capacity < buffer->length + bytes) capacity *= 2;
+
+  char* data = realloc(buffer->data, capacity);
+  if (!data) return false;
+  buffer->data = data;
+  buffer->capacity = capacity;
+  return true;
+}
+
+static inline void parse_kv_append(lua_State* state, struct parse_kv_buffer* buffer, const char* string, uint32_t length) {
+  if (!parse_kv_reserve(buffer, length))
+    luaL_error(state, "out of memory serializing config");
+
+  memcpy(buffer->data + buffer->length, string, length);
+  buffer->length += length;
+}
+
+// The command is split into arguments at spaces outside of quotes and the
+// quotes are stripped. A `"` can't appear inside double quotes, so it is
+// written as `"'"'"`: close the double quotes, a single quoted `"` and open
+// them again.
+static void parse_kv_append_quoted(lua_State* state, struct parse_kv_buffer* buffer, const char* value, uint32_t length) {
+  bool needs_quotes = length == 0;
+  for (uint32_t i = 0; i < length && !needs_quotes; i++) {
+    needs_quotes = value[i] == ' ' || value[i] == '"' || value[i] == '\'';
+  }
+
+  if (!needs_quotes) {
+    parse_kv_append(state, buffer, value, length);
+    return;
+  }
+
+  parse_kv_append(state, buffer, "\"", 1);
+  uint32_t start = 0;
+  for (uint32_t i = 0; i < length; i++) {
+    if (value[i] != '"') continue;
+    parse_kv_append(state, buffer, value + start, i - start);
+    parse_kv_append(state, buffer, "\"'\"'\"", 5);
+    start = i + 1;
+  }
+  parse_kv_append(state, buffer, value + start, length - start);
+  parse_kv_append(state, buffer, "\"", 1);
+}
+
+static bool parse_kv_is_special(const char* key, uint32_t length) {
+  for (uint32_t i = 0; i < g_special_key_count; i++) {
+    if (strncmp(g_special_keys[i], key, length) == 0
+        && g_special_keys[i][length] == '\0') {
+      return true;
     }
+  }
+  return false;
+}
 
-    key = lua_tostring(state, -2);
+// snprintf with `%.14g` is by far the slowest part of a pair, and almost
+// every number in a config is an integer.
+static uint32_t parse_kv_format_number(char* buffer, lua_Number value) {
+  if (!(value >= -1e15 && value <= 1e15)
+      || value != (lua_Number)(int64_t)value) {
+    return snprintf(buffer, 32, LUA_NUMBER_FMT, value);
+  }
 
-    if (lua_type(state, -1) == LUA_TTABLE) {
-      if (prefix) {
-        uint32_t new_prefix_len = (prefix ? strlen(prefix) : 0)
-                                  + strlen(key)
-                                  + 2;
-
-        char new_prefix[new_prefix_len];
-        snprintf(new_prefix, new_prefix_len, "%s.%s", prefix, key);
-        value = parse_kv_table(state, new_prefix);
-      } else {
-        value = parse_kv_table(state, (char*)key);
-      }
+  int64_t integer = (int64_t)value;
+  uint64_t magnitude = integer < 0 ? -(uint64_t)integer : (uint64_t)integer;
+  char digits[20];
+  uint32_t count = 0;
+  do {
+    digits[count++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude);
 
-      if (!value) {
-        if (kv_pairs) free(kv_pairs);
-        return NULL;
-      }
+  uint32_t length = 0;
+  if (integer < 0) buffer[length++] = '-';
+  while (count) buffer[length++] = digits[--count];
+  return length;
+}
 
-      uint32_t new_kv_pair_len = kv_pair_len
-                                 + strlen(value)
-                                 + 1;
+static uint32_t parse_kv_format_color(char* buffer, lua_Number value) {
+  static const char hex[] = "0123456789abcdef";
+  uint32_t color = (uint32_t)(int64_t)value;
+  buffer[0] = '0';
+  buffer[1] = 'x';
+  for (int i = 0; i < 8; i++) buffer[2 + i] = hex[(color >> (28 - 4 * i)) & 0xf];
+  return 10;
+}
 
-      kv_pairs = realloc(kv_pairs, new_kv_pair_len);
-      snprintf(kv_pairs + kv_pair_len, new_kv_pair_len, "%s", value);
-      free((char*)value);
+static bool parse_kv_is_color(const char* key, uint32_t length) {
+  return length >= 5 && memcmp(key + length - 5, "color", 5) == 0;
+}
+
+// Writes the scalar at the top of the stack as a value, `key` decides
+// whether numbers are colors
+static void parse_kv_value(lua_State* state, struct parse_kv_output* output, const char* key, uint32_t key_length) {
+  struct parse_kv_buffer* buffer = output->buffer;
+  int type = lua_type(state, -1);
+
+  if (type == LUA_TBOOLEAN) {
+    if (lua_toboolean(state, -1)) parse_kv_append(state, buffer, "on", 2);
+    else parse_kv_append(state, buffer, "off", 3);
+  } else if (type == LUA_TNUMBER) {
+    char number[32];
+    lua_Number value = lua_tonumber(state, -1);
+    uint32_t length = parse_kv_is_color(key, key_length)
+                      ? parse_kv_format_color(number, value)
+                      : parse_kv_format_number(number, value);
+    parse_kv_append(state, buffer, number, length);
+  } else {
+    size_t length;
+    const char* value = lua_tolstring(state, -1, &length);
+    if (output->argv) parse_kv_append(state, buffer, value, length);
+    else parse_kv_append_quoted(state, buffer, value, length);
+  }
+}
+
+// Writes `key=value` for the scalar at the top of the stack, `path` is the
+// current contents of `g_key`.
+static void parse_kv_pair(lua_State* state, struct parse_kv_output* output, const char* path) {
+  const char* key = g_key.data;
+  uint32_t key_length = g_key.length;
+
+  for (uint32_t i = 0; i < g_alias_count; i++) {
+    if (g_aliases[i].key_length == key_length
+        && memcmp(g_aliases[i].key, key, key_length) == 0) {
+      if (!g_aliases[i].alias) return;
+      key = g_aliases[i].alias;
+      key_length = g_aliases[i].alias_length;
+      break;
     }
-    else {
-      if (lua_type(state, -1) == LUA_TBOOLEAN) {
-        value = lua_toboolean(state, -1) ? "on" : "off";
-      } else {
-        if ((strcmp(key, "color") == 0 || strcmp(key, "border_color") == 0)
-            && lua_type(state, -1) == LUA_TNUMBER) {
-          uint32_t number = lua_tonumber(state, -1);
-          snprintf(hex, 16, "0x%x", number);
-          value = hex;
-        } else {
-          value = lua_tostring(state, -1);
+  }
+
+  int type = lua_type(state, -1);
+  if (type != LUA_TSTRING && type != LUA_TNUMBER && type != LUA_TBOOLEAN) {
+    luaL_error(state, "cannot serialize a %s value for '%s'",
+                      lua_typename(state, type), path);
+  }
+
+  struct parse_kv_buffer* buffer = output->buffer;
+  if (!output->argv && buffer->length > 0) parse_kv_append(state, buffer, " ", 1);
+  parse_kv_append(state, buffer, key, key_length);
+  parse_kv_append(state, buffer, "=", 1);
+  parse_kv_value(state, output, key, key_length);
+  if (output->argv) parse_kv_append(state, buffer, "", 1);
+}
+
+static void parse_kv_table_at(lua_State* state, struct parse_kv_output* output, int index, uint32_t depth) {
+  if (depth > PARSE_KV_MAX_DEPTH)
+    luaL_error(state, "config is nested too deeply (is it recursive?)");
+
+  uint32_t prefix_length = g_key.length;
+
+  lua_pushnil(state);
+  while (lua_next(state, index)) {
+    g_key.length = prefix_length;
+    int key_type = lua_type(state, -2);
+
+    if (key_type == LUA_TSTRING) {
+      size_t key_length;
+      const char* key = lua_tolstring(state, -2, &key_length);
+
+      int specials = output->specials;
+      if (depth == 0 && specials
+          && parse_kv_is_special(key, key_length)) {
+        if (specials > 0) {
+          if (lua_isnil(state, specials)) {
+            lua_newtable(state);
+            lua_replace(state, specials);
+          }
+          lua_pushvalue(state, -2);
+          lua_pushvalue(state, -2);
+          lua_rawset(state, specials);
         }
+        lua_pop(state, 1);
+        continue;
       }
 
-      uint32_t new_kv_pair_len = (prefix ? strlen(prefix) + 1 : 0)
-                                  + kv_pair_len
-                                  + strlen(value)
-                                  + strlen(key)
-                                  + 5;
-
-      kv_pairs = realloc(kv_pairs, new_kv_pair_len);
-      if (prefix) {
-        snprintf(kv_pairs + kv_pair_len, new_kv_pair_len, " %s.%s='%s'",
-                                                          prefix,
-                                                          key,
-                                                          value         );
-      }
-      else {
-        snprintf(kv_pairs + kv_pair_len, new_kv_pair_len, " %s='%s'",
-                                                          key,
-                                                          value      );
-      }
+      if (prefix_length > 0) parse_kv_append(state, &g_key, ".", 1);
+      parse_kv_append(state, &g_key, key, key_length);
+    } else if (key_type == LUA_TNUMBER && lua_tonumber(state, -2) != 1) {
+      char number[32];
+      uint32_t length = parse_kv_format_number(number, lua_tonumber(state, -2));
+      if (prefix_length > 0) parse_kv_append(state, &g_key, ".", 1);
+      parse_kv_append(state, &g_key, number, length);
     }
+    // otherwise `[1]` (or any other non-string key) sets the value of the
+    // parent key, which is dropped at the top level
+
+    if (lua_type(state, -1) == LUA_TTABLE) {
+      parse_kv_table_at(state, output, lua_gettop(state), depth + 1);
+    } else if (g_key.length > 0) {
+      // NUL terminated for error messages
+      if (!parse_kv_reserve(&g_key, 1))
+        luaL_error(state, "out of memory serializing config");
+      g_key.data[g_key.length] = '\0';
+      parse_kv_pair(state, output, g_key.data);
+    }
+
     lua_pop(state, 1);
   }
 
-  return kv_pairs;
+  g_key.length = prefix_length;
 }
 
-void json_object_to_lua_table(lua_State* state, cJSON* json);
-
-void json_array_to_lua_table(lua_State* state, cJSON* json) {
-  int i = 1;
-  cJSON* item;
-  lua_newtable(state);
-  cJSON_ArrayForEach(item, json) {
-    switch (item->type) {
-      case cJSON_Number:
-        lua_pushnumber(state, item->valuedouble);
-        break;
-      case cJSON_String:
-        lua_pushstring(state, item->valuestring);
-        break;
-      case cJSON_Array:
-        json_array_to_lua_table(state, item);
-        break;
-      case cJSON_Object:
-        json_object_to_lua_table(state, item);
-        break;
-      case cJSON_True:
-        lua_pushboolean(state, true);
-        break;
-      case cJSON_False:
-        lua_pushboolean(state, false);
-        break;
-      default:
-        lua_pushnil(state);
-        break;
-    }
-    
-    lua_rawseti(state, -2, i);
-    i++;
+// Serializes the config table at `index`. Top level special keys are not
+// serialized but copied into a table stored at `specials` which has to
+// hold nil initially, pass 0 to serialize them like any other key. `extra`
+// is appended verbatim if it isn't NULL.
+//
+// The returned string is only valid until the next call.
+char* parse_kv_table(lua_State* state, int index, int specials, const char* extra, uint32_t* length) {
+  if (index < 0) index = lua_gettop(state) + index + 1;
+
+  struct parse_kv_output output = { &g_pairs, false, specials };
+  g_pairs.length = 0;
+  g_key.length = 0;
+  parse_kv_table_at(state, &output, index, 0);
+
+  if (extra) {
+    if (g_pairs.length > 0) parse_kv_append(state, &g_pairs, " ", 1);
+    parse_kv_append(state, &g_pairs, extra, strlen(extra));
   }
+
+  if (!parse_kv_reserve(&g_pairs, 1))
+    luaL_error(state, "out of memory serializing config");
+  g_pairs.data[g_pairs.length] = '\0';
+
+  *length = g_pairs.length;
+  return g_pairs.data;
 }
 
-void json_object_to_lua_table(lua_State* state, cJSON* json) {
-  lua_newtable(state);
-  cJSON* item;
-  cJSON_ArrayForEach(item, json) {
-    lua_pushstring(state, item->string);
-    switch (item->type) {
-      case cJSON_Number:
-        lua_pushnumber(state, item->valuedouble);
-        break;
-      case cJSON_String:
-        lua_pushstring(state, item->valuestring);
-        break;
-      case cJSON_Array:
-        json_array_to_lua_table(state, item);
-        break;
-      case cJSON_Object:
-        json_object_to_lua_table(state, item);
-        break;
-      case cJSON_True:
-        lua_pushboolean(state, true);
-        break;
-      case cJSON_False:
-        lua_pushboolean(state, false);
-        break;
-      default:
-        lua_pushnil(state);
-        break;
-    }
-    lua_settable(state, -3);
+// Appends the value at `index` to `argv` as NUL terminated arguments:
+// strings verbatim, numbers and booleans formatted like config values and
+// config tables as one `key=value` argument per pair, without their special
+// keys.
+void parse_kv_argument(lua_State* state, int index, struct parse_kv_buffer* argv) {
+  if (index < 0) index = lua_gettop(state) + index + 1;
+  struct parse_kv_output output = { argv, true, -1 };
+
+  int type = lua_type(state, index);
+  if (type == LUA_TTABLE) {
+    g_key.length = 0;
+    parse_kv_table_at(state, &output, index, 0);
+    return;
+  }
+
+  if (type != LUA_TSTRING && type != LUA_TNUMBER && type != LUA_TBOOLEAN) {
+    luaL_error(state, "cannot use a %s value as a command argument",
+                      lua_typename(state, type));
   }
+
+  lua_pushvalue(state, index);
+  parse_kv_value(state, &output, "", 0);
+  parse_kv_append(state, argv, "", 1);
+  lua_pop(state, 1);
 }
 
-bool json_to_lua_table(lua_State* state, const char* json_str) {
-  cJSON* json = cJSON_Parse(json_str);
-  if (!json) {
-    return false;
+// Appends `key=value` as a single argument, the key is aliased like a
+// config key
+void parse_kv_pair_argument(lua_State* state, int key, int value, struct parse_kv_buffer* argv) {
+  if (value < 0) value = lua_gettop(state) + value + 1;
+  struct parse_kv_output output = { argv, true, -1 };
+
+  size_t key_length;
+  const char* key_string = luaL_checklstring(state, key, &key_length);
+  g_key.length = 0;
+  parse_kv_append(state, &g_key, key_string, key_length);
+  parse_kv_append(state, &g_key, "", 1);
+  g_key.length--;
+
+  lua_pushvalue(state, value);
+  parse_kv_pair(state, &output, g_key.data);
+  lua_pop(state, 1);
+}
+
+// Replaces the alias map with the `{ [key] = alias }` table at `aliases`,
+// where an alias that isn't a string drops the key, and the special keys
+// with the keys of the table at `specials`.
+void parse_kv_configure(lua_State* state, int aliases, int specials) {
+  for (uint32_t i = 0; i < g_alias_count; i++) {
+    free(g_aliases[i].key);
+    if (g_aliases[i].alias) free(g_aliases[i].alias);
   }
+  for (uint32_t i = 0; i < g_special_key_count; i++) free(g_special_keys[i]);
+  g_alias_count = 0;
+  g_special_key_count = 0;
 
-  if (cJSON_IsInvalid(json)) {
-    cJSON_Delete(json);
-    return false;
+  lua_pushnil(state);
+  while (lua_next(state, aliases)) {
+    if (lua_type(state, -2) == LUA_TSTRING) {
+      g_aliases = realloc(g_aliases, sizeof(struct parse_kv_alias)
+                                     * (g_alias_count + 1));
+      struct parse_kv_alias* alias = &g_aliases[g_alias_count++];
+      alias->key = strdup(lua_tostring(state, -2));
+      alias->key_length = strlen(alias->key);
+      alias->alias = lua_type(state, -1) == LUA_TSTRING
+                     ? strdup(lua_tostring(state, -1))
+                     : NULL;
+      alias->alias_length = alias->alias ? strlen(alias->alias) : 0;
+    }
+    lua_pop(state, 1);
   }
 
-  switch (json->type) {
-    case cJSON_Array:
-      json_array_to_lua_table(state, json);
-      break;
-    case cJSON_Object:
-      json_object_to_lua_table(state, json);
-      break;
-    default:
-      cJSON_Delete(json);
-      return false;
-      break;
+  lua_pushnil(state);
+  while (lua_next(state, specials)) {
+    if (lua_type(state, -2) == LUA_TSTRING && lua_toboolean(state, -1)) {
+      g_special_keys = realloc(g_special_keys, sizeof(char*)
+                                               * (g_special_key_count + 1));
+      g_special_keys[g_special_key_count++] = strdup(lua_tostring(state, -2));
+    }
+    lua_pop(state, 1);
   }
-  cJSON_Delete(json);
-  return true;
 }
 
+bool json_to_lua_table(lua_State* state, const char* json_str) {
+  return json_decode(state, json_str, strlen(json_str));
+}
@@ -4,9 +4,22 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
-#include "cJSON.h"
+#include "json.h"
 
-char* parse_kv_table(lua_State* state, char* prefix);
+struct parse_kv_buffer {
+  char* data;
+  uint32_t length;
+  uint32_t capacity;
+};
+
+bool parse_kv_reserve(struct parse_kv_buffer* buffer, uint32_t bytes);
+
+char* parse_kv_table(lua_State* state, int index, int specials, const char* extra, uint32_t* length);
+void parse_kv_argument(lua_State* state, int index, struct parse_kv_buffer* argv);
+void parse_kv_pair_argument(lua_State* state, int key, int value, struct parse_kv_buffer* argv);
+void parse_kv_configure(lua_State* state, int aliases, int specials);
 bool json_to_lua_table(lua_State* state, const char* json_str);
 
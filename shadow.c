@@ -0,0 +1,384 @@
+#include "shadow.h"
+
+#define SHADOW_INITIAL_CAPACITY 64
+
+// Items are never removed from the table, invalidating one only drops its
+// properties, so probing doesn't need tombstones.
+static struct shadow_item** g_items = NULL;
+static uint32_t g_item_capacity = 0;
+static uint32_t g_item_count = 0;
+static uint32_t g_property_count = 0;
+
+// Sets waiting for their message to be posted, oldest first
+static struct shadow_pending* g_pending = NULL;
+static uint32_t g_pending_count = 0;
+static uint32_t g_pending_capacity = 0;
+static uint64_t g_pending_seq = 0;
+
+static bool g_enabled = true;
+static struct shadow_stats g_stats = { 0 };
+
+static uint32_t shadow_hash(const char* string, uint32_t length) {
+  uint32_t hash = 2166136261u;
+  for (uint32_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)string[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static struct shadow_item** shadow_slot(struct shadow_item** items, uint32_t capacity, const char* name, uint32_t hash) {
+  uint32_t i = hash & (capacity - 1);
+  while (items[i] && (items[i]->hash != hash || strcmp(items[i]->name, name) != 0))
+    i = (i + 1) & (capacity - 1);
+  return &items[i];
+}
+
+static bool shadow_grow() {
+  uint32_t capacity = g_item_capacity ? g_item_capacity * 2 : SHADOW_INITIAL_CAPACITY;
+  struct shadow_item** items = calloc(capacity, sizeof(struct shadow_item*));
+  if (!items) return false;
+
+  for (uint32_t i = 0; i < g_item_capacity; i++) {
+    if (!g_items[i]) continue;
+    *shadow_slot(items, capacity, g_items[i]->name, g_items[i]->hash) = g_items[i];
+  }
+
+  free(g_items);
+  g_items = items;
+  g_item_capacity = capacity;
+  return true;
+}
+
+static struct shadow_item* shadow_find(const char* name, bool create) {
+  uint32_t hash = shadow_hash(name, strlen(name));
+  if (g_item_capacity > 0) {
+    struct shadow_item* item = *shadow_slot(g_items, g_item_capacity, name, hash);
+    if (item || !create) return item;
+  } else if (!create) return NULL;
+
+  if ((g_item_count + 1) * 4 > g_item_capacity * 3 && !shadow_grow()) return NULL;
+
+  struct shadow_item* item = calloc(1, sizeof(struct shadow_item));
+  if (!item) return NULL;
+  item->name = strdup(name);
+  item->hash = hash;
+  if (!item->name) {
+    free(item);
+    return NULL;
+  }
+
+  *shadow_slot(g_items, g_item_capacity, name, hash) = item;
+  g_item_count++;
+  return item;
+}
+
+static void shadow_remove_property(struct shadow_item* item, uint32_t index) {
+  free(item->properties[index].key);
+  free(item->properties[index].value);
+  item->properties[index] = item->properties[--item->property_count];
+  g_property_count--;
+}
+
+// Drops a set that won't be recorded, the strings may already be taken
+static void shadow_pending_drop(struct shadow_pending* pending) {
+  free(pending->key);
+  free(pending->value);
+  pending->key = pending->value = NULL;
+  if (pending->item) pending->item->pending--;
+  pending->item = NULL;
+}
+
+// Forgets the pending sets of `item`, only those of `key` if it is given
+static void shadow_pending_forget(struct shadow_item* item, const char* key, uint32_t key_length) {
+  for (uint32_t i = 0; i < g_pending_count && item->pending > 0; i++) {
+    struct shadow_pending* pending = &g_pending[i];
+    if (pending->item != item) continue;
+    if (key && (pending->key_length != key_length
+                || memcmp(pending->key, key, key_length) != 0)) continue;
+    shadow_pending_drop(pending);
+  }
+}
+
+static void shadow_clear(struct shadow_item* item) {
+  while (item->property_count > 0) shadow_remove_property(item, 0);
+  shadow_pending_forget(item, NULL, 0);
+}
+
+// `icon` and `icon.string` (or `icon.font` and `icon.font.size`) name the
+// same state, so setting one of them forgets the other. `icon` and
+// `icon.color` don't, forgetting those every time both are set would keep
+// either from ever being suppressed.
+static bool shadow_overlaps(const char* a, uint32_t a_length, const char* b, uint32_t b_length) {
+  if (a_length == b_length) return false;
+  if (a_length > b_length) return shadow_overlaps(b, b_length, a, a_length);
+  if (memcmp(a, b, a_length) != 0 || b[a_length] != '.') return false;
+
+  const char* rest = b + a_length + 1;
+  uint32_t rest_length = b_length - a_length - 1;
+  if (rest_length == 6 && memcmp(rest, "string", 6) == 0) return true;
+  return (a_length == 4 || (a_length > 4 && a[a_length - 5] == '.'))
+         && memcmp(a + a_length - 4, "font", 4) == 0;
+}
+
+// True if a set of `key`, or of a key naming the same state, is pending
+static bool shadow_pending_has(struct shadow_item* item, const char* key, uint32_t key_length) {
+  if (item->pending == 0) return false;
+  for (uint32_t i = 0; i < g_pending_count; i++) {
+    struct shadow_pending* pending = &g_pending[i];
+    if (pending->item != item) continue;
+    if ((pending->key_length == key_length && memcmp(pending->key, key, key_length) == 0)
+        || shadow_overlaps(pending->key, pending->key_length, key, key_length))
+      return true;
+  }
+  return false;
+}
+
+static char* shadow_copy(const char* string, uint32_t length) {
+  char* copy = malloc(length + 1);
+  if (!copy) return NULL;
+  memcpy(copy, string, length);
+  copy[length] = '\0';
+  return copy;
+}
+
+// Queues `key=value` to be recorded once the message carrying it was
+// posted, false if it can't be
+static bool shadow_defer(struct shadow_item* item, const char* key, uint32_t key_length, const char* value, uint32_t value_length) {
+  if (g_pending_count == g_pending_capacity) {
+    uint32_t capacity = g_pending_capacity ? g_pending_capacity * 2 : SHADOW_INITIAL_CAPACITY;
+    struct shadow_pending* pending = realloc(g_pending, capacity * sizeof(struct shadow_pending));
+    if (!pending) return false;
+    g_pending = pending;
+    g_pending_capacity = capacity;
+  }
+
+  char* key_copy = shadow_copy(key, key_length);
+  char* value_copy = shadow_copy(value, value_length);
+  if (!key_copy || !value_copy) {
+    free(key_copy);
+    free(value_copy);
+    return false;
+  }
+
+  g_pending[g_pending_count++] = (struct shadow_pending) {
+    item, key_copy, value_copy, key_length, value_length, g_pending_seq++
+  };
+  item->pending++;
+  return true;
+}
+
+// Returns true if `key=value` is what the bar already has, otherwise
+// queues it to be recorded once it was posted.
+static bool shadow_unchanged(struct shadow_item* item, const char* key, uint32_t key_length, const char* value, uint32_t value_length) {
+  // `toggle` depends on the state, it is always sent and leaves it unknown
+  if (value_length == 6 && memcmp(value, "toggle", 6) == 0) {
+    for (uint32_t i = 0; i < item->property_count; i++) {
+      struct shadow_property* current = &item->properties[i];
+      if (current->key_length == key_length
+          && memcmp(current->key, key, key_length) == 0) {
+        shadow_remove_property(item, i);
+        break;
+      }
+    }
+    shadow_pending_forget(item, key, key_length);
+    return false;
+  }
+
+  if (!shadow_pending_has(item, key, key_length)) {
+    for (uint32_t i = 0; i < item->property_count; i++) {
+      struct shadow_property* current = &item->properties[i];
+      if (current->key_length == key_length
+          && memcmp(current->key, key, key_length) == 0) {
+        if (current->value_length == value_length
+            && memcmp(current->value, value, value_length) == 0) {
+          return true;
+        }
+        break;
+      }
+    }
+  }
+
+  // whatever the bar ends up with can't be known without it
+  if (!shadow_defer(item, key, key_length, value, value_length)) shadow_clear(item);
+  return false;
+}
+
+// Records a set that was posted, the strings of `pending` are taken over
+static void shadow_record(struct shadow_pending* pending) {
+  struct shadow_item* item = pending->item;
+  struct shadow_property* property = NULL;
+  for (uint32_t i = 0; i < item->property_count;) {
+    struct shadow_property* current = &item->properties[i];
+    if (current->key_length == pending->key_length
+        && memcmp(current->key, pending->key, pending->key_length) == 0) {
+      property = current;
+    } else if (shadow_overlaps(current->key, current->key_length,
+                               pending->key, pending->key_length)) {
+      shadow_remove_property(item, i);
+      // removing moves the last property into this slot
+      if (property == &item->properties[item->property_count]) property = current;
+      continue;
+    }
+    i++;
+  }
+
+  if (!property) {
+    if (item->property_count == item->property_capacity) {
+      uint32_t capacity = item->property_capacity ? item->property_capacity * 2 : 8;
+      struct shadow_property* properties = realloc(item->properties, capacity * sizeof(struct shadow_property));
+      if (!properties) return;
+      item->properties = properties;
+      item->property_capacity = capacity;
+    }
+
+    property = &item->properties[item->property_count++];
+    property->key = pending->key;
+    property->key_length = pending->key_length;
+    property->value = NULL;
+    pending->key = NULL;
+    g_property_count++;
+  }
+
+  free(property->value);
+  property->value = pending->value;
+  property->value_length = pending->value_length;
+  pending->value = NULL;
+}
+
+static inline uint32_t shadow_next(const char* args, uint32_t length, uint32_t offset) {
+  while (offset < length && args[offset]) offset++;
+  return offset < length ? offset + 1 : length;
+}
+
+static inline bool shadow_is_command(const char* arg) {
+  return arg[0] == '-' && arg[1] == '-';
+}
+
+// Forgets the argument at `offset`, a regex might match anything
+static void shadow_forget(const char* args, uint32_t length, uint32_t offset) {
+  if (offset >= length) return;
+  if (args[offset] == '/') shadow_reset();
+  else shadow_invalidate(&args[offset]);
+}
+
+// Drops unchanged properties from the NUL terminated arguments in `args`
+// by moving the remaining ones down, and returns their new length.
+uint32_t shadow_filter(char* args, uint32_t length) {
+  if (!g_enabled) return length;
+
+  uint32_t in = 0, out = 0;
+  while (in < length) {
+    uint32_t next = shadow_next(args, length, in);
+    const char* arg = &args[in];
+
+    if (strcmp(arg, "--add") == 0) {
+      // `--add <type> <name>`, a new item starts with the defaults
+      shadow_forget(args, length, shadow_next(args, length, next));
+    } else if (strcmp(arg, "--remove") == 0 || strcmp(arg, "--clone") == 0) {
+      shadow_forget(args, length, next);
+    } else if (strcmp(arg, "--rename") == 0) {
+      shadow_forget(args, length, next);
+      shadow_forget(args, length, shadow_next(args, length, next));
+    } else if (strcmp(arg, "--set") == 0 && next < length && args[next] != '/') {
+      uint32_t properties = shadow_next(args, length, next);
+      struct shadow_item* item = shadow_find(&args[next], true);
+      if (!item) {
+        shadow_reset();
+        memmove(&args[out], arg, next - in);
+        out += next - in;
+        in = next;
+        continue;
+      }
+
+      // `--set <name>` is kept in place and taken back if every property
+      // turns out to be unchanged
+      uint32_t command = out;
+      memmove(&args[out], arg, properties - in);
+      out += properties - in;
+      in = properties;
+
+      uint32_t kept = 0, dropped = 0;
+      while (in < length && !shadow_is_command(&args[in])) {
+        next = shadow_next(args, length, in);
+        char* equals = memchr(&args[in], '=', next - in);
+        bool unchanged = false;
+        if (equals) {
+          const char* value = equals + 1;
+          unchanged = shadow_unchanged(item, &args[in], equals - &args[in],
+                                       value, strlen(value));
+        }
+
+        if (unchanged) dropped++;
+        else {
+          memmove(&args[out], &args[in], next - in);
+          out += next - in;
+          kept++;
+        }
+        in = next;
+      }
+
+      g_stats.suppressed += dropped;
+      g_stats.sent += kept;
+      if (kept == 0 && dropped > 0) {
+        out = command;
+        g_stats.suppressed_commands++;
+      }
+      continue;
+    } else if (strcmp(arg, "--set") == 0) {
+      // a regex set changes items we can't name
+      shadow_reset();
+    }
+
+    memmove(&args[out], arg, next - in);
+    out += next - in;
+    in = next;
+  }
+
+  return out;
+}
+
+uint64_t shadow_mark() {
+  return g_pending_seq;
+}
+
+// Everything filtered before `mark` was taken has been posted, or couldn't
+// be if `posted` is false
+void shadow_sent(uint64_t mark, bool posted) {
+  uint32_t done = 0;
+  while (done < g_pending_count && g_pending[done].seq < mark) {
+    struct shadow_pending* pending = &g_pending[done++];
+    if (posted && pending->item) shadow_record(pending);
+    shadow_pending_drop(pending);
+  }
+
+  g_pending_count -= done;
+  memmove(g_pending, g_pending + done, g_pending_count * sizeof(struct shadow_pending));
+}
+
+void shadow_invalidate(const char* name) {
+  struct shadow_item* item = shadow_find(name, false);
+  if (item) shadow_clear(item);
+}
+
+void shadow_reset() {
+  for (uint32_t i = 0; i < g_pending_count; i++) shadow_pending_drop(&g_pending[i]);
+  g_pending_count = 0;
+  for (uint32_t i = 0; i < g_item_capacity; i++) {
+    if (g_items[i]) shadow_clear(g_items[i]);
+  }
+}
+
+// Disabling forgets everything, the bar may change while nobody watches
+void shadow_set_enabled(bool enabled) {
+  if (!enabled) shadow_reset();
+  g_enabled = enabled;
+}
+
+struct shadow_stats shadow_stats() {
+  struct shadow_stats stats = g_stats;
+  stats.items = g_item_count;
+  stats.properties = g_property_count;
+  stats.pending = g_pending_count;
+  return stats;
+}
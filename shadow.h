@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+//
+// The shadow model remembers the last value sent for every `item.property`
+// so a `--set` that wouldn't change anything never reaches the bar. Most
+// callbacks set the same label, icon and color on every event, and every
+// one of those would otherwise cost a round trip and a redraw.
+//
+// Commands are filtered in the wire format right before they are queued,
+// so every way of issuing them (strings, argv, config tables) is covered.
+// Properties whose value didn't change are dropped, and a `--set` left
+// without properties is dropped entirely.
+//
+// What a command sets is only pending until the message carrying it was
+// posted, a message that never made it leaves the model as it was. A set
+// is never dropped while an earlier one of the same property is pending,
+// that one might still fail.
+//
+// The model only knows what went through the helper. An item changed from
+// somewhere else (a shell plugin, `sketchybar --set` in a terminal) has to
+// be invalidated, or the next set of the old value is suppressed.
+//
+struct shadow_property {
+  char* key;
+  char* value;
+  uint32_t key_length;
+  uint32_t value_length;
+};
+
+struct shadow_item {
+  char* name;
+  uint32_t hash;
+  struct shadow_property* properties;
+  uint32_t property_count;
+  uint32_t property_capacity;
+  uint32_t pending;
+};
+
+struct shadow_pending {
+  // NULL once the item was invalidated after the set was filtered
+  struct shadow_item* item;
+  char* key;
+  char* value;
+  uint32_t key_length;
+  uint32_t value_length;
+  uint64_t seq;
+};
+
+struct shadow_stats {
+  uint64_t suppressed;
+  uint64_t suppressed_commands;
+  uint64_t sent;
+  uint32_t items;
+  uint32_t properties;
+  uint32_t pending;
+};
+
+uint32_t shadow_filter(char* args, uint32_t length);
+uint64_t shadow_mark();
+void shadow_sent(uint64_t mark, bool posted);
+
+void shadow_invalidate(const char* item);
+void shadow_reset();
+void shadow_set_enabled(bool enabled);
+
+struct shadow_stats shadow_stats();
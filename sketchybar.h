@@ -1,300 +1,396 @@
 #pragma once
 
-#include <mach/mach.h>
-#include <mach/message.h>
-#include <bootstrap.h>
-#include <stdlib.h>
 #include <pthread.h>
-#include <stdio.h>
-
-typedef char* env;
-
-#define MACH_HANDLER(name) void name(env env)
-typedef MACH_HANDLER(mach_handler);
-
-struct mach_message {
-  mach_msg_header_t header;
-  mach_msg_size_t msgh_descriptor_count;
-  mach_msg_ool_descriptor_t descriptor;
-};
-
-struct mach_buffer {
-  struct mach_message message;
-  mach_msg_trailer_t trailer;
-};
-
-struct mach_server {
-  bool is_running;
-  mach_port_name_t task;
-  mach_port_t port;
-  mach_port_t bs_port;
-
-  pthread_t thread;
-  mach_handler* handler;
-};
+#include <poll.h>
+#include "transport.h"
+#include "event_queue.h"
+#include "capture.h"
+#include "stats.h"
+#include "env.h"
 
 struct key_value_pair {
   char* key;
   char* value;
 };
 
-static struct mach_server g_mach_server;
-static mach_port_t g_mach_port = 0;
-
+// Every key and value is measured once, see env.h for repeated lookups
 static inline char* env_get_value_for_key(env env, char* key) {
   uint32_t caret = 0;
-  for(;;) {
-    if (!env[caret]) break;
-    if (strcmp(&env[caret], key) == 0)
-      return &env[caret + strlen(&env[caret]) + 1];
-
-    caret += strlen(&env[caret])
-             + strlen(&env[caret + strlen(&env[caret]) + 1])
-             + 2;
+  while (env[caret]) {
+    uint32_t key_length = strlen(&env[caret]);
+    char* value = &env[caret + key_length + 1];
+    if (strcmp(&env[caret], key) == 0) return value;
+    caret += key_length + strlen(value) + 2;
   }
   return (char*)"";
 }
 
 static inline struct key_value_pair env_get_next_key_value_pair(env env, struct key_value_pair prev) {
-  uint32_t caret = 0;
-  if (prev.key != NULL) {
-    caret = (prev.key - env) + strlen(&env[(prev.key - env)])
-                             + strlen(&env[(prev.key - env)
-                                      + strlen(&env[(prev.key - env)])
-                                      + 1                             ])
-                             + 2;
-  }
+  char* key = env;
+  if (prev.key != NULL) key = prev.value + strlen(prev.value) + 1;
 
-  if (!env[caret]) return (struct key_value_pair) { NULL, NULL };
-
-  return (struct key_value_pair) { env + caret,
-                                   env + caret + strlen(&env[caret]) +1 };
+  if (!*key) return (struct key_value_pair) { NULL, NULL };
+  return (struct key_value_pair) { key, key + strlen(key) + 1 };
 }
 
-static inline mach_port_t mach_get_bs_port(char* name) {
-  mach_port_name_t task = mach_task_self();
+//
+// Commands are written to the bar in its wire format: every argument NUL
+// terminated and one more NUL at the end. They are split into arguments as
+// they are appended, at spaces outside of quotes with the quotes stripped,
+// so a transaction is just a buffer the commands are appended to. The
+// buffer grows geometrically and is reused for every message.
+//
+struct command_buffer {
+  char* data;
+  uint32_t length;
+  uint32_t capacity;
+};
 
-  mach_port_t bs_port;
-  if (task_get_special_port(task,
-                            TASK_BOOTSTRAP_PORT,
-                            &bs_port            ) != KERN_SUCCESS) {
-    return 0;
-  }
+static struct command_buffer g_cmd = { 0 };
+static bool g_transaction = false;
+
+//
+// Every command passes through the filter as it is queued. `apply` may
+// drop arguments by moving the rest down and returns their new length.
+// What it learns from them only holds once they reached the bar: `sent`
+// tells it whether everything filtered before `mark` returned was posted.
+// A bar that went away took its state along, `reset` is called as soon as
+// the transport's epoch changed.
+//
+struct command_filter {
+  uint32_t (*apply)(char* args, uint32_t length);
+  uint64_t (*mark)();
+  void (*sent)(uint64_t mark, bool posted);
+  void (*reset)();
+};
+
+static struct command_filter* g_command_filter = NULL;
+static uint32_t g_command_filter_epoch = 0;
 
-  mach_port_t port;
-  if (bootstrap_look_up(bs_port,
-                        name,
-                        &port   ) != KERN_SUCCESS) {
-    return 0;
+static inline void command_buffer_filter(struct command_buffer* buffer, uint32_t start) {
+  if (!g_command_filter) return;
+  if (g_command_filter_epoch != transport_epoch()) {
+    g_command_filter_epoch = transport_epoch();
+    g_command_filter->reset();
   }
+  buffer->length = start + g_command_filter->apply(buffer->data + start,
+                                                   buffer->length - start);
+}
 
-  return port;
+static inline uint64_t command_filter_mark() {
+  return g_command_filter ? g_command_filter->mark() : 0;
 }
 
-static inline void mach_receive_message(mach_port_t port, struct mach_buffer* buffer, bool timeout) {
-  *buffer = (struct mach_buffer) { 0 };
-  mach_msg_return_t msg_return;
-  if (timeout)
-    msg_return = mach_msg(&buffer->message.header,
-                          MACH_RCV_MSG | MACH_RCV_TIMEOUT,
-                          0,
-                          sizeof(struct mach_buffer),
-                          port,
-                          100,
-                          MACH_PORT_NULL             );
-  else 
-    msg_return = mach_msg(&buffer->message.header,
-                          MACH_RCV_MSG,
-                          0,
-                          sizeof(struct mach_buffer),
-                          port,
-                          MACH_MSG_TIMEOUT_NONE,
-                          MACH_PORT_NULL             );
-
-  if (msg_return != MACH_MSG_SUCCESS) {
-    buffer->message.descriptor.address = NULL;
-  }
+static inline void command_filter_sent(uint64_t mark, bool posted) {
+  if (g_command_filter) g_command_filter->sent(mark, posted);
 }
 
-char* g_rsp = NULL;
-static inline char* mach_send_message(mach_port_t port, char* message, uint32_t len) {
-  if (!message || !port) {
-    return NULL;
-  }
+static inline bool command_buffer_reserve(struct command_buffer* buffer, uint32_t bytes) {
+  if (buffer->length + bytes <= buffer->capacity) return true;
 
-  mach_port_t response_port;
-  mach_port_name_t task = mach_task_self();
-  if (mach_port_allocate(task, MACH_PORT_RIGHT_RECEIVE,
-                               &response_port          ) != KERN_SUCCESS) {
-    return NULL;
-  }
+  uint32_t capacity = buffer->capacity ? buffer->capacity : 1024;
+  while (capacity < buffer->length + bytes) capacity *= 2;
 
-  if (mach_port_insert_right(task, response_port,
-                                   response_port,
-                                   MACH_MSG_TYPE_MAKE_SEND)!= KERN_SUCCESS) {
-    return NULL;
-  }
+  char* data = realloc(buffer->data, capacity);
+  if (!data) return false;
+  buffer->data = data;
+  buffer->capacity = capacity;
+  return true;
+}
+
+static inline bool command_buffer_append(struct command_buffer* buffer, const char* message) {
+  uint32_t message_length = strlen(message);
+
+  // an argument is never longer than its source plus the NUL
+  if (!command_buffer_reserve(buffer, message_length + 1)) return false;
+
+  char* out = buffer->data + buffer->length;
+  char quote = '\0';
+  bool in_argument = false;
+  for (uint32_t i = 0; i < message_length; i++) {
+    char c = message[i];
+
+    // the other kind of quote is kept inside quotes, "it's" stays intact
+    if ((c == '"' || c == '\'') && (!quote || quote == c)) {
+      quote = quote ? '\0' : c;
+      in_argument = true;
+      continue;
+    }
+
+    if (c == ' ' && !quote) {
+      if (in_argument) *out++ = '\0';
+      in_argument = false;
+      continue;
+    }
 
-  struct mach_message msg = { 0 };
-  msg.header.msgh_remote_port = port;
-  msg.header.msgh_local_port = response_port;
-  msg.header.msgh_id = response_port;
-  msg.header.msgh_bits = MACH_MSGH_BITS_SET(MACH_MSG_TYPE_COPY_SEND,
-                                            MACH_MSG_TYPE_MAKE_SEND,
-                                            0,
-                                            MACH_MSGH_BITS_COMPLEX       );
-
-  msg.header.msgh_size = sizeof(struct mach_message);
-  msg.msgh_descriptor_count = 1;
-  msg.descriptor.address = message;
-  msg.descriptor.size = len * sizeof(char);
-  msg.descriptor.copy = MACH_MSG_VIRTUAL_COPY;
-  msg.descriptor.deallocate = false;
-  msg.descriptor.type = MACH_MSG_OOL_DESCRIPTOR;
-
-  mach_msg(&msg.header,
-           MACH_SEND_MSG,
-           sizeof(struct mach_message),
-           0,
-           MACH_PORT_NULL,
-           MACH_MSG_TIMEOUT_NONE,
-           MACH_PORT_NULL              );
-
-  struct mach_buffer buffer = { 0 };
-  mach_receive_message(response_port, &buffer, true);
-
-  if (g_rsp) free(g_rsp);
-  g_rsp = NULL;
-  if (buffer.message.descriptor.address) {
-    g_rsp = malloc(strlen(buffer.message.descriptor.address) + 1);
-    memcpy(g_rsp, buffer.message.descriptor.address,
-                strlen(buffer.message.descriptor.address) + 1);
-  } else {
-    g_rsp = malloc(1);
-    *g_rsp = '\0';
+    *out++ = c;
+    in_argument = true;
   }
+  if (in_argument) *out++ = '\0';
 
-  mach_msg_destroy(&buffer.message.header);
+  buffer->length = out - buffer->data;
+  return true;
+}
+
+//
+// A scheduler can hold messages back and send them later, combined. It
+// gets every complete message through `queue`, which returns false for the
+// ones that have to go out right away. `take` returns what it holds as a
+// single message (NULL if nothing) and `due_in` the ms until it wants that
+// to happen, < 0 while it holds nothing.
+//
+struct command_scheduler {
+  bool (*queue)(char* args, uint32_t length);
+  char* (*take)(uint32_t* length);
+  int32_t (*due_in)();
+};
+
+static struct command_scheduler* g_command_scheduler = NULL;
+// The filter's mark once the scheduler took the last message it holds
+static uint64_t g_command_scheduled = 0;
 
-  return g_rsp;
+// Every message leaves through one of these two, so it is timed and
+// counted for `stats` under its first argument
+static inline char* command_send(char* args, uint32_t length) {
+  uint64_t start = stats_now_ns();
+  char* response = transport_get()->send(args, length);
+  stats_command(args, length, response ? strlen(response) : 0, stats_now_ns() - start);
+  return response;
 }
 
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+static inline bool command_post(char* args, uint32_t length) {
+  uint64_t start = stats_now_ns();
+  bool posted = transport_get()->post(args, length);
+  stats_post(args, length, stats_now_ns() - start);
+  return posted;
+}
 
-static inline bool mach_server_register(struct mach_server* mach_server, char* bootstrap_name) {
-  mach_server->task = mach_task_self();
+// Nobody reads the reply to what the scheduler held back, so it is posted
+static inline void command_scheduler_flush() {
+  if (!g_command_scheduler) return;
 
-  if (mach_port_allocate(mach_server->task,
-                         MACH_PORT_RIGHT_RECEIVE,
-                         &mach_server->port      ) != KERN_SUCCESS) {
-    return false;
-  }
+  uint32_t length;
+  char* message = g_command_scheduler->take(&length);
+  if (message) command_filter_sent(g_command_scheduled, command_post(message, length));
+}
 
-  if (mach_port_insert_right(mach_server->task,
-                             mach_server->port,
-                             mach_server->port,
-                             MACH_MSG_TYPE_MAKE_SEND) != KERN_SUCCESS) {
-    return false;
-  }
+static inline bool command_buffer_terminate(struct command_buffer* buffer) {
+  if (!command_buffer_reserve(buffer, 1)) return false;
+  buffer->data[buffer->length] = '\0';
+  return true;
+}
 
-  if (task_get_special_port(mach_server->task,
-                            TASK_BOOTSTRAP_PORT,
-                            &mach_server->bs_port) != KERN_SUCCESS) {
-    return false;
+// Hands the message to the scheduler, true if it holds on to it. Whatever
+// is held back always goes out before a message sent right away.
+static inline bool command_buffer_schedule(struct command_buffer* buffer) {
+  if (!g_command_scheduler) return false;
+
+  if (g_command_scheduler->queue(buffer->data, buffer->length + 1)) {
+    g_command_scheduled = command_filter_mark();
+    if (g_command_scheduler->due_in() == 0) command_scheduler_flush();
+    return true;
   }
+  command_scheduler_flush();
+  return false;
+}
 
-  if (bootstrap_register(mach_server->bs_port,
-                         bootstrap_name,
-                         mach_server->port    ) != KERN_SUCCESS) {
-    return false;
+static inline char* command_buffer_send(struct command_buffer* buffer) {
+  uint64_t mark = command_filter_mark();
+  if (!command_buffer_terminate(buffer)) {
+    command_filter_sent(mark, false);
+    return NULL;
   }
+  if (command_buffer_schedule(buffer)) return NULL;
 
-  return true;
+  char* response = command_send(buffer->data, buffer->length + 1);
+  command_filter_sent(mark, response != NULL);
+  return response;
 }
 
-static inline bool mach_server_begin(struct mach_server* mach_server, mach_handler handler) {
-  mach_server->handler = handler;
-  mach_server->is_running = true;
-  struct mach_buffer buffer;
-  while (mach_server->is_running) {
-    mach_receive_message(mach_server->port, &buffer, false);
-    mach_server->handler((env)buffer.message.descriptor.address);
-    mach_msg_destroy(&buffer.message.header);
+// Like `command_buffer_send` for messages whose reply isn't needed, the bar
+// doesn't send one and nothing waits for it
+static inline bool command_buffer_post(struct command_buffer* buffer) {
+  uint64_t mark = command_filter_mark();
+  if (!command_buffer_terminate(buffer)) {
+    command_filter_sent(mark, false);
+    return false;
   }
+  if (command_buffer_schedule(buffer)) return true;
 
-  return true;
+  bool posted = command_post(buffer->data, buffer->length + 1);
+  command_filter_sent(mark, posted);
+  return posted;
 }
-#pragma clang diagnostic pop
-
-static char* g_cmd = NULL;
 
+// Sends `message` to the bar and returns the response, inside of a
+// transaction the message is queued and NULL is returned. Nothing is sent
+// if the filter drops the whole message.
 static inline char* sketchybar(char* message) {
-  if (g_cmd && message) {
-    g_cmd = realloc(g_cmd, strlen(g_cmd) + strlen(message) + 2);
-    if (strlen(g_cmd) > 0) {
-      memcpy(g_cmd + strlen(g_cmd) + 1, message, strlen(message) + 1);
-      *(g_cmd + strlen(g_cmd)) = ' ';
-    }
-    else
-       memcpy(g_cmd + strlen(g_cmd), message, strlen(message) + 1);
+  if (!message) return NULL;
+  if (!g_transaction) g_cmd.length = 0;
 
-    return NULL;
-  } else if (g_cmd && !message) {
-    message = g_cmd;
-  }
+  uint32_t start = g_cmd.length;
+  if (!command_buffer_append(&g_cmd, message)) return NULL;
+  command_buffer_filter(&g_cmd, start);
 
-  // printf("%s\n", message);
-  uint32_t message_length = strlen(message) + 1;
-  char formatted_message[message_length + 1];
+  if (g_transaction || g_cmd.length == 0) return NULL;
+  return command_buffer_send(&g_cmd);
+}
 
-  char quote = '\0';
-  uint32_t caret = 0;
-  for (int i = 0; i < message_length; ++i) {
-    if (message[i] == '"' || message[i] == '\'') {
-      if (quote == message[i]) quote = '\0';
-      else quote = message[i];
-      continue;
-    }
-    formatted_message[caret] = message[i];
-    if (message[i] == ' ' && !quote) formatted_message[caret] = '\0';
-    caret++;
+// Like `sketchybar` for arguments that are already in the wire format
+static inline char* sketchybar_argv(const char* args, uint32_t length) {
+  if (!g_transaction) g_cmd.length = 0;
+  if (!command_buffer_reserve(&g_cmd, length)) return NULL;
+
+  uint32_t start = g_cmd.length;
+  memcpy(g_cmd.data + start, args, length);
+  g_cmd.length += length;
+  command_buffer_filter(&g_cmd, start);
+
+  if (g_transaction || g_cmd.length == 0) return NULL;
+  return command_buffer_send(&g_cmd);
+}
+
+static inline void transaction_create() {
+  if (!g_transaction) {
+    g_transaction = true;
+    g_cmd.length = 0;
   }
+}
 
-  if (caret > 0 && formatted_message[caret] == '\0'
-      && formatted_message[caret - 1] == '\0') {
-    caret--;
+// A transaction is only ever commands, there's no reply worth waiting for
+static inline bool transaction_commit() {
+  bool posted = true;
+  if (g_transaction) {
+    g_transaction = false;
+    if (g_cmd.length > 0) posted = command_buffer_post(&g_cmd);
+    g_cmd.length = 0;
   }
+  return posted;
+}
+
+static inline bool event_server_init(mach_handler event_handler, char* bootstrap_name) {
+  return transport_get()->server_register(bootstrap_name);
+}
 
-  formatted_message[caret] = '\0';
-  if (!g_mach_port) g_mach_port = mach_get_bs_port("git.felix.sketchybar");
+//
+// Timers run on the thread handling events, in between them. `due_in` is
+// the ms until the next one is due (< 0 if there is none) and `run` calls
+// everything that is due by now.
+//
+struct event_timers {
+  int32_t (*due_in)();
+  void (*run)();
+};
+
+static struct event_timers* g_event_timers = NULL;
+
+//
+// File descriptors the loop polls along with the event queue, the pipes of
+// child processes for one. `fds` fills in what to wait for and returns how
+// many, `ready` gets them back after the wait with `revents` set (all 0 if
+// nothing happened on them) and `due_in` is 0 while there is something to
+// hand out without waiting, < 0 otherwise.
+//
+#define EVENT_SERVER_MAX_FDS 64
+
+struct event_fds {
+  uint32_t (*fds)(struct pollfd* fds, uint32_t max);
+  void (*ready)(struct pollfd* fds, uint32_t count);
+  int32_t (*due_in)();
+};
 
-  return mach_send_message(g_mach_port,
-                           formatted_message,
-                           caret + 1          );
+static struct event_fds* g_event_fds = NULL;
+
+static inline int32_t event_server_min_timeout(int32_t timeout, int32_t due_in) {
+  if (due_in >= 0 && (timeout < 0 || due_in < timeout)) return due_in;
+  return timeout;
 }
 
-static inline void transaction_create() {
-  if (!g_cmd) {
-    g_cmd = malloc(1);
-    *g_cmd = '\0';
-  }
+static inline int32_t event_server_timeout() {
+  int32_t timeout = g_command_scheduler ? g_command_scheduler->due_in() : -1;
+  if (g_event_timers) timeout = event_server_min_timeout(timeout, g_event_timers->due_in());
+  if (g_event_fds) timeout = event_server_min_timeout(timeout, g_event_fds->due_in());
+  return timeout;
 }
 
-static inline char* transaction_commit() {
-  char* response = NULL;
-  if (g_cmd) {
-    response = sketchybar(NULL);
-    free(g_cmd);
-    g_cmd = NULL;
+// Timers go first, what they send can then make it into the same frame
+static inline void event_server_tick() {
+  if (g_event_timers && g_event_timers->due_in() == 0)
+    g_event_timers->run();
+  if (g_command_scheduler && g_command_scheduler->due_in() == 0)
+    command_scheduler_flush();
+}
+
+// Receives and handles events on the calling thread, in case the receiver
+// thread can't be started. The transport can't wait on other descriptors,
+// they are checked at least every `EVENT_SERVER_INLINE_POLL_MS`.
+#define EVENT_SERVER_INLINE_POLL_MS 10
+
+static inline void event_server_run_inline(mach_handler event_handler) {
+  struct transport* transport = transport_get();
+  struct pollfd fds[EVENT_SERVER_MAX_FDS];
+  uint32_t count = 0;
+  env event;
+  for (;;) {
+    int32_t timeout = event_server_timeout();
+    if (count > 0) timeout = event_server_min_timeout(timeout, EVENT_SERVER_INLINE_POLL_MS);
+    if (!transport->receive(&event, timeout)) break;
+
+    if (event) {
+      capture_event(event);
+      event_handler(event);
+      transport->release(event);
+    }
+    if (count > 0) poll(fds, count, 0);
+    if (g_event_fds) g_event_fds->ready(fds, count);
+    event_server_tick();
+    count = g_event_fds ? g_event_fds->fds(fds, EVENT_SERVER_MAX_FDS) : 0;
   }
-  return response;
 }
 
-static inline void event_server_init(mach_handler event_handler, char* bootstrap_name) {
-  mach_server_register(&g_mach_server, bootstrap_name);
+// The receiver thread only copies events into the queue, the message goes
+// back to the transport right away
+static inline void* event_server_receive(void* context) {
+  struct transport* transport = transport_get();
+  env event;
+  while (transport->receive(&event, -1)) {
+    if (!event) continue;
+    capture_event(event);
+    event_queue_push(event);
+    transport->release(event);
+  }
+  event_queue_close();
+  return NULL;
 }
 
+// Handles queued events on the calling thread, waiting for them no longer
+// than the scheduler wants to hold its messages or the next timer is due,
+// and for the other descriptors at the same time
 static inline void event_server_run(mach_handler event_handler) {
-  mach_server_begin(&g_mach_server, event_handler);
+  pthread_t receiver;
+  if (!event_queue_init()
+      || pthread_create(&receiver, NULL, event_server_receive, NULL) != 0) {
+    event_server_run_inline(event_handler);
+    command_scheduler_flush();
+    return;
+  }
+
+  struct pollfd fds[EVENT_SERVER_MAX_FDS];
+  for (;;) {
+    uint32_t count = g_event_fds ? g_event_fds->fds(fds, EVENT_SERVER_MAX_FDS) : 0;
+    bool closed;
+    env event = event_queue_wait(event_server_timeout(), fds, count, &closed);
+    if (closed) break;
+
+    if (event) {
+      event_handler(event);
+      event_queue_done();
+    }
+    if (g_event_fds) g_event_fds->ready(fds, count);
+    event_server_tick();
+  }
+
+  pthread_join(receiver, NULL);
+  command_scheduler_flush();
 }
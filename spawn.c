@@ -0,0 +1,295 @@
+#include "spawn.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define SPAWN_READ_SIZE 4096
+#define SPAWN_REAP_ATTEMPTS 10
+
+extern char** environ;
+
+static struct spawn_process g_running[SPAWN_MAX_LIMIT];
+static uint32_t g_running_count = 0;
+static uint32_t g_limit = SPAWN_DEFAULT_LIMIT;
+
+// waiting for a free slot, oldest first
+static struct spawn_process* g_pending = NULL;
+static uint32_t g_pending_count = 0;
+static uint32_t g_pending_capacity = 0;
+
+static struct spawn_result* g_finished = NULL;
+static uint32_t g_finished_count = 0;
+static uint32_t g_finished_capacity = 0;
+
+// closed their stdout without exiting, reaped later so they don't linger
+static pid_t* g_orphans = NULL;
+static uint32_t g_orphan_count = 0;
+static uint32_t g_orphan_capacity = 0;
+
+static struct spawn_stats g_stats = { 0 };
+
+static bool spawn_grow(void** data, uint32_t* capacity, uint32_t count, uint32_t size) {
+  if (count <= *capacity) return true;
+
+  uint32_t new_capacity = *capacity ? *capacity * 2 : 16;
+  while (new_capacity < count) new_capacity *= 2;
+
+  void* new_data = realloc(*data, (size_t)new_capacity * size);
+  if (!new_data) return false;
+  *data = new_data;
+  *capacity = new_capacity;
+  return true;
+}
+
+static bool spawn_append(struct spawn_process* process, const char* data, uint32_t length) {
+  // one byte more for the NUL the output is terminated with
+  if (!spawn_grow((void**)&process->buffer, &process->capacity,
+                  process->length + length + 1, 1)) {
+    return false;
+  }
+  memcpy(process->buffer + process->length, data, length);
+  process->length += length;
+  process->buffer[process->length] = '\0';
+  return true;
+}
+
+// Starts the process with its stdout going to a pipe, the rest inherited
+static bool spawn_exec(const char* args, pid_t* pid, int* fd) {
+  uint32_t argc = 0;
+  for (const char* arg = args; *arg; arg += strlen(arg) + 1) argc++;
+  if (argc == 0) return false;
+
+  char* argv[argc + 1];
+  argc = 0;
+  for (const char* arg = args; *arg; arg += strlen(arg) + 1) argv[argc++] = (char*)arg;
+  argv[argc] = NULL;
+
+  int pipes[2];
+  if (pipe(pipes) != 0) return false;
+  fcntl(pipes[0], F_SETFD, FD_CLOEXEC);
+  fcntl(pipes[1], F_SETFD, FD_CLOEXEC);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, pipes[1], STDOUT_FILENO);
+  int error = posix_spawnp(pid, argv[0], &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(pipes[1]);
+
+  if (error != 0) {
+    close(pipes[0]);
+    return false;
+  }
+
+  fcntl(pipes[0], F_SETFL, fcntl(pipes[0], F_GETFL) | O_NONBLOCK);
+  *fd = pipes[0];
+  return true;
+}
+
+// Most processes exit right after closing their stdout, but not
+// necessarily before the loop sees it closed
+static int spawn_reap(pid_t pid) {
+  for (int attempt = 0; attempt < SPAWN_REAP_ATTEMPTS; attempt++) {
+    int status;
+    pid_t result = waitpid(pid, &status, WNOHANG);
+    if (result == pid) return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    if (result == -1 && errno != EINTR) return -1;
+
+    struct timespec wait = { 0, 1000000 };
+    nanosleep(&wait, NULL);
+  }
+
+  if (spawn_grow((void**)&g_orphans, &g_orphan_capacity, g_orphan_count + 1, sizeof(pid_t)))
+    g_orphans[g_orphan_count++] = pid;
+  return -1;
+}
+
+static void spawn_reap_orphans() {
+  for (uint32_t i = 0; i < g_orphan_count;) {
+    int status;
+    pid_t result = waitpid(g_orphans[i], &status, WNOHANG);
+    if (result == 0 || (result == -1 && errno == EINTR)) {
+      i++;
+      continue;
+    }
+    g_orphans[i] = g_orphans[--g_orphan_count];
+  }
+}
+
+static void spawn_finish(int data, char* output, uint32_t length, int status) {
+  if (!spawn_grow((void**)&g_finished, &g_finished_capacity,
+                  g_finished_count + 1, sizeof(struct spawn_result))) {
+    // nobody gets resumed in that case, but there is nothing else to do
+    free(output);
+    return;
+  }
+  g_finished[g_finished_count++] = (struct spawn_result) { data, output, length, status };
+}
+
+// Starts `process` from its arguments, a failure finishes it right away
+static void spawn_launch(struct spawn_process* process) {
+  char* args = process->buffer;
+  process->buffer = NULL;
+  process->length = 0;
+  process->capacity = 0;
+
+  if (!spawn_exec(args, &process->pid, &process->fd)) {
+    g_stats.failed++;
+    free(args);
+    spawn_finish(process->data, NULL, 0, -1);
+    return;
+  }
+
+  free(args);
+  g_stats.started++;
+  g_running[g_running_count++] = *process;
+}
+
+static void spawn_launch_pending() {
+  uint32_t launched = 0;
+  while (launched < g_pending_count && g_running_count < g_limit) {
+    spawn_launch(&g_pending[launched++]);
+  }
+  if (launched == 0) return;
+
+  g_pending_count -= launched;
+  memmove(g_pending, g_pending + launched, g_pending_count * sizeof(struct spawn_process));
+}
+
+// Queues a process, it is started once fewer than `spawn_limit` run.
+// Returns false only if there's no memory to queue it.
+bool spawn_start(const char* args, uint32_t length, int data) {
+  if (!spawn_grow((void**)&g_pending, &g_pending_capacity,
+                  g_pending_count + 1, sizeof(struct spawn_process))) {
+    return false;
+  }
+
+  struct spawn_process process = { 0, -1, data, NULL, 0, 0 };
+  if (!spawn_append(&process, args, length)) return false;
+  g_pending[g_pending_count++] = process;
+
+  spawn_launch_pending();
+  return true;
+}
+
+// Runs a process to completion on the calling thread, ignoring the limit
+bool spawn_run(const char* args, struct spawn_result* result) {
+  *result = (struct spawn_result) { 0, NULL, 0, -1 };
+
+  pid_t pid;
+  int fd;
+  if (!spawn_exec(args, &pid, &fd)) {
+    g_stats.failed++;
+    return false;
+  }
+  g_stats.started++;
+
+  struct spawn_process process = { pid, fd, 0, NULL, 0, 0 };
+  char chunk[SPAWN_READ_SIZE];
+  for (;;) {
+    ssize_t bytes = read(fd, chunk, sizeof(chunk));
+    if (bytes > 0) {
+      spawn_append(&process, chunk, bytes);
+    } else if (bytes == 0) {
+      break;
+    } else if (errno == EAGAIN) {
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      poll(&pfd, 1, -1);
+    } else if (errno != EINTR) {
+      break;
+    }
+  }
+  close(fd);
+
+  int status;
+  pid_t reaped;
+  while ((reaped = waitpid(pid, &status, 0)) == -1 && errno == EINTR);
+  result->output = process.buffer;
+  result->length = process.length;
+  result->status = reaped == pid && WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+  return true;
+}
+
+void spawn_limit(uint32_t limit) {
+  if (limit < 1) limit = 1;
+  if (limit > SPAWN_MAX_LIMIT) limit = SPAWN_MAX_LIMIT;
+  g_limit = limit;
+  spawn_launch_pending();
+}
+
+uint32_t spawn_fds(struct pollfd* fds, uint32_t max) {
+  if (g_orphan_count > 0) spawn_reap_orphans();
+
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < g_running_count && count < max; i++) {
+    fds[count++] = (struct pollfd) { g_running[i].fd, POLLIN, 0 };
+  }
+  return count;
+}
+
+// Reads from the pipes poll found ready, finishing the processes whose
+// stdout was closed
+void spawn_ready(struct pollfd* fds, uint32_t count) {
+  char chunk[SPAWN_READ_SIZE];
+  for (uint32_t i = 0; i < count; i++) {
+    if (!fds[i].revents) continue;
+
+    uint32_t index = 0;
+    while (index < g_running_count && g_running[index].fd != fds[i].fd) index++;
+    if (index == g_running_count) continue;
+    struct spawn_process* process = &g_running[index];
+
+    bool closed = false;
+    for (;;) {
+      ssize_t bytes = read(process->fd, chunk, sizeof(chunk));
+      if (bytes > 0) {
+        if (!spawn_append(process, chunk, bytes)) closed = true;
+        else continue;
+      } else if (bytes == 0 || (errno != EAGAIN && errno != EINTR)) {
+        closed = true;
+      } else if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (!closed) continue;
+
+    close(process->fd);
+    spawn_finish(process->data, process->buffer, process->length, spawn_reap(process->pid));
+    g_running[index] = g_running[--g_running_count];
+  }
+
+  spawn_launch_pending();
+}
+
+// 0 while finished processes wait to be popped, < 0 otherwise
+int32_t spawn_due_in() {
+  return g_finished_count > 0 ? 0 : -1;
+}
+
+// Takes the oldest finished process, its output is the caller's to free
+// with `spawn_result_free`
+bool spawn_pop(struct spawn_result* result) {
+  if (g_finished_count == 0) return false;
+
+  *result = g_finished[0];
+  g_finished_count--;
+  memmove(g_finished, g_finished + 1, g_finished_count * sizeof(struct spawn_result));
+  return true;
+}
+
+void spawn_result_free(struct spawn_result* result) {
+  if (result->output) free(result->output);
+  result->output = NULL;
+  result->length = 0;
+}
+
+struct spawn_stats spawn_stats() {
+  struct spawn_stats stats = g_stats;
+  stats.running = g_running_count;
+  stats.pending = g_pending_count;
+  return stats;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/types.h>
+
+#define SPAWN_DEFAULT_LIMIT 8
+#define SPAWN_MAX_LIMIT 64
+
+//
+// Child processes are started with `posix_spawnp`, no shell in between,
+// and their stdout is read from a pipe in the event loop: `spawn_fds` adds
+// the pipes of running processes to the loop's poll and `spawn_ready`
+// reads whatever poll found. A process is finished once its stdout is
+// closed, it is then taken off with `spawn_pop` along with its output and
+// exit status.
+//
+// At most `spawn_limit` processes run at the same time, the ones started
+// beyond that wait in order until one finishes.
+//
+// Arguments are in the bar's wire format, NUL terminated and followed by
+// another NUL. `data` is the caller's and comes back with the result.
+//
+struct spawn_process {
+  pid_t pid;
+  int fd;
+  int data;
+
+  // the arguments until started, the output after
+  char* buffer;
+  uint32_t length;
+  uint32_t capacity;
+};
+
+struct spawn_result {
+  int data;
+  char* output;
+  uint32_t length;
+  // the exit code, -1 if the process couldn't be started or didn't exit
+  int status;
+};
+
+struct spawn_stats {
+  uint32_t running;
+  uint32_t pending;
+  uint64_t started;
+  uint64_t failed;
+};
+
+bool spawn_start(const char* args, uint32_t length, int data);
+bool spawn_run(const char* args, struct spawn_result* result);
+void spawn_limit(uint32_t limit);
+
+uint32_t spawn_fds(struct pollfd* fds, uint32_t max);
+void spawn_ready(struct pollfd* fds, uint32_t count);
+int32_t spawn_due_in();
+bool spawn_pop(struct spawn_result* result);
+void spawn_result_free(struct spawn_result* result);
+
+struct spawn_stats spawn_stats();
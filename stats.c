@@ -0,0 +1,459 @@
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define STATS_INITIAL_CAPACITY 32
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+
+//
+// Histograms are keyed by one or two strings, stored as "first\0second\0"
+// in one allocation. Entries are only dropped all at once by
+// `stats_reset`, so probing doesn't need tombstones.
+//
+struct stats_entry {
+  char* key;
+  uint32_t first_length;
+  uint32_t second_length;
+  uint32_t hash;
+  struct stats_histogram* histogram;
+};
+
+struct stats_table {
+  struct stats_entry* entries;
+  uint32_t capacity;
+  uint32_t count;
+};
+
+static struct stats_table g_dispatch = { 0 };
+static struct stats_table g_commands = { 0 };
+static struct stats_table g_posts = { 0 };
+static struct stats_table g_yabai = { 0 };
+static struct stats_counters g_counters = { 0 };
+
+static int g_signal_pipe[2] = { -1, -1 };
+
+static uint32_t stats_hash(const char* first, uint32_t first_length, const char* second, uint32_t second_length) {
+  uint32_t hash = 2166136261u;
+  for (uint32_t i = 0; i < first_length; i++) hash = (hash ^ (unsigned char)first[i]) * 16777619u;
+  hash = (hash ^ 0xff) * 16777619u;
+  for (uint32_t i = 0; i < second_length; i++) hash = (hash ^ (unsigned char)second[i]) * 16777619u;
+  return hash;
+}
+
+static struct stats_entry* stats_slot(struct stats_entry* entries, uint32_t capacity, const char* first, uint32_t first_length, const char* second, uint32_t second_length, uint32_t hash) {
+  uint32_t i = hash & (capacity - 1);
+  for (;;) {
+    struct stats_entry* entry = &entries[i];
+    if (!entry->key) return entry;
+    if (entry->hash == hash
+        && entry->first_length == first_length
+        && entry->second_length == second_length
+        && memcmp(entry->key, first, first_length) == 0
+        && memcmp(entry->key + first_length + 1, second, second_length) == 0) {
+      return entry;
+    }
+    i = (i + 1) & (capacity - 1);
+  }
+}
+
+static bool stats_grow(struct stats_table* table) {
+  uint32_t capacity = table->capacity ? table->capacity * 2 : STATS_INITIAL_CAPACITY;
+  struct stats_entry* entries = calloc(capacity, sizeof(struct stats_entry));
+  if (!entries) return false;
+
+  for (uint32_t i = 0; i < table->capacity; i++) {
+    struct stats_entry* entry = &table->entries[i];
+    if (!entry->key) continue;
+    *stats_slot(entries, capacity, entry->key, entry->first_length,
+                entry->key + entry->first_length + 1, entry->second_length,
+                entry->hash) = *entry;
+  }
+
+  free(table->entries);
+  table->entries = entries;
+  table->capacity = capacity;
+  return true;
+}
+
+static struct stats_histogram* stats_find(struct stats_table* table, const char* first, uint32_t first_length, const char* second, uint32_t second_length) {
+  uint32_t hash = stats_hash(first, first_length, second, second_length);
+  if (table->capacity > 0) {
+    struct stats_entry* entry = stats_slot(table->entries, table->capacity, first,
+                                           first_length, second, second_length, hash);
+    if (entry->key) return entry->histogram;
+  }
+
+  if ((table->count + 1) * 4 > table->capacity * 3 && !stats_grow(table)) return NULL;
+
+  char* key = malloc(first_length + second_length + 2);
+  struct stats_histogram* histogram = calloc(1, sizeof(struct stats_histogram));
+  if (!key || !histogram) {
+    free(key);
+    free(histogram);
+    return NULL;
+  }
+  memcpy(key, first, first_length);
+  key[first_length] = '\0';
+  memcpy(key + first_length + 1, second, second_length);
+  key[first_length + second_length + 1] = '\0';
+
+  *stats_slot(table->entries, table->capacity, first, first_length, second,
+              second_length, hash) = (struct stats_entry) {
+    key, first_length, second_length, hash, histogram
+  };
+  table->count++;
+  return histogram;
+}
+
+static void stats_table_clear(struct stats_table* table) {
+  for (uint32_t i = 0; i < table->capacity; i++) {
+    free(table->entries[i].key);
+    free(table->entries[i].histogram);
+  }
+  free(table->entries);
+  *table = (struct stats_table) { 0 };
+}
+
+static uint32_t stats_bucket(uint64_t ns) {
+  if (ns < STATS_SUB_BUCKETS) return ns;
+
+  uint32_t exponent = 63 - __builtin_clzll(ns);
+  uint32_t bucket = ((exponent - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+                    + ((ns >> (exponent - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1));
+  return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+// The largest value that lands in `bucket`
+static uint64_t stats_bucket_limit(uint32_t bucket) {
+  if (bucket < STATS_SUB_BUCKETS) return bucket;
+
+  uint32_t exponent = (bucket >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+  uint64_t lower = (uint64_t)(STATS_SUB_BUCKETS + (bucket & (STATS_SUB_BUCKETS - 1)))
+                   << (exponent - STATS_SUB_BITS);
+  return lower + (1ull << (exponent - STATS_SUB_BITS)) - 1;
+}
+
+static void stats_histogram_add(struct stats_histogram* histogram, uint64_t ns) {
+  if (!histogram) return;
+  histogram->count++;
+  histogram->total_ns += ns;
+  if (ns > histogram->max_ns) histogram->max_ns = ns;
+  histogram->buckets[stats_bucket(ns)]++;
+}
+
+void stats_dispatch(const char* item, const char* event, uint32_t bytes, uint64_t ns) {
+  g_counters.events++;
+  g_counters.event_bytes += bytes;
+  stats_histogram_add(stats_find(&g_dispatch, item, strlen(item), event, strlen(event)), ns);
+}
+
+// `args` is in the wire format, its first argument names the message
+void stats_command(const char* args, uint32_t sent, uint32_t received, uint64_t ns) {
+  g_counters.messages++;
+  g_counters.bytes_sent += sent;
+  g_counters.replies++;
+  g_counters.bytes_received += received;
+  stats_histogram_add(stats_find(&g_commands, args, strlen(args), "", 0), ns);
+}
+
+void stats_post(const char* args, uint32_t sent, uint64_t ns) {
+  g_counters.messages++;
+  g_counters.bytes_sent += sent;
+  stats_histogram_add(stats_find(&g_posts, args, strlen(args), "", 0), ns);
+}
+
+// Keyed by the command up to its second word, `query --windows --space 2`
+// goes with every other `query --windows`
+void stats_yabai(const char* command, uint32_t sent, uint32_t received, uint64_t ns) {
+  g_counters.yabai_requests++;
+  g_counters.yabai_bytes_sent += sent;
+  g_counters.yabai_bytes_received += received;
+
+  const char* space = strchr(command, ' ');
+  if (space) space = strchr(space + 1, ' ');
+  uint32_t length = space ? space - command : strlen(command);
+  stats_histogram_add(stats_find(&g_yabai, command, length, "", 0), ns);
+}
+
+// The upper limit of the bucket the value at `percentile` falls in, never
+// more than the largest value seen
+uint64_t stats_percentile(struct stats_histogram* histogram, double percentile) {
+  if (histogram->count == 0) return 0;
+
+  uint64_t target = (uint64_t)(histogram->count * percentile);
+  if (target < 1) target = 1;
+
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < STATS_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen < target) continue;
+    uint64_t limit = stats_bucket_limit(i);
+    return limit < histogram->max_ns ? limit : histogram->max_ns;
+  }
+  return histogram->max_ns;
+}
+
+struct stats_counters stats_counters() {
+  return g_counters;
+}
+
+void stats_reset() {
+  stats_table_clear(&g_dispatch);
+  stats_table_clear(&g_commands);
+  stats_table_clear(&g_posts);
+  stats_table_clear(&g_yabai);
+  g_counters = (struct stats_counters) { 0 };
+}
+
+//
+// lua
+//
+
+static void stats_push_histogram(lua_State* L, struct stats_histogram* histogram) {
+  lua_createtable(L, 0, 6);
+  lua_pushnumber(L, histogram->count);
+  lua_setfield(L, -2, "count");
+  lua_pushnumber(L, histogram->total_ns / 1e3 / histogram->count);
+  lua_setfield(L, -2, "mean_us");
+  lua_pushnumber(L, stats_percentile(histogram, 0.5) / 1e3);
+  lua_setfield(L, -2, "p50_us");
+  lua_pushnumber(L, stats_percentile(histogram, 0.9) / 1e3);
+  lua_setfield(L, -2, "p90_us");
+  lua_pushnumber(L, stats_percentile(histogram, 0.99) / 1e3);
+  lua_setfield(L, -2, "p99_us");
+  lua_pushnumber(L, histogram->max_ns / 1e3);
+  lua_setfield(L, -2, "max_us");
+}
+
+static void stats_push_table(lua_State* L, struct stats_table* table, const char* name) {
+  lua_createtable(L, 0, table->count);
+  for (uint32_t i = 0; i < table->capacity; i++) {
+    struct stats_entry* entry = &table->entries[i];
+    if (!entry->key) continue;
+    stats_push_histogram(L, entry->histogram);
+    lua_setfield(L, -2, entry->key);
+  }
+  lua_setfield(L, -2, name);
+}
+
+// dispatch[item][event]
+static void stats_push_dispatch(lua_State* L) {
+  lua_createtable(L, 0, g_dispatch.count);
+  for (uint32_t i = 0; i < g_dispatch.capacity; i++) {
+    struct stats_entry* entry = &g_dispatch.entries[i];
+    if (!entry->key) continue;
+
+    lua_getfield(L, -1, entry->key);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      lua_newtable(L);
+      lua_pushvalue(L, -1);
+      lua_setfield(L, -3, entry->key);
+    }
+    stats_push_histogram(L, entry->histogram);
+    lua_setfield(L, -2, entry->key + entry->first_length + 1);
+    lua_pop(L, 1);
+  }
+  lua_setfield(L, -2, "dispatch");
+}
+
+static void stats_push_counter(lua_State* L, const char* name, uint64_t value) {
+  lua_pushnumber(L, value);
+  lua_setfield(L, -2, name);
+}
+
+void stats_push(lua_State* L) {
+  lua_createtable(L, 0, 5);
+  stats_push_dispatch(L);
+  stats_push_table(L, &g_commands, "commands");
+  stats_push_table(L, &g_posts, "posts");
+  stats_push_table(L, &g_yabai, "yabai");
+
+  lua_createtable(L, 0, 9);
+  stats_push_counter(L, "events", g_counters.events);
+  stats_push_counter(L, "event_bytes", g_counters.event_bytes);
+  stats_push_counter(L, "messages", g_counters.messages);
+  stats_push_counter(L, "bytes_sent", g_counters.bytes_sent);
+  stats_push_counter(L, "replies", g_counters.replies);
+  stats_push_counter(L, "bytes_received", g_counters.bytes_received);
+  stats_push_counter(L, "yabai_requests", g_counters.yabai_requests);
+  stats_push_counter(L, "yabai_bytes_sent", g_counters.yabai_bytes_sent);
+  stats_push_counter(L, "yabai_bytes_received", g_counters.yabai_bytes_received);
+  lua_setfield(L, -2, "counters");
+}
+
+//
+// JSON, the same layout as `stats_push`
+//
+
+static void stats_write_string(FILE* file, const char* string) {
+  fputc('"', file);
+  for (const unsigned char* c = (const unsigned char*)string; *c; c++) {
+    if (*c == '"' || *c == '\\') fprintf(file, "\\%c", *c);
+    else if (*c < 0x20) fprintf(file, "\\u%04x", *c);
+    else fputc(*c, file);
+  }
+  fputc('"', file);
+}
+
+static void stats_write_histogram(FILE* file, struct stats_histogram* histogram) {
+  fprintf(file, "{\"count\":%llu,\"mean_us\":%.3f,\"p50_us\":%.3f,\"p90_us\":%.3f,"
+                "\"p99_us\":%.3f,\"max_us\":%.3f}",
+          (unsigned long long)histogram->count,
+          histogram->total_ns / 1e3 / histogram->count,
+          stats_percentile(histogram, 0.5) / 1e3,
+          stats_percentile(histogram, 0.9) / 1e3,
+          stats_percentile(histogram, 0.99) / 1e3,
+          histogram->max_ns / 1e3);
+}
+
+static void stats_write_table(FILE* file, struct stats_table* table) {
+  fputc('{', file);
+  bool first = true;
+  for (uint32_t i = 0; i < table->capacity; i++) {
+    struct stats_entry* entry = &table->entries[i];
+    if (!entry->key) continue;
+    if (!first) fputc(',', file);
+    first = false;
+    stats_write_string(file, entry->key);
+    fputc(':', file);
+    stats_write_histogram(file, entry->histogram);
+  }
+  fputc('}', file);
+}
+
+// Items aren't grouped together in the table, every item is written with
+// all of its events the first time it comes up
+static void stats_write_dispatch(FILE* file) {
+  fputc('{', file);
+  bool first_item = true;
+  for (uint32_t i = 0; i < g_dispatch.capacity; i++) {
+    struct stats_entry* entry = &g_dispatch.entries[i];
+    if (!entry->key) continue;
+
+    bool written = false;
+    for (uint32_t j = 0; j < i && !written; j++) {
+      struct stats_entry* other = &g_dispatch.entries[j];
+      written = other->key && other->first_length == entry->first_length
+                && memcmp(other->key, entry->key, entry->first_length) == 0;
+    }
+    if (written) continue;
+
+    if (!first_item) fputc(',', file);
+    first_item = false;
+    stats_write_string(file, entry->key);
+    fputs(":{", file);
+
+    bool first_event = true;
+    for (uint32_t j = i; j < g_dispatch.capacity; j++) {
+      struct stats_entry* other = &g_dispatch.entries[j];
+      if (!other->key || other->first_length != entry->first_length
+          || memcmp(other->key, entry->key, entry->first_length) != 0) {
+        continue;
+      }
+      if (!first_event) fputc(',', file);
+      first_event = false;
+      stats_write_string(file, other->key + other->first_length + 1);
+      fputc(':', file);
+      stats_write_histogram(file, other->histogram);
+    }
+    fputc('}', file);
+  }
+  fputc('}', file);
+}
+
+// Written next to `path` first and moved over it, a reader never sees
+// half of it
+bool stats_dump(const char* path) {
+  uint32_t length = strlen(path);
+  char temporary[length + 5];
+  memcpy(temporary, path, length);
+  memcpy(temporary + length, ".tmp", 5);
+
+  FILE* file = fopen(temporary, "w");
+  if (!file) return false;
+
+  fputs("{\"dispatch\":", file);
+  stats_write_dispatch(file);
+  fputs(",\"commands\":", file);
+  stats_write_table(file, &g_commands);
+  fputs(",\"posts\":", file);
+  stats_write_table(file, &g_posts);
+  fputs(",\"yabai\":", file);
+  stats_write_table(file, &g_yabai);
+  fprintf(file, ",\"counters\":{\"events\":%llu,\"event_bytes\":%llu,\"messages\":%llu,"
+                "\"bytes_sent\":%llu,\"replies\":%llu,\"bytes_received\":%llu,"
+                "\"yabai_requests\":%llu,\"yabai_bytes_sent\":%llu,"
+                "\"yabai_bytes_received\":%llu}}\n",
+          (unsigned long long)g_counters.events,
+          (unsigned long long)g_counters.event_bytes,
+          (unsigned long long)g_counters.messages,
+          (unsigned long long)g_counters.bytes_sent,
+          (unsigned long long)g_counters.replies,
+          (unsigned long long)g_counters.bytes_received,
+          (unsigned long long)g_counters.yabai_requests,
+          (unsigned long long)g_counters.yabai_bytes_sent,
+          (unsigned long long)g_counters.yabai_bytes_received);
+
+  bool written = !ferror(file);
+  if (fclose(file) != 0) written = false;
+  if (!written || rename(temporary, path) != 0) {
+    unlink(temporary);
+    return false;
+  }
+  return true;
+}
+
+//
+// The signal only writes a byte to a pipe the event loop polls, the dump
+// happens on the thread running lua in between events
+//
+
+static void stats_signal(int signal) {
+  int saved = errno;
+  char byte = 0;
+  if (write(g_signal_pipe[1], &byte, 1) == -1) { }
+  errno = saved;
+}
+
+bool stats_dump_on(int signal) {
+  if (g_signal_pipe[0] == -1) {
+    if (pipe(g_signal_pipe) != 0) return false;
+    for (int i = 0; i < 2; i++) {
+      fcntl(g_signal_pipe[i], F_SETFD, FD_CLOEXEC);
+      fcntl(g_signal_pipe[i], F_SETFL, fcntl(g_signal_pipe[i], F_GETFL) | O_NONBLOCK);
+    }
+  }
+
+  struct sigaction action = { 0 };
+  action.sa_handler = stats_signal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  return sigaction(signal, &action, NULL) == 0;
+}
+
+uint32_t stats_fds(struct pollfd* fds, uint32_t max) {
+  if (g_signal_pipe[0] == -1 || max == 0) return 0;
+  fds[0] = (struct pollfd) { g_signal_pipe[0], POLLIN, 0 };
+  return 1;
+}
+
+void stats_ready(struct pollfd* fds, uint32_t count) {
+  bool signalled = false;
+  for (uint32_t i = 0; i < count; i++) {
+    if (fds[i].fd == g_signal_pipe[0] && fds[i].revents) signalled = true;
+  }
+  if (!signalled) return;
+
+  char bytes[64];
+  while (read(g_signal_pipe[0], bytes, sizeof(bytes)) > 0);
+
+  char* path = getenv(STATS_DUMP_ENV);
+  if (!path || !*path) path = STATS_DUMP_PATH;
+  if (!stats_dump(path)) {
+    fprintf(stderr, "Could not write stats to %s\n", path);
+    fflush(stderr);
+  }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+
+#define STATS_DUMP_ENV "SKETCHYBAR_STATS_FILE"
+#define STATS_DUMP_PATH "/tmp/git.lua.sketchybar.stats.json"
+
+// 4 buckets per power of two, the last one takes everything past ~30 min
+#define STATS_SUB_BITS 2
+#define STATS_BUCKETS (40 << STATS_SUB_BITS)
+
+//
+// Latency is always recorded, it's two reads of the clock and a hash
+// lookup per event or message. Every histogram splits each power of two
+// into four buckets, so percentiles are within 25% of the real value
+// (never below it) at any scale, from a callback that takes 2 µs to a
+// query that times out after a second.
+//
+// - dispatch: per (item, event), the time the event's callbacks ran
+// - commands: per first argument (`--query`, `--set`, ...), messages to
+//   the bar waited for until their reply came, async queries included
+// - posts: the same for messages nothing waits for, the time to hand them
+//   to the transport
+// - yabai: per command up to its second word (`query --windows`), from
+//   connecting until the response is in, timeouts included
+//
+// Bytes are counted on every path between the helper and the bar or yabai.
+// All of it is recorded on the thread running lua.
+//
+// `sb.stats()` returns all of it as a table and sending the helper SIGUSR1
+// writes it as JSON to `$SKETCHYBAR_STATS_FILE` or STATS_DUMP_PATH.
+//
+struct stats_histogram {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint32_t buckets[STATS_BUCKETS];
+};
+
+struct stats_counters {
+  uint64_t events;
+  uint64_t event_bytes;
+  uint64_t messages;
+  uint64_t bytes_sent;
+  uint64_t replies;
+  uint64_t bytes_received;
+  uint64_t yabai_requests;
+  uint64_t yabai_bytes_sent;
+  uint64_t yabai_bytes_received;
+};
+
+static inline uint64_t stats_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stats_dispatch(const char* item, const char* event, uint32_t bytes, uint64_t ns);
+void stats_command(const char* args, uint32_t sent, uint32_t received, uint64_t ns);
+void stats_post(const char* args, uint32_t sent, uint64_t ns);
+void stats_yabai(const char* command, uint32_t sent, uint32_t received, uint64_t ns);
+
+uint64_t stats_percentile(struct stats_histogram* histogram, double percentile);
+struct stats_counters stats_counters();
+void stats_push(lua_State* L);
+bool stats_dump(const char* path);
+void stats_reset();
+
+bool stats_dump_on(int signal);
+uint32_t stats_fds(struct pollfd* fds, uint32_t max);
+void stats_ready(struct pollfd* fds, uint32_t count);
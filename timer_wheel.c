@@ -0,0 +1,269 @@
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_RANGE (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+#define TIMER_WHEEL_MAX_TIMERS 0xffff
+
+// Timers live in a pool and are linked by index, an id is the pool index
+// plus one in the low 16 bits and a generation in the high ones, so a
+// stale id never cancels the timer that reused its entry.
+static struct timer* g_timers = NULL;
+static uint32_t g_timer_count = 0;
+static uint32_t g_timer_capacity = 0;
+static int32_t g_free = -1;
+
+static int32_t g_slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+static uint64_t g_occupied[TIMER_WHEEL_LEVELS];
+static int32_t g_due = -1;
+static int32_t g_due_tail = -1;
+
+// the tick the wheel was last turned to
+static uint64_t g_current = 0;
+static bool g_initialized = false;
+static struct timer_wheel_stats g_stats = { 0 };
+
+static uint64_t timer_wheel_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void timer_wheel_init() {
+  if (g_initialized) return;
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      g_slots[level][slot] = -1;
+    }
+  }
+  g_current = timer_wheel_now_ms();
+  g_initialized = true;
+}
+
+static bool timer_wheel_empty() {
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    if (g_occupied[level]) return false;
+  }
+  return true;
+}
+
+static void timer_unlink(int32_t index) {
+  struct timer* timer = &g_timers[index];
+  if (timer->prev >= 0) g_timers[timer->prev].next = timer->next;
+  else *timer->list = timer->next;
+
+  if (timer->next >= 0) g_timers[timer->next].prev = timer->prev;
+  else if (timer->list == &g_due) g_due_tail = timer->prev;
+
+  if (timer->list != &g_due && *timer->list < 0) {
+    uint32_t slot = timer->list - &g_slots[0][0];
+    g_occupied[slot / TIMER_WHEEL_SLOTS] &= ~(1ull << (slot % TIMER_WHEEL_SLOTS));
+  }
+  timer->list = NULL;
+}
+
+static void timer_append_due(int32_t index) {
+  struct timer* timer = &g_timers[index];
+  timer->list = &g_due;
+  timer->prev = g_due_tail;
+  timer->next = -1;
+  if (g_due_tail >= 0) g_timers[g_due_tail].next = index;
+  else g_due = index;
+  g_due_tail = index;
+}
+
+// Puts the timer into the lowest level its deadline fits into
+static void timer_place(int32_t index) {
+  struct timer* timer = &g_timers[index];
+  uint64_t expires = timer->expires;
+  if (expires < g_current) expires = g_current;
+  if (expires - g_current >= TIMER_WHEEL_RANGE) expires = g_current + TIMER_WHEEL_RANGE - 1;
+
+  uint64_t delta = expires - g_current;
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1
+         && delta >= 1ull << (TIMER_WHEEL_BITS * (level + 1))) {
+    level++;
+  }
+
+  uint32_t slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+  int32_t* list = &g_slots[level][slot];
+  timer->list = list;
+  timer->prev = -1;
+  timer->next = *list;
+  if (*list >= 0) g_timers[*list].prev = index;
+  *list = index;
+  g_occupied[level] |= 1ull << slot;
+}
+
+// The next tick at which a slot holding timers comes up, either because
+// its timers are due or because they have to be moved down a level
+static uint64_t timer_wheel_next_tick() {
+  uint64_t next = UINT64_MAX;
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    uint64_t occupied = g_occupied[level];
+    if (!occupied) continue;
+
+    // bit i of `rotated` is the slot i + 1 after the current one
+    uint32_t shift = TIMER_WHEEL_BITS * level;
+    uint64_t block = g_current >> shift;
+    uint32_t start = (block + 1) & TIMER_WHEEL_MASK;
+    uint64_t rotated = (occupied >> start) | (occupied << ((64 - start) & 63));
+    uint64_t tick = (block + __builtin_ctzll(rotated) + 1) << shift;
+    if (tick < next) next = tick;
+  }
+  return next;
+}
+
+static void timer_wheel_cascade(int level, uint32_t slot) {
+  int32_t index = g_slots[level][slot];
+  g_slots[level][slot] = -1;
+  g_occupied[level] &= ~(1ull << slot);
+
+  while (index >= 0) {
+    int32_t next = g_timers[index].next;
+    timer_place(index);
+    index = next;
+  }
+}
+
+// Turns the wheel to `now`, only stopping at ticks where a slot comes up
+static void timer_wheel_advance(uint64_t now) {
+  while (g_current < now) {
+    uint64_t next = timer_wheel_next_tick();
+    if (next > now) {
+      g_current = now;
+      break;
+    }
+    g_current = next;
+
+    for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+      uint32_t shift = TIMER_WHEEL_BITS * level;
+      if (g_current & ((1ull << shift) - 1)) continue;
+      timer_wheel_cascade(level, (g_current >> shift) & TIMER_WHEEL_MASK);
+    }
+
+    uint32_t slot = g_current & TIMER_WHEEL_MASK;
+    int32_t index = g_slots[0][slot];
+    g_slots[0][slot] = -1;
+    g_occupied[0] &= ~(1ull << slot);
+    while (index >= 0) {
+      int32_t next = g_timers[index].next;
+      timer_append_due(index);
+      index = next;
+    }
+  }
+}
+
+static struct timer* timer_lookup(uint32_t id) {
+  uint32_t index = (id & TIMER_WHEEL_MAX_TIMERS) - 1;
+  if (index >= g_timer_count) return NULL;
+  struct timer* timer = &g_timers[index];
+  return timer->id == id && timer->list ? timer : NULL;
+}
+
+// Adds a timer due in `delay_ms`, repeating every `period_ms` unless that
+// is 0. Returns its id, 0 if it couldn't be added.
+uint32_t timer_wheel_add(uint32_t delay_ms, uint32_t period_ms, int data) {
+  timer_wheel_init();
+
+  int32_t index = g_free;
+  if (index >= 0) {
+    g_free = g_timers[index].next;
+  } else {
+    if (g_timer_count == TIMER_WHEEL_MAX_TIMERS) return 0;
+    if (g_timer_count == g_timer_capacity) {
+      uint32_t capacity = g_timer_capacity ? g_timer_capacity * 2 : 64;
+      struct timer* timers = realloc(g_timers, capacity * sizeof(struct timer));
+      if (!timers) return 0;
+      g_timers = timers;
+      g_timer_capacity = capacity;
+    }
+    index = g_timer_count++;
+    g_timers[index].id = index + 1;
+  }
+
+  struct timer* timer = &g_timers[index];
+  uint32_t generation = (timer->id >> 16) + 1;
+  timer->id = (generation << 16) | (index + 1);
+  timer->data = data;
+  timer->period = period_ms;
+
+  // the wheel only moves while it's being looked at, so it may be behind
+  uint64_t now = timer_wheel_now_ms();
+  if (timer_wheel_empty() && g_due < 0 && now > g_current) g_current = now;
+  timer->expires = now + delay_ms;
+  if (timer->expires <= g_current) timer->expires = g_current + 1;
+
+  timer_place(index);
+  g_stats.active++;
+  return timer->id;
+}
+
+// Removes a timer, due or not, `data` is what it was added with
+bool timer_wheel_cancel(uint32_t id, int* data) {
+  struct timer* timer = timer_lookup(id);
+  if (!timer) return false;
+
+  int32_t index = timer - g_timers;
+  timer_unlink(index);
+  *data = timer->data;
+  timer->next = g_free;
+  g_free = index;
+  g_stats.active--;
+  return true;
+}
+
+// Turns the wheel to the current time, returns whether any timer is due
+bool timer_wheel_expire() {
+  if (!g_initialized) return false;
+  timer_wheel_advance(timer_wheel_now_ms());
+  return g_due >= 0;
+}
+
+// Takes the next due timer off the list. A periodic timer stays and is
+// scheduled for its next period, any other is removed.
+bool timer_wheel_pop(uint32_t* id, int* data, bool* periodic) {
+  if (g_due < 0) return false;
+  uint64_t now = timer_wheel_now_ms();
+
+  int32_t index = g_due;
+  struct timer* timer = &g_timers[index];
+  timer_unlink(index);
+  *id = timer->id;
+  *data = timer->data;
+  *periodic = timer->period > 0;
+
+  uint64_t late = now > timer->expires ? now - timer->expires : 0;
+  g_stats.fired++;
+  g_stats.late_ms += late;
+  if (late > g_stats.max_late_ms) g_stats.max_late_ms = late;
+
+  if (timer->period > 0) {
+    timer->expires += timer->period;
+    if (timer->expires <= g_current) {
+      uint64_t missed = (g_current - timer->expires) / timer->period + 1;
+      timer->expires += missed * timer->period;
+    }
+    timer_place(index);
+  } else {
+    timer->next = g_free;
+    g_free = index;
+    g_stats.active--;
+  }
+  return true;
+}
+
+// The ms until a timer is due, < 0 if there are none
+int32_t timer_wheel_due_in() {
+  if (g_due >= 0) return 0;
+  if (!g_initialized || timer_wheel_empty()) return -1;
+
+  uint64_t next = timer_wheel_next_tick();
+  uint64_t now = timer_wheel_now_ms();
+  if (next <= now) return 0;
+  return next - now > INT32_MAX ? INT32_MAX : (int32_t)(next - now);
+}
+
+struct timer_wheel_stats timer_wheel_stats() {
+  return g_stats;
+}
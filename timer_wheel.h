@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+//
+// Timers are kept in a hierarchical wheel with a 1 ms tick: four levels of
+// 64 slots, each level covering 64 times the range of the one below it,
+// about 4.6 hours in total. A timer goes into the lowest level its
+// deadline fits into, and every time a level wraps around the next slot of
+// the level above is spread out into the ones below. Adding and cancelling
+// a timer is constant time, and so is every tick.
+//
+// Each level keeps a bitmap of the slots holding timers, the time until the
+// next one is due is found without walking any lists. A timer further out
+// than the wheel reaches waits in the last slot it can and is moved back in
+// as the wheel turns.
+//
+// `timer_wheel_expire` moves the timers that are due to a list, in the
+// order they were due, and `timer_wheel_pop` takes them off one by one, so
+// a callback can add or cancel timers (itself included) while the list is
+// worked through. Nothing becomes due while popping, a slow callback can't
+// keep a short period from ever letting go.
+//
+// Periodic timers are rescheduled when they are popped, periods missed
+// while the helper was busy are skipped rather than made up for.
+//
+struct timer {
+  uint32_t id;
+  int data;
+  uint64_t expires;
+  uint32_t period;
+
+  // the list the timer is on, a wheel slot or the due list
+  int32_t prev;
+  int32_t next;
+  int32_t* list;
+};
+
+struct timer_wheel_stats {
+  uint64_t fired;
+  uint64_t late_ms;
+  uint64_t max_late_ms;
+  uint32_t active;
+};
+
+uint32_t timer_wheel_add(uint32_t delay_ms, uint32_t period_ms, int data);
+bool timer_wheel_cancel(uint32_t id, int* data);
+bool timer_wheel_expire();
+bool timer_wheel_pop(uint32_t* id, int* data, bool* periodic);
+
+int32_t timer_wheel_due_in();
+struct timer_wheel_stats timer_wheel_stats();
@@ -0,0 +1,82 @@
+//
+// Compiles a lua file to bytecode and writes it out as a C array,
+// the way `xxd -C -i -n <name>` writes the source: `<NAME>` and
+// `<NAME>_LEN`, upper-cased. It links the same LuaJIT as the helper, so
+// the bytecode always matches the VM that loads it, which a `luajit -b`
+// from the PATH doesn't promise.
+//
+// The debug info is kept, an error in the embedded code still points at
+// `core.lua:<line>`. The chunk is named after the file alone, the path it
+// was built from means nothing where the helper runs.
+//
+//   ./tools/luabc lua_lib_core lua/src/core.lua >> lua/libs.h
+//
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <name> <file.lua>\n", argv[0]);
+    return 1;
+  }
+
+  lua_State* L = luaL_newstate();
+  if (!L) return 1;
+  luaL_openlibs(L);
+
+  FILE* file = fopen(argv[2], "rb");
+  if (!file) {
+    fprintf(stderr, "%s: could not open\n", argv[2]);
+    return 1;
+  }
+  luaL_Buffer source;
+  luaL_buffinit(L, &source);
+  size_t read;
+  do {
+    char* chunk = luaL_prepbuffer(&source);
+    read = fread(chunk, 1, LUAL_BUFFERSIZE, file);
+    luaL_addsize(&source, read);
+  } while (read == LUAL_BUFFERSIZE);
+  fclose(file);
+  luaL_pushresult(&source);
+
+  const char* base = strrchr(argv[2], '/');
+  lua_pushfstring(L, "@%s", base ? base + 1 : argv[2]);
+
+  size_t source_length;
+  const char* code = lua_tolstring(L, -2, &source_length);
+  lua_getglobal(L, "string");
+  lua_getfield(L, -1, "dump");
+  if (luaL_loadbuffer(L, code, source_length, lua_tostring(L, -3)) != 0) {
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    return 1;
+  }
+  if (lua_pcall(L, 1, 1, 0) != 0) {
+    fprintf(stderr, "%s: %s\n", argv[2], lua_tostring(L, -1));
+    return 1;
+  }
+
+  size_t length;
+  const unsigned char* bytecode = (const unsigned char*)lua_tolstring(L, -1, &length);
+
+  char name[256];
+  size_t i;
+  for (i = 0; argv[1][i] && i < sizeof(name) - 1; i++) {
+    name[i] = toupper((unsigned char)argv[1][i]);
+  }
+  name[i] = '\0';
+
+  printf("unsigned char %s[] = {", name);
+  for (i = 0; i < length; i++) {
+    printf(i % 12 ? " 0x%02x," : "\n  0x%02x,", bytecode[i]);
+  }
+  printf("\n};\nunsigned int %s_LEN = %zu;\n", name, length);
+
+  lua_close(L);
+  return 0;
+}
@@ -0,0 +1,339 @@
+//
+// A stand-in for sketchybar that speaks the unix socket transport.
+//
+// It acks every command the helper sends, replying to `--query` with the
+// contents of a fixture file or else with `{"query":"<what was queried>"}`,
+// after `-d` ms if given and newest first with `-o`. Events are injected
+// into the helper at a fixed rate. Counters are printed as key=value lines
+// on exit.
+//
+//   SKETCHYBAR_TRANSPORT=unix ./sb_helper &
+//   ./tools/mockbar -r 1000 -c 10000 -i clock -e routine
+//
+#include <signal.h>
+#include <time.h>
+#include "../transport.h"
+
+#define MOCKBAR_HELPER "git.lua.sketchybar"
+#define MOCKBAR_MAX_DEFERRED 64
+
+struct deferred_reply {
+  int fd;
+  uint32_t seq;
+  uint64_t due;
+  char* payload;
+  uint32_t len;
+};
+
+struct mockbar {
+  const char* helper_name;
+  const char* item;
+  const char* event;
+  char* query_reply;
+  uint32_t query_reply_len;
+  double rate;
+  uint64_t count;
+  uint64_t linger_ms;
+  uint64_t query_delay_ms;
+  bool reverse;
+
+  struct deferred_reply deferred[MOCKBAR_MAX_DEFERRED];
+  uint32_t deferred_count;
+
+  int listen_fd;
+  int helper_fd;
+  int clients[UNIX_MAX_CLIENTS];
+  uint32_t client_count;
+
+  char* frame;
+  uint32_t frame_capacity;
+
+  uint64_t events_sent;
+  uint64_t event_bytes;
+  uint64_t events_deferred;
+  uint64_t frames_received;
+  uint64_t commands_received;
+  uint64_t command_bytes;
+  uint64_t replies_sent;
+};
+
+static volatile sig_atomic_t g_stop = 0;
+static void mockbar_stop(int signal) { g_stop = 1; }
+
+static inline uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static char* read_file(const char* path, uint32_t* len) {
+  FILE* file = fopen(path, "rb");
+  if (!file) return NULL;
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char* contents = malloc(size + 1);
+  if (fread(contents, 1, size, file) != (size_t)size) {
+    free(contents);
+    fclose(file);
+    return NULL;
+  }
+  contents[size] = '\0';
+  *len = size + 1;
+  fclose(file);
+  return contents;
+}
+
+// Counts `--` tokens, a transaction carries several commands in one frame
+static uint64_t count_commands(char* payload, uint32_t len) {
+  uint64_t commands = 0;
+  bool token_start = true;
+  for (uint32_t i = 0; i + 1 < len; i++) {
+    if (token_start && payload[i] == '-' && payload[i + 1] == '-') commands++;
+    token_start = payload[i] == '\0';
+  }
+  return commands;
+}
+
+static bool handle_frame(struct mockbar* bar, int fd) {
+  struct unix_frame_header header;
+  if (!unix_frame_read(fd, &header, &bar->frame, &bar->frame_capacity))
+    return false;
+
+  bar->frames_received++;
+  bar->commands_received += count_commands(bar->frame, header.length);
+  bar->command_bytes += header.length;
+
+  if (!(header.flags & UNIX_FRAME_REPLY)) return true;
+
+  bar->replies_sent++;
+  if (strcmp(bar->frame, "--query") == 0) {
+    char echo[256];
+    char* payload = bar->query_reply;
+    uint32_t len = bar->query_reply_len;
+    if (!payload) {
+      const char* queried = header.length > 8 ? bar->frame + 8 : "";
+      len = snprintf(echo, sizeof(echo), "{\"query\":\"%.200s\"}", queried) + 1;
+      payload = echo;
+    }
+
+    if (bar->query_delay_ms > 0 && bar->deferred_count < MOCKBAR_MAX_DEFERRED) {
+      char* copy = malloc(len);
+      if (!copy) return false;
+      memcpy(copy, payload, len);
+      bar->deferred[bar->deferred_count++]
+        = (struct deferred_reply) { fd, header.seq,
+                                    now_ns() + bar->query_delay_ms * 1000000ull,
+                                    copy, len };
+      return true;
+    }
+    return unix_frame_write(fd, 0, header.seq, payload, len);
+  }
+
+  return unix_frame_write(fd, 0, header.seq, "", 1);
+}
+
+// Replies that are due go out, the oldest first or the newest first with
+// `reverse`. Returns the ms until the next one is due, -1 if there is none.
+static int send_deferred(struct mockbar* bar, uint64_t now) {
+  int next = -1;
+  for (uint32_t n = bar->deferred_count; n > 0; n--) {
+    uint32_t i = bar->reverse ? n - 1 : bar->deferred_count - n;
+    struct deferred_reply* reply = &bar->deferred[i];
+    if (reply->due > now) {
+      int due_in = (int)((reply->due - now) / 1000000ull) + 1;
+      if (next < 0 || due_in < next) next = due_in;
+      continue;
+    }
+
+    unix_frame_write(reply->fd, 0, reply->seq, reply->payload, reply->len);
+    free(reply->payload);
+    bar->deferred_count--;
+    memmove(reply, reply + 1, (bar->deferred_count - i) * sizeof(struct deferred_reply));
+  }
+  return next;
+}
+
+static void drop_deferred(struct mockbar* bar, int fd) {
+  for (uint32_t i = 0; i < bar->deferred_count;) {
+    if (bar->deferred[i].fd != fd) {
+      i++;
+      continue;
+    }
+    free(bar->deferred[i].payload);
+    bar->deferred_count--;
+    memmove(&bar->deferred[i], &bar->deferred[i + 1],
+            (bar->deferred_count - i) * sizeof(struct deferred_reply));
+  }
+}
+
+static bool send_event(struct mockbar* bar) {
+  if (bar->helper_fd == -1) {
+    bar->helper_fd = unix_socket_connect(bar->helper_name);
+    if (bar->helper_fd == -1) return false;
+  }
+
+  // The helper might be blocked waiting on one of our replies, never block
+  // on it in return.
+  struct pollfd pfd = { bar->helper_fd, POLLOUT, 0 };
+  if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLOUT)) {
+    bar->events_deferred++;
+    return false;
+  }
+
+  char info[32];
+  snprintf(info, sizeof(info), "%llu", (unsigned long long)bar->events_sent);
+
+  // Same layout sketchybar uses: KEY\0VALUE\0...\0
+  char env[512];
+  uint32_t len = 0;
+  const char* pairs[] = { "NAME", bar->item, "SENDER", bar->event,
+                          "INFO", info };
+  for (int i = 0; i < 6; i++) {
+    uint32_t part = strlen(pairs[i]) + 1;
+    if (len + part + 1 > sizeof(env)) return false;
+    memcpy(env + len, pairs[i], part);
+    len += part;
+  }
+  env[len++] = '\0';
+
+  if (!unix_frame_write(bar->helper_fd, 0, 0, env, len)) {
+    close(bar->helper_fd);
+    bar->helper_fd = -1;
+    return false;
+  }
+  bar->events_sent++;
+  bar->event_bytes += len;
+  return true;
+}
+
+static void print_stats(struct mockbar* bar, uint64_t elapsed_ns) {
+  double seconds = elapsed_ns / 1e9;
+  printf("elapsed_s=%.3f\n", seconds);
+  printf("events_sent=%llu\n", (unsigned long long)bar->events_sent);
+  printf("event_bytes=%llu\n", (unsigned long long)bar->event_bytes);
+  printf("events_deferred=%llu\n", (unsigned long long)bar->events_deferred);
+  printf("events_per_s=%.1f\n", seconds > 0 ? bar->events_sent / seconds : 0);
+  printf("frames_received=%llu\n", (unsigned long long)bar->frames_received);
+  printf("commands_received=%llu\n", (unsigned long long)bar->commands_received);
+  printf("command_bytes=%llu\n", (unsigned long long)bar->command_bytes);
+  printf("commands_per_s=%.1f\n", seconds > 0 ? bar->commands_received / seconds : 0);
+  printf("replies_sent=%llu\n", (unsigned long long)bar->replies_sent);
+}
+
+static void usage(const char* name) {
+  fprintf(stderr, "usage: %s [-n helper] [-r events/s] [-c count] [-i item]"
+                  " [-e event] [-q query.json] [-d query_delay_ms] [-o]"
+                  " [-l linger_ms]\n"
+                  "  -r 0 injects events as fast as the helper accepts them\n",
+                  name                                                      );
+}
+
+int main(int argc, char** argv) {
+  struct mockbar bar = { .helper_name = MOCKBAR_HELPER,
+                         .item = "mockbar",
+                         .event = "routine",
+                         .rate = 100,
+                         .linger_ms = 1000,
+                         .listen_fd = -1,
+                         .helper_fd = -1 };
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:c:i:e:q:d:ol:h")) != -1) {
+    switch (opt) {
+      case 'n': bar.helper_name = optarg; break;
+      case 'r': bar.rate = atof(optarg); break;
+      case 'c': bar.count = strtoull(optarg, NULL, 10); break;
+      case 'i': bar.item = optarg; break;
+      case 'e': bar.event = optarg; break;
+      case 'l': bar.linger_ms = strtoull(optarg, NULL, 10); break;
+      case 'd': bar.query_delay_ms = strtoull(optarg, NULL, 10); break;
+      case 'o': bar.reverse = true; break;
+      case 'q':
+        bar.query_reply = read_file(optarg, &bar.query_reply_len);
+        if (!bar.query_reply) {
+          fprintf(stderr, "Could not read %s\n", optarg);
+          return 1;
+        }
+        break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+
+  bar.listen_fd = unix_socket_listen(TRANSPORT_BAR_NAME);
+  if (bar.listen_fd == -1) {
+    fprintf(stderr, "Could not listen on the bar socket [%d]\n", errno);
+    return 1;
+  }
+
+  signal(SIGINT, mockbar_stop);
+  signal(SIGTERM, mockbar_stop);
+  signal(SIGPIPE, SIG_IGN);
+
+  uint64_t interval_ns = bar.rate > 0 ? (uint64_t)(1e9 / bar.rate) : 0;
+  uint64_t start = now_ns();
+  uint64_t next_event = start;
+  uint64_t done_at = 0;
+
+  while (!g_stop) {
+    uint64_t now = now_ns();
+    bool injecting = bar.count == 0 || bar.events_sent < bar.count;
+
+    if (!injecting && !done_at) done_at = now;
+    if (done_at && now - done_at >= bar.linger_ms * 1000000ull) break;
+
+    bool backed_up = false;
+    while (injecting && now >= next_event) {
+      if (!send_event(&bar)) {
+        backed_up = bar.helper_fd != -1;
+        // helper isn't up yet or is backed up, try again shortly
+        if (bar.helper_fd == -1) next_event = now + 10000000ull;
+        break;
+      }
+      next_event += interval_ns;
+      injecting = bar.count == 0 || bar.events_sent < bar.count;
+      if (interval_ns == 0) break;
+    }
+
+    int timeout_ms = 10;
+    if (injecting && next_event > now)
+      timeout_ms = (int)((next_event - now) / 1000000ull);
+    else if (injecting)
+      timeout_ms = backed_up ? 1 : 0;
+
+    int deferred_in = send_deferred(&bar, now);
+    if (deferred_in >= 0 && deferred_in < timeout_ms) timeout_ms = deferred_in;
+
+    struct pollfd fds[UNIX_MAX_CLIENTS + 1];
+    uint32_t count = bar.client_count;
+    fds[0] = (struct pollfd) { bar.listen_fd, POLLIN, 0 };
+    for (uint32_t i = 0; i < count; i++)
+      fds[i + 1] = (struct pollfd) { bar.clients[i], POLLIN, 0 };
+
+    if (poll(fds, count + 1, timeout_ms) <= 0) continue;
+
+    for (uint32_t i = count; i > 0; i--) {
+      if (!fds[i].revents) continue;
+      if (!handle_frame(&bar, fds[i].fd)) {
+        drop_deferred(&bar, fds[i].fd);
+        close(fds[i].fd);
+        bar.clients[i - 1] = bar.clients[--bar.client_count];
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int client = accept(bar.listen_fd, NULL, NULL);
+      if (client != -1 && bar.client_count < UNIX_MAX_CLIENTS)
+        bar.clients[bar.client_count++] = client;
+      else if (client != -1)
+        close(client);
+    }
+  }
+
+  print_stats(&bar, now_ns() - start);
+
+  char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+  unix_socket_path(path, sizeof(path), TRANSPORT_BAR_NAME);
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef char* env;
+
+#define MACH_HANDLER(name) void name(env env)
+typedef MACH_HANDLER(mach_handler);
+
+#define TRANSPORT_BAR_NAME "git.felix.sketchybar"
+#define TRANSPORT_ENV "SKETCHYBAR_TRANSPORT"
+
+#define TRANSPORT_REPLY_TIMEOUT_MS 100
+#define TRANSPORT_MAX_STASHED 64
+
+//
+// Everything that goes between the helper and the bar passes through one of
+// these. Mach ports are what sketchybar actually speaks, the unix socket
+// backend exists so the helper can be driven by `tools/mockbar` on machines
+// without a bar (or without mach at all).
+//
+// - `send` waits for the bar's reply and returns it. The returned string is
+//   owned by the transport and only valid until the next `send`.
+// - `post` is fire-and-forget, the bar isn't even asked for a reply.
+// - `request` sends a message without waiting and returns the sequence id
+//   its reply will be tagged with, 0 if it couldn't be sent. `reply` takes
+//   the next reply that arrived without waiting for one (the response is
+//   malloc'd), `reply_fd` becomes readable when there is one. Replies that
+//   came in while `send` waited for its own are handed out first.
+// - `forget` gives up on every reply still outstanding, it's called when one
+//   didn't come in time. Backends that can't tell which request a reply
+//   belongs to would otherwise hand every later reply to the wrong one.
+// - `receive` waits up to `timeout_ms` (< 0 = forever) for an event and sets
+//   `*event` to NULL if nothing arrived. It only returns false if the event
+//   server is unusable. Every non-NULL event must be handed back to
+//   `release` once the handler is done with it.
+//
+// Replies come back on one channel that stays open, so any number of
+// requests can be in flight and `send` is just a `request` that waits.
+//
+// `receive` and `release` run on the receiver thread, everything else on
+// the thread running lua, so the two sides must not share state.
+//
+struct transport {
+  const char* name;
+  bool (*server_register)(char* bootstrap_name);
+  char* (*send)(char* message, uint32_t len);
+  bool (*post)(char* message, uint32_t len);
+  uint32_t (*request)(char* message, uint32_t len);
+  bool (*reply)(uint32_t* seq, char** response);
+  int (*reply_fd)();
+  bool (*receive)(env* event, int32_t timeout_ms);
+  void (*release)(env event);
+  void (*forget)();
+};
+
+struct transport_reply {
+  uint32_t seq;
+  char* response;
+};
+
+static uint32_t g_transport_seq = 0;
+static struct transport_reply g_transport_stash[TRANSPORT_MAX_STASHED];
+static uint32_t g_transport_stash_count = 0;
+static uint32_t g_transport_epoch = 0;
+
+static inline uint64_t transport_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Never 0, that's what a failed request returns
+static inline uint32_t transport_next_seq() {
+  if (++g_transport_seq == 0) g_transport_seq = 1;
+  return g_transport_seq;
+}
+
+// Keeps a reply nobody waited for, the oldest is dropped once the stash is
+// full: a reply nobody collected for that long was given up.
+static inline void transport_stash(uint32_t seq, char* response) {
+  if (g_transport_stash_count == TRANSPORT_MAX_STASHED) {
+    free(g_transport_stash[0].response);
+    g_transport_stash_count--;
+    memmove(g_transport_stash, g_transport_stash + 1,
+            g_transport_stash_count * sizeof(struct transport_reply));
+  }
+  g_transport_stash[g_transport_stash_count++] = (struct transport_reply) { seq, response };
+}
+
+static inline bool transport_unstash(uint32_t* seq, char** response) {
+  if (g_transport_stash_count == 0) return false;
+
+  *seq = g_transport_stash[0].seq;
+  *response = g_transport_stash[0].response;
+  g_transport_stash_count--;
+  memmove(g_transport_stash, g_transport_stash + 1,
+          g_transport_stash_count * sizeof(struct transport_reply));
+  return true;
+}
+
+static inline bool transport_stashed() {
+  return g_transport_stash_count > 0;
+}
+
+static inline void transport_stash_clear() {
+  while (g_transport_stash_count > 0)
+    free(g_transport_stash[--g_transport_stash_count].response);
+}
+
+// Changes whenever the replies still outstanding were given up on or lost
+// with the connection, a request sent in an older epoch is never answered
+static inline uint32_t transport_epoch() {
+  return g_transport_epoch;
+}
+
+static inline void transport_epoch_advance() {
+  g_transport_epoch++;
+}
+
+#ifdef __APPLE__
+#include "transport_mach.h"
+#endif
+#include "transport_unix.h"
+
+static struct transport* g_transport = NULL;
+
+// Mach is the default wherever it exists, `SKETCHYBAR_TRANSPORT=unix` forces
+// the socket backend.
+static inline struct transport* transport_get() {
+  if (g_transport) return g_transport;
+
+#ifdef __APPLE__
+  char* selected = getenv(TRANSPORT_ENV);
+  if (!selected || strcmp(selected, "unix") != 0) {
+    g_transport = &g_transport_mach;
+    return g_transport;
+  }
+#endif
+
+  g_transport = &g_transport_unix;
+  return g_transport;
+}
@@ -0,0 +1,398 @@
+#pragma once
+
+#include <mach/mach.h>
+#include <mach/message.h>
+#include <bootstrap.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/event.h>
+
+struct mach_message {
+  mach_msg_header_t header;
+  mach_msg_size_t msgh_descriptor_count;
+  mach_msg_ool_descriptor_t descriptor;
+};
+
+struct mach_buffer {
+  struct mach_message message;
+  mach_msg_trailer_t trailer;
+};
+
+struct mach_server {
+  bool is_running;
+  mach_port_name_t task;
+  mach_port_t port;
+  mach_port_t bs_port;
+
+  pthread_t thread;
+  mach_handler* handler;
+};
+
+static struct mach_server g_mach_server;
+static mach_port_t g_mach_port = 0;
+static struct mach_buffer g_mach_event;
+
+static inline mach_port_t mach_get_bs_port(char* name) {
+  mach_port_name_t task = mach_task_self();
+
+  mach_port_t bs_port;
+  if (task_get_special_port(task,
+                            TASK_BOOTSTRAP_PORT,
+                            &bs_port            ) != KERN_SUCCESS) {
+    return 0;
+  }
+
+  mach_port_t port;
+  if (bootstrap_look_up(bs_port,
+                        name,
+                        &port   ) != KERN_SUCCESS) {
+    return 0;
+  }
+
+  return port;
+}
+
+// `timeout_ms` < 0 blocks until a message arrives
+static inline bool mach_receive_message(mach_port_t port, struct mach_buffer* buffer, int32_t timeout_ms) {
+  *buffer = (struct mach_buffer) { 0 };
+  mach_msg_return_t msg_return;
+  if (timeout_ms >= 0)
+    msg_return = mach_msg(&buffer->message.header,
+                          MACH_RCV_MSG | MACH_RCV_TIMEOUT,
+                          0,
+                          sizeof(struct mach_buffer),
+                          port,
+                          timeout_ms,
+                          MACH_PORT_NULL             );
+  else
+    msg_return = mach_msg(&buffer->message.header,
+                          MACH_RCV_MSG,
+                          0,
+                          sizeof(struct mach_buffer),
+                          port,
+                          MACH_MSG_TIMEOUT_NONE,
+                          MACH_PORT_NULL             );
+
+  if (msg_return != MACH_MSG_SUCCESS) {
+    buffer->message.descriptor.address = NULL;
+    return false;
+  }
+  return true;
+}
+
+static inline void mach_message_init(struct mach_message* msg, mach_port_t port, mach_port_t response_port, char* message, uint32_t len) {
+  msg->header.msgh_remote_port = port;
+  msg->header.msgh_local_port = response_port;
+  msg->header.msgh_id = response_port;
+  msg->header.msgh_bits = MACH_MSGH_BITS_SET(MACH_MSG_TYPE_COPY_SEND,
+                                             response_port
+                                             ? MACH_MSG_TYPE_MAKE_SEND
+                                             : 0,
+                                             0,
+                                             MACH_MSGH_BITS_COMPLEX       );
+
+  msg->header.msgh_size = sizeof(struct mach_message);
+  msg->msgh_descriptor_count = 1;
+  msg->descriptor.address = message;
+  msg->descriptor.size = len * sizeof(char);
+  msg->descriptor.copy = MACH_MSG_VIRTUAL_COPY;
+  msg->descriptor.deallocate = false;
+  msg->descriptor.type = MACH_MSG_OOL_DESCRIPTOR;
+}
+
+//
+// Replies all come back to one receive port that lives as long as the
+// helper does. It is the only member of a port set watched by a kqueue, so
+// the event loop can poll for replies along with everything else.
+//
+// The bar doesn't echo anything a request could be recognized by, but it
+// handles its port on one thread and answers every request carrying a
+// reply port, in the order they arrived. Replies are matched to the
+// requests still waiting for one in the order they were sent.
+//
+// That only holds as long as every request is answered. Once one isn't in
+// time, or more are outstanding than are remembered, any reply could be
+// the late one, so all of them are given up on: the port is destroyed
+// along with whatever still arrives on it and the next request gets a new
+// one. Queries waiting for a reply fail, see `transport_epoch`.
+//
+#define MACH_MAX_OUTSTANDING 256
+
+struct mach_replies {
+  mach_port_t port;
+  mach_port_t set;
+  int kq;
+
+  // sequence ids of the requests waiting for a reply, oldest first
+  uint32_t outstanding[MACH_MAX_OUTSTANDING];
+  uint32_t head;
+  uint32_t count;
+};
+
+static struct mach_replies g_mach_replies = { .kq = -1 };
+static char* g_rsp = NULL;
+
+static inline bool mach_replies_init() {
+  if (g_mach_replies.port) return true;
+
+  mach_port_name_t task = mach_task_self();
+  mach_port_t port, set;
+  if (mach_port_allocate(task, MACH_PORT_RIGHT_RECEIVE, &port) != KERN_SUCCESS)
+    return false;
+
+  if (mach_port_insert_right(task, port, port, MACH_MSG_TYPE_MAKE_SEND) != KERN_SUCCESS
+      || mach_port_allocate(task, MACH_PORT_RIGHT_PORT_SET, &set) != KERN_SUCCESS) {
+    mach_port_mod_refs(task, port, MACH_PORT_RIGHT_RECEIVE, -1);
+    return false;
+  }
+
+  int kq = kqueue();
+  struct kevent event;
+  EV_SET(&event, set, EVFILT_MACHPORT, EV_ADD | EV_ENABLE, 0, 0, NULL);
+  if (mach_port_move_member(task, port, set) != KERN_SUCCESS
+      || kq == -1
+      || kevent(kq, &event, 1, NULL, 0, NULL) == -1) {
+    if (kq != -1) close(kq);
+    mach_port_mod_refs(task, set, MACH_PORT_RIGHT_PORT_SET, -1);
+    mach_port_destruct(task, port, -1, 0);
+    return false;
+  }
+  fcntl(kq, F_SETFD, FD_CLOEXEC);
+
+  g_mach_replies.port = port;
+  g_mach_replies.set = set;
+  g_mach_replies.kq = kq;
+  return true;
+}
+
+static inline void mach_replies_reset() {
+  g_mach_replies.head = 0;
+  g_mach_replies.count = 0;
+  transport_stash_clear();
+  transport_epoch_advance();
+  if (!g_mach_replies.port) return;
+
+  mach_port_name_t task = mach_task_self();
+  mach_port_destruct(task, g_mach_replies.port, -1, 0);
+  mach_port_mod_refs(task, g_mach_replies.set, MACH_PORT_RIGHT_PORT_SET, -1);
+  close(g_mach_replies.kq);
+  g_mach_replies = (struct mach_replies) { .kq = -1 };
+}
+
+static inline void mach_replies_push(uint32_t seq) {
+  uint32_t tail = (g_mach_replies.head + g_mach_replies.count) % MACH_MAX_OUTSTANDING;
+  g_mach_replies.outstanding[tail] = seq;
+  g_mach_replies.count++;
+}
+
+static inline uint32_t mach_replies_pop() {
+  if (g_mach_replies.count == 0) return 0;
+
+  uint32_t seq = g_mach_replies.outstanding[g_mach_replies.head];
+  g_mach_replies.head = (g_mach_replies.head + 1) % MACH_MAX_OUTSTANDING;
+  g_mach_replies.count--;
+  return seq;
+}
+
+// Sends `message` with the reply port attached and returns its sequence id
+static inline uint32_t mach_request_message(mach_port_t port, char* message, uint32_t len) {
+  if (g_mach_replies.count == MACH_MAX_OUTSTANDING) mach_replies_reset();
+  if (!message || !port || !mach_replies_init()) {
+    return 0;
+  }
+
+  struct mach_message msg = { 0 };
+  mach_message_init(&msg, port, g_mach_replies.port, message, len);
+
+  if (mach_msg(&msg.header,
+               MACH_SEND_MSG,
+               sizeof(struct mach_message),
+               0,
+               MACH_PORT_NULL,
+               MACH_MSG_TIMEOUT_NONE,
+               MACH_PORT_NULL              ) != MACH_MSG_SUCCESS) {
+    return 0;
+  }
+
+  uint32_t seq = transport_next_seq();
+  mach_replies_push(seq);
+  return seq;
+}
+
+// Takes the next reply off the port, waiting up to `timeout_ms` for one
+static inline bool mach_receive_reply(int32_t timeout_ms, uint32_t* seq, char** response) {
+  struct mach_buffer buffer;
+  if (!mach_receive_message(g_mach_replies.set, &buffer, timeout_ms)) return false;
+
+  const char* reply = buffer.message.descriptor.address;
+  uint32_t length = reply ? strlen(reply) : 0;
+  *response = malloc(length + 1);
+  if (*response) {
+    if (length > 0) memcpy(*response, reply, length);
+    (*response)[length] = '\0';
+  }
+
+  mach_msg_destroy(&buffer.message.header);
+  *seq = mach_replies_pop();
+  return *response != NULL;
+}
+
+static inline char* mach_send_message(mach_port_t port, char* message, uint32_t len) {
+  uint32_t seq = mach_request_message(port, message, len);
+  if (seq == 0) return NULL;
+
+  uint64_t deadline = transport_now_ms() + TRANSPORT_REPLY_TIMEOUT_MS;
+  uint64_t now;
+  while ((now = transport_now_ms()) < deadline) {
+    uint32_t reply_seq;
+    char* response;
+    if (!mach_receive_reply(deadline - now, &reply_seq, &response)) break;
+
+    if (reply_seq == seq) {
+      if (g_rsp) free(g_rsp);
+      g_rsp = response;
+      return g_rsp;
+    }
+    transport_stash(reply_seq, response);
+  }
+
+  // the reply could still come and be taken for the next request's
+  mach_replies_reset();
+  if (g_rsp) free(g_rsp);
+  g_rsp = malloc(1);
+  if (g_rsp) *g_rsp = '\0';
+  return g_rsp;
+}
+
+// Same as `mach_send_message` but without a reply port, the bar has nowhere
+// to send a response so we don't wait for one.
+static inline bool mach_post_message(mach_port_t port, char* message, uint32_t len) {
+  if (!message || !port) {
+    return false;
+  }
+
+  struct mach_message msg = { 0 };
+  mach_message_init(&msg, port, MACH_PORT_NULL, message, len);
+
+  return mach_msg(&msg.header,
+                  MACH_SEND_MSG,
+                  sizeof(struct mach_message),
+                  0,
+                  MACH_PORT_NULL,
+                  MACH_MSG_TIMEOUT_NONE,
+                  MACH_PORT_NULL              ) == MACH_MSG_SUCCESS;
+}
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+
+static inline bool mach_server_register(struct mach_server* mach_server, char* bootstrap_name) {
+  mach_server->task = mach_task_self();
+
+  if (mach_port_allocate(mach_server->task,
+                         MACH_PORT_RIGHT_RECEIVE,
+                         &mach_server->port      ) != KERN_SUCCESS) {
+    return false;
+  }
+
+  if (mach_port_insert_right(mach_server->task,
+                             mach_server->port,
+                             mach_server->port,
+                             MACH_MSG_TYPE_MAKE_SEND) != KERN_SUCCESS) {
+    return false;
+  }
+
+  if (task_get_special_port(mach_server->task,
+                            TASK_BOOTSTRAP_PORT,
+                            &mach_server->bs_port) != KERN_SUCCESS) {
+    return false;
+  }
+
+  if (bootstrap_register(mach_server->bs_port,
+                         bootstrap_name,
+                         mach_server->port    ) != KERN_SUCCESS) {
+    return false;
+  }
+
+  return true;
+}
+#pragma clang diagnostic pop
+
+
+//
+// transport backend
+//
+
+static inline mach_port_t transport_mach_bar_port() {
+  if (!g_mach_port) g_mach_port = mach_get_bs_port(TRANSPORT_BAR_NAME);
+  return g_mach_port;
+}
+
+// A bar that was restarted has a new port and won't answer what the old
+// one was asked
+static inline void transport_mach_reset() {
+  g_mach_port = 0;
+  mach_replies_reset();
+}
+
+static inline bool transport_mach_register(char* bootstrap_name) {
+  return mach_server_register(&g_mach_server, bootstrap_name);
+}
+
+static inline char* transport_mach_send(char* message, uint32_t len) {
+  char* response = mach_send_message(transport_mach_bar_port(), message, len);
+  if (!response && message) transport_mach_reset();
+  return response;
+}
+
+static inline bool transport_mach_post(char* message, uint32_t len) {
+  if (mach_post_message(transport_mach_bar_port(), message, len)) return true;
+  transport_mach_reset();
+  return false;
+}
+
+static inline uint32_t transport_mach_request(char* message, uint32_t len) {
+  uint32_t seq = mach_request_message(transport_mach_bar_port(), message, len);
+  if (seq == 0 && message) transport_mach_reset();
+  return seq;
+}
+
+// The kqueue only says a reply is there, its event is taken off as well so
+// it is reported again only if more replies arrive
+static inline bool transport_mach_reply(uint32_t* seq, char** response) {
+  if (transport_unstash(seq, response)) return true;
+  if (g_mach_replies.kq == -1) return false;
+
+  struct kevent event;
+  struct timespec zero = { 0, 0 };
+  kevent(g_mach_replies.kq, NULL, 0, &event, 1, &zero);
+  return mach_receive_reply(0, seq, response);
+}
+
+static inline int transport_mach_reply_fd() {
+  return mach_replies_init() ? g_mach_replies.kq : -1;
+}
+
+static inline bool transport_mach_receive(env* event, int32_t timeout_ms) {
+  mach_receive_message(g_mach_server.port, &g_mach_event, timeout_ms);
+  *event = (env)g_mach_event.message.descriptor.address;
+  return true;
+}
+
+static inline void transport_mach_release(env event) {
+  mach_msg_destroy(&g_mach_event.message.header);
+}
+
+static struct transport g_transport_mach = {
+  .name = "mach",
+  .server_register = transport_mach_register,
+  .send = transport_mach_send,
+  .post = transport_mach_post,
+  .request = transport_mach_request,
+  .reply = transport_mach_reply,
+  .reply_fd = transport_mach_reply_fd,
+  .receive = transport_mach_receive,
+  .release = transport_mach_release,
+  .forget = mach_replies_reset
+};
@@ -0,0 +1,377 @@
+#pragma once
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+//
+// Unix socket transport. Both ends listen on `<dir>/<bootstrap name>.socket`
+// where `<dir>` is `$SKETCHYBAR_SOCKET_DIR` or /tmp, so the bar is reachable
+// at `/tmp/git.felix.sketchybar.socket` and the helper at
+// `/tmp/git.lua.sketchybar.socket`.
+//
+// Every message is a frame: a header followed by `length` bytes of payload.
+// The payload is exactly what would have gone into the mach OOL descriptor,
+// NUL-separated command tokens or a packed env. Frames flagged with
+// `UNIX_FRAME_REPLY` are answered with a frame holding the NUL-terminated
+// response and the same `seq`, replies don't have to come in order.
+//
+// The sockets are only accessible to their owner. A peer announcing a frame
+// longer than UNIX_FRAME_MAX_LENGTH, or not sending a frame it started
+// within UNIX_FRAME_TIMEOUT_MS, is dropped.
+//
+
+#define UNIX_SOCKET_DIR_ENV "SKETCHYBAR_SOCKET_DIR"
+#define UNIX_SOCKET_DIR "/tmp"
+#define UNIX_MAX_CLIENTS 8
+#define UNIX_FRAME_MAX_LENGTH (64u << 20)
+#define UNIX_FRAME_TIMEOUT_MS 1000
+
+#define UNIX_FRAME_REPLY (1 << 0)
+
+// A peer that went away makes writes fail with EPIPE instead of killing
+// the process with SIGPIPE, so the reconnects below get to run. Ignoring
+// the signal for the whole process would be inherited by spawned scripts.
+#ifdef MSG_NOSIGNAL
+#define UNIX_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define UNIX_SEND_FLAGS 0
+#endif
+
+struct unix_frame_header {
+  uint32_t length;
+  uint32_t flags;
+  uint32_t seq;
+};
+
+static inline void unix_socket_path(char* path, size_t size, const char* name) {
+  char* dir = getenv(UNIX_SOCKET_DIR_ENV);
+  snprintf(path, size, "%s/%s.socket", dir ? dir : UNIX_SOCKET_DIR, name);
+}
+
+static inline bool unix_socket_address(struct sockaddr_un* address, const char* name) {
+  memset(address, 0, sizeof(struct sockaddr_un));
+  address->sun_family = AF_UNIX;
+  unix_socket_path(address->sun_path, sizeof(address->sun_path), name);
+  return address->sun_path[0] != '\0';
+}
+
+// macOS has no MSG_NOSIGNAL everywhere, the socket itself is told instead
+static inline void unix_socket_nosigpipe(int fd) {
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+static inline int unix_socket_connect(const char* name) {
+  struct sockaddr_un address;
+  if (!unix_socket_address(&address, name)) return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) return -1;
+
+  if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
+    close(fd);
+    return -1;
+  }
+  unix_socket_nosigpipe(fd);
+  return fd;
+}
+
+static inline int unix_socket_listen(const char* name) {
+  struct sockaddr_un address;
+  if (!unix_socket_address(&address, name)) return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) return -1;
+
+  // Nobody but the owner may connect, the socket is created 0600
+  unlink(address.sun_path);
+  mode_t mask = umask(0077);
+  int bound = bind(fd, (struct sockaddr*)&address, sizeof(address));
+  umask(mask);
+  if (bound == -1 || listen(fd, UNIX_MAX_CLIENTS) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Fails once `deadline` (transport_now_ms) passes without the rest arriving
+static inline bool unix_read_all(int fd, void* data, size_t len, uint64_t deadline) {
+  char* caret = data;
+  while (len > 0) {
+    uint64_t now = transport_now_ms();
+    if (now >= deadline) return false;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int ready = poll(&pfd, 1, deadline - now);
+    if (ready == 0) return false;
+    if (ready == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+
+    ssize_t bytes = read(fd, caret, len);
+    if (bytes == 0) return false;
+    if (bytes == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    caret += bytes;
+    len -= bytes;
+  }
+  return true;
+}
+
+static inline bool unix_frame_write(int fd, uint32_t flags, uint32_t seq, const char* payload, uint32_t len) {
+  struct unix_frame_header header = { len, flags, seq };
+  struct iovec iov[2] = { { &header, sizeof(header) },
+                          { (void*)payload, len     } };
+
+  size_t remaining = sizeof(header) + len;
+  int iov_index = 0;
+  while (remaining > 0) {
+    struct msghdr message = { .msg_iov = iov + iov_index,
+                              .msg_iovlen = 2 - iov_index };
+    ssize_t bytes = sendmsg(fd, &message, UNIX_SEND_FLAGS);
+    if (bytes == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    remaining -= bytes;
+    while (iov_index < 2 && (size_t)bytes >= iov[iov_index].iov_len) {
+      bytes -= iov[iov_index].iov_len;
+      iov_index++;
+    }
+    if (iov_index < 2) {
+      iov[iov_index].iov_base = (char*)iov[iov_index].iov_base + bytes;
+      iov[iov_index].iov_len -= bytes;
+    }
+  }
+  return true;
+}
+
+// Reads one frame into `*buffer`, growing it as needed. Two NUL bytes are
+// appended past the payload so it can be treated as a string or an env even
+// if the sender didn't terminate it. False means the peer has to go: it
+// closed, announced too long a frame or didn't send all of it in time.
+static inline bool unix_frame_read(int fd, struct unix_frame_header* header, char** buffer, uint32_t* capacity) {
+  uint64_t deadline = transport_now_ms() + UNIX_FRAME_TIMEOUT_MS;
+  if (!unix_read_all(fd, header, sizeof(struct unix_frame_header), deadline))
+    return false;
+  if (header->length > UNIX_FRAME_MAX_LENGTH) return false;
+
+  size_t size = (size_t)header->length + 2;
+  if (size > *capacity) {
+    char* grown = realloc(*buffer, size);
+    if (!grown) return false;
+    *buffer = grown;
+    *capacity = size;
+  }
+
+  if (!unix_read_all(fd, *buffer, header->length, deadline)) return false;
+  (*buffer)[header->length] = '\0';
+  (*buffer)[header->length + 1] = '\0';
+  return true;
+}
+
+static inline bool unix_wait_readable(int fd, int32_t timeout_ms) {
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  int ready;
+  do { ready = poll(&pfd, 1, timeout_ms); } while (ready == -1 && errno == EINTR);
+  return ready > 0;
+}
+
+
+//
+// transport backend
+//
+
+struct unix_transport {
+  int bar_fd;
+  int listen_fd;
+  int clients[UNIX_MAX_CLIENTS];
+  uint32_t client_count;
+
+  char* rsp;
+  uint32_t rsp_capacity;
+  char* event;
+  uint32_t event_capacity;
+};
+
+static struct unix_transport g_unix_transport = { .bar_fd = -1,
+                                                  .listen_fd = -1 };
+
+// Replies still in flight are gone with the connection
+static inline void transport_unix_disconnect() {
+  if (g_unix_transport.bar_fd == -1) return;
+  close(g_unix_transport.bar_fd);
+  g_unix_transport.bar_fd = -1;
+  transport_epoch_advance();
+}
+
+static inline int transport_unix_bar_fd() {
+  if (g_unix_transport.bar_fd == -1)
+    g_unix_transport.bar_fd = unix_socket_connect(TRANSPORT_BAR_NAME);
+  return g_unix_transport.bar_fd;
+}
+
+static inline bool transport_unix_register(char* bootstrap_name) {
+  g_unix_transport.listen_fd = unix_socket_listen(bootstrap_name);
+  return g_unix_transport.listen_fd != -1;
+}
+
+static inline uint32_t transport_unix_request(char* message, uint32_t len) {
+  int fd = transport_unix_bar_fd();
+  if (!message || fd == -1) return 0;
+
+  uint32_t seq = transport_next_seq();
+  if (!unix_frame_write(fd, UNIX_FRAME_REPLY, seq, message, len)) {
+    transport_unix_disconnect();
+    return 0;
+  }
+  return seq;
+}
+
+static inline char* transport_unix_send(char* message, uint32_t len) {
+  uint32_t seq = transport_unix_request(message, len);
+  if (seq == 0) return NULL;
+
+  // Replies to requests still in flight are kept for `reply`, a late one
+  // to an earlier `send` is recognized by its seq and dropped eventually
+  uint64_t deadline = transport_now_ms() + TRANSPORT_REPLY_TIMEOUT_MS;
+  for (;;) {
+    uint64_t now = transport_now_ms();
+    int fd = g_unix_transport.bar_fd;
+    if (fd == -1 || now >= deadline || !unix_wait_readable(fd, deadline - now))
+      break;
+
+    struct unix_frame_header header;
+    if (!unix_frame_read(fd, &header, &g_unix_transport.rsp,
+                                      &g_unix_transport.rsp_capacity)) {
+      transport_unix_disconnect();
+      break;
+    }
+    if (header.seq == seq) return g_unix_transport.rsp;
+
+    char* response = malloc(header.length + 1);
+    if (!response) continue;
+    memcpy(response, g_unix_transport.rsp, header.length + 1);
+    transport_stash(header.seq, response);
+  }
+
+  if (!g_unix_transport.rsp) {
+    g_unix_transport.rsp = malloc(1);
+    g_unix_transport.rsp_capacity = 1;
+  }
+  *g_unix_transport.rsp = '\0';
+  return g_unix_transport.rsp;
+}
+
+static inline bool transport_unix_reply(uint32_t* seq, char** response) {
+  if (transport_unstash(seq, response)) return true;
+
+  int fd = g_unix_transport.bar_fd;
+  if (fd == -1 || !unix_wait_readable(fd, 0)) return false;
+
+  struct unix_frame_header header;
+  char* buffer = NULL;
+  uint32_t capacity = 0;
+  if (!unix_frame_read(fd, &header, &buffer, &capacity)) {
+    free(buffer);
+    transport_unix_disconnect();
+    return false;
+  }
+
+  *seq = header.seq;
+  *response = buffer;
+  return true;
+}
+
+static inline int transport_unix_reply_fd() {
+  return g_unix_transport.bar_fd;
+}
+
+static inline bool transport_unix_post(char* message, uint32_t len) {
+  int fd = transport_unix_bar_fd();
+  if (!message || fd == -1) return false;
+
+  if (!unix_frame_write(fd, 0, 0, message, len)) {
+    transport_unix_disconnect();
+    return false;
+  }
+  return true;
+}
+
+// Replies carry their seq, a late one is told apart from the rest and
+// dropped eventually
+static inline void transport_unix_forget() { }
+
+static inline void transport_unix_drop_client(uint32_t index) {
+  close(g_unix_transport.clients[index]);
+  g_unix_transport.clients[index]
+    = g_unix_transport.clients[--g_unix_transport.client_count];
+}
+
+static inline bool transport_unix_receive(env* event, int32_t timeout_ms) {
+  *event = NULL;
+  if (g_unix_transport.listen_fd == -1) return false;
+
+  struct pollfd fds[UNIX_MAX_CLIENTS + 1];
+  uint32_t count = g_unix_transport.client_count;
+  fds[0] = (struct pollfd) { g_unix_transport.listen_fd, POLLIN, 0 };
+  for (uint32_t i = 0; i < count; i++) {
+    fds[i + 1] = (struct pollfd) { g_unix_transport.clients[i], POLLIN, 0 };
+  }
+
+  int ready = poll(fds, count + 1, timeout_ms);
+  if (ready == -1) return errno == EINTR;
+  if (ready == 0) return true;
+
+  // Walk backwards so dropping a client doesn't shift the ones not yet seen
+  for (uint32_t i = count; i > 0; i--) {
+    if (!fds[i].revents) continue;
+
+    struct unix_frame_header header;
+    if (unix_frame_read(fds[i].fd, &header, &g_unix_transport.event,
+                                           &g_unix_transport.event_capacity)) {
+      *event = g_unix_transport.event;
+      break;
+    }
+    transport_unix_drop_client(i - 1);
+  }
+
+  if (fds[0].revents & POLLIN) {
+    int client = accept(g_unix_transport.listen_fd, NULL, NULL);
+    if (client != -1) {
+      unix_socket_nosigpipe(client);
+      if (g_unix_transport.client_count < UNIX_MAX_CLIENTS)
+        g_unix_transport.clients[g_unix_transport.client_count++] = client;
+      else
+        close(client);
+    }
+  }
+
+  return true;
+}
+
+static inline void transport_unix_release(env event) { }
+
+static struct transport g_transport_unix = {
+  .name = "unix",
+  .server_register = transport_unix_register,
+  .send = transport_unix_send,
+  .post = transport_unix_post,
+  .request = transport_unix_request,
+  .reply = transport_unix_reply,
+  .reply_fd = transport_unix_reply_fd,
+  .receive = transport_unix_receive,
+  .release = transport_unix_release,
+  .forget = transport_unix_forget
+};
@@ -0,0 +1,192 @@
+#include "yabai.h"
+#include "stats.h"
+
+static struct sockaddr_un g_yabai_address;
+static bool g_yabai_address_set = false;
+static int g_yabai_timeout_ms = YABAI_TIMEOUT_MS;
+
+static uint64_t yabai_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// yabai messages are a 4 byte length followed by the NUL-separated
+// arguments and a final NUL.
+uint32_t generate_message(const char* command, char** message_buf) {
+  uint32_t command_len = strlen(command);
+  *message_buf = malloc(sizeof(int32_t) + command_len + 2);
+  char* mbuf = *message_buf;
+  uint32_t message_len = sizeof(int32_t);
+
+  for (uint32_t i = 0; i < command_len; i++) {
+    char c = command[i];
+    if (c == ' ') mbuf[message_len++] = '\0';
+    else mbuf[message_len++] = c;
+  }
+
+  mbuf[message_len++] = '\0';
+  mbuf[message_len++] = '\0';
+
+  int32_t payload_len = message_len - sizeof(int32_t);
+  memcpy(mbuf, &payload_len, sizeof(int32_t));
+
+  return message_len;
+}
+
+bool yabai_set_socket_path(const char* path) {
+  if (!path || strlen(path) >= sizeof(g_yabai_address.sun_path)) return false;
+
+  memset(&g_yabai_address, 0, sizeof(struct sockaddr_un));
+  g_yabai_address.sun_family = AF_UNIX;
+  strncpy(g_yabai_address.sun_path, path, sizeof(g_yabai_address.sun_path) - 1);
+  g_yabai_address_set = true;
+  return true;
+}
+
+void yabai_set_timeout(int timeout_ms) {
+  g_yabai_timeout_ms = timeout_ms;
+}
+
+int yabai_timeout() {
+  return g_yabai_timeout_ms;
+}
+
+// Every request ends in exactly one of `yabai_request_fail` and
+// `yabai_request_finish`
+static void yabai_request_record(struct yabai_request* request) {
+  stats_yabai(request->command, request->sent, request->response.length,
+              stats_now_ns() - request->started_ns);
+}
+
+static void yabai_request_fail(struct yabai_request* request, const char* error) {
+  if (request->fd != -1) close(request->fd);
+  request->fd = -1;
+  request->error = error;
+  yabai_request_record(request);
+}
+
+bool yabai_request_begin(struct yabai_request* request, const char* command) {
+  *request = (struct yabai_request) { .fd = -1, .started_ns = stats_now_ns() };
+  json_stream_init(&request->response);
+  strncpy(request->command, command, YABAI_STATS_COMMAND - 1);
+
+  if (!g_yabai_address_set) {
+    yabai_request_fail(request, "yabai socket path has not been set");
+    return false;
+  }
+
+  request->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (request->fd == -1) {
+    yabai_request_fail(request, "could not open socket");
+    return false;
+  }
+
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(request->fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+  if (connect(request->fd, (struct sockaddr*)&g_yabai_address,
+                           sizeof(struct sockaddr_un)          ) == -1) {
+    yabai_request_fail(request, "could not connect to yabai");
+    return false;
+  }
+
+  char* message = NULL;
+  uint32_t message_len = generate_message(command, &message);
+  ssize_t sent = send(request->fd, message, message_len, YABAI_SEND_FLAGS);
+  free(message);
+
+  if (sent > 0) request->sent = sent;
+  if (sent != (ssize_t)message_len) {
+    yabai_request_fail(request, "could not send message to yabai");
+    return false;
+  }
+
+  // Only the reads are multiplexed, a message this small always fits in the
+  // socket buffer.
+  fcntl(request->fd, F_SETFL, fcntl(request->fd, F_GETFL) | O_NONBLOCK);
+  return true;
+}
+
+static void yabai_request_finish(struct yabai_request* request) {
+  close(request->fd);
+  request->fd = -1;
+
+  struct json_stream* response = &request->response;
+  if (response->length > 0 && response->buffer[0] == YABAI_FAILURE_MESSAGE)
+    request->error = response->buffer + 1;
+  yabai_request_record(request);
+}
+
+// Returns false once the request is finished, either because the response is
+// complete or because reading failed.
+bool yabai_request_read(struct yabai_request* request) {
+  struct json_stream* response = &request->response;
+  for (;;) {
+    char* space = json_stream_reserve(response, YABAI_RECV_BUFFER);
+    if (!space) {
+      yabai_request_fail(request, "out of memory");
+      return false;
+    }
+
+    ssize_t bytes = recv(request->fd, space, YABAI_RECV_BUFFER, 0);
+
+    if (bytes > 0) {
+      // A short read doesn't mean the response is over, only yabai closing
+      // the connection or the JSON closing its top-level value does.
+      json_stream_commit(response, bytes);
+      if (response->complete) {
+        yabai_request_finish(request);
+        return false;
+      }
+      continue;
+    }
+    if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+    if (bytes == -1 && errno == EINTR) continue;
+
+    if (bytes == -1) yabai_request_fail(request, "could not receive data over socket");
+    else yabai_request_finish(request);
+    return false;
+  }
+}
+
+void yabai_request_expire(struct yabai_request* request) {
+  if (request->fd != -1)
+    yabai_request_fail(request, "timed out waiting for yabai");
+}
+
+void yabai_request_wait(struct yabai_request* requests, uint32_t count) {
+  struct pollfd fds[YABAI_MAX_INFLIGHT];
+  struct yabai_request* pending[YABAI_MAX_INFLIGHT];
+  uint64_t deadline = yabai_now_ms() + g_yabai_timeout_ms;
+
+  for (;;) {
+    uint32_t pending_count = 0;
+    for (uint32_t i = 0; i < count && pending_count < YABAI_MAX_INFLIGHT; i++) {
+      if (requests[i].fd == -1) continue;
+      pending[pending_count] = &requests[i];
+      fds[pending_count++] = (struct pollfd) { requests[i].fd, POLLIN, 0 };
+    }
+    if (pending_count == 0) return;
+
+    uint64_t now = yabai_now_ms();
+    int ready = now < deadline ? poll(fds, pending_count, deadline - now) : 0;
+    if (ready == -1 && errno == EINTR) continue;
+
+    if (ready <= 0) {
+      for (uint32_t i = 0; i < count; i++) yabai_request_expire(&requests[i]);
+      return;
+    }
+
+    for (uint32_t i = 0; i < pending_count; i++) {
+      if (fds[i].revents) yabai_request_read(pending[i]);
+    }
+  }
+}
+
+void yabai_request_free(struct yabai_request* request) {
+  if (request->fd != -1) close(request->fd);
+  json_stream_free(&request->response);
+  *request = (struct yabai_request) { .fd = -1 };
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include "json.h"
+
+#define YABAI_RECV_BUFFER 65536
+#define YABAI_TIMEOUT_MS 1000
+#define YABAI_MAX_INFLIGHT 16
+
+// yabai closing the socket early fails the send instead of raising SIGPIPE
+#ifdef MSG_NOSIGNAL
+#define YABAI_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define YABAI_SEND_FLAGS 0
+#endif
+
+// yabai prefixes error responses with this byte
+#define YABAI_FAILURE_MESSAGE '\x07'
+
+//
+// yabai answers exactly one message per connection and closes the socket
+// once the response has been written, so there's nothing to keep open
+// between queries. What can be shared is the resolved address, and several
+// requests can be in flight on their own connections at the same time.
+//
+// A request is started with `yabai_request_begin` and completed by
+// `yabai_request_wait`. Either can fail, in which case `error` is set and
+// the socket is already closed. A loop polling the socket itself calls
+// `yabai_request_read` whenever it is readable instead, until it returns
+// false, and `yabai_request_expire` once `yabai_timeout` ms passed.
+//
+// The response is read straight into a json stream so it gets scanned while
+// the rest of it is still in flight, `response.buffer` is NUL terminated
+// and owned by the request.
+//
+// Every request is timed from `yabai_request_begin` until it finished or
+// failed and recorded for `stats` under the start of its command.
+//
+#define YABAI_STATS_COMMAND 48
+
+struct yabai_request {
+  int fd;
+  struct json_stream response;
+  const char* error;
+
+  uint64_t started_ns;
+  uint32_t sent;
+  char command[YABAI_STATS_COMMAND];
+};
+
+uint32_t generate_message(const char* command, char** message_buf);
+
+bool yabai_set_socket_path(const char* path);
+void yabai_set_timeout(int timeout_ms);
+int yabai_timeout();
+
+bool yabai_request_begin(struct yabai_request* request, const char* command);
+void yabai_request_wait(struct yabai_request* requests, uint32_t count);
+bool yabai_request_read(struct yabai_request* request);
+void yabai_request_expire(struct yabai_request* request);
+void yabai_request_free(struct yabai_request* request);